@@ -2,10 +2,130 @@
 #define NET_CLIENT
 
 #include "net.h"
+#include "net_session.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
 
 using boost::asio::ip::tcp;
 
 namespace net {
+  // Connection quality derived from echoed pings: smoothed RTT, jitter and a
+  // rolling window of the most recent samples for percentiles.
+  class connection_quality {
+  public:
+    static constexpr std::size_t window_size = 128;
+
+    struct snapshot {
+      std::chrono::microseconds last{ 0 };
+      std::chrono::microseconds smoothed{ 0 };
+      std::chrono::microseconds jitter{ 0 };
+      std::chrono::microseconds min{ 0 };
+      std::chrono::microseconds max{ 0 };
+      std::chrono::microseconds p50{ 0 };
+      std::chrono::microseconds p95{ 0 };
+      uint64_t sent = 0;
+      uint64_t received = 0;
+      uint64_t lost = 0;
+    };
+
+    void on_sent()
+    {
+      std::scoped_lock lock(__mux);
+      __sent++;
+    }
+
+    void on_lost()
+    {
+      std::scoped_lock lock(__mux);
+      __lost++;
+    }
+
+    void add_sample(trace_clock::duration rtt)
+    {
+      std::scoped_lock lock(__mux);
+      auto us = std::chrono::duration_cast<std::chrono::microseconds>(rtt);
+
+      // RFC 6298 smoothing for the RTT and RFC 3550 style inter-arrival jitter
+      if (__received == 0) {
+        __smoothed = us;
+        __min = us;
+        __max = us;
+      }
+      else {
+        auto delta = us - __last;
+        if (delta.count() < 0)
+          delta = -delta;
+        __jitter += (delta - __jitter) / 16;
+        __smoothed += (us - __smoothed) / 8;
+        __min = std::min(__min, us);
+        __max = std::max(__max, us);
+      }
+
+      __last = us;
+      __window[__received % window_size] = us;
+      __received++;
+    }
+
+    snapshot get() const
+    {
+      std::scoped_lock lock(__mux);
+      snapshot snap;
+      snap.last = __last;
+      snap.smoothed = __smoothed;
+      snap.jitter = __jitter;
+      snap.min = __min;
+      snap.max = __max;
+      snap.sent = __sent;
+      snap.received = __received;
+      snap.lost = __lost;
+
+      std::size_t n = static_cast<std::size_t>(std::min<uint64_t>(__received, window_size));
+      if (n) {
+        std::vector<std::chrono::microseconds> sorted(__window.begin(), __window.begin() + n);
+        std::sort(sorted.begin(), sorted.end());
+        snap.p50 = sorted[(n - 1) / 2];
+        snap.p95 = sorted[(n * 95 + 99) / 100 - 1];
+      }
+      return snap;
+    }
+
+  private:
+    mutable std::mutex __mux;
+    std::array<std::chrono::microseconds, window_size> __window{};
+    std::chrono::microseconds __last{ 0 };
+    std::chrono::microseconds __smoothed{ 0 };
+    std::chrono::microseconds __jitter{ 0 };
+    std::chrono::microseconds __min{ 0 };
+    std::chrono::microseconds __max{ 0 };
+    uint64_t __sent = 0;
+    uint64_t __received = 0;
+    uint64_t __lost = 0;
+  };
+
+  // Progress of client_interface::connect()
+  enum class connect_status {
+    idle,
+    resolving,
+    connecting,
+    connected,
+    failed,
+    disconnected
+  };
+
+  inline const char *connect_status_name(connect_status status)
+  {
+    switch (status) {
+    case connect_status::idle: return "Not connected";
+    case connect_status::resolving: return "Resolving...";
+    case connect_status::connecting: return "Connecting...";
+    case connect_status::connected: return "Connected";
+    case connect_status::failed: return "Connection failed";
+    case connect_status::disconnected: return "Disconnected";
+    default: return "?";
+    }
+  }
+
   template <typename T>
   class client_interface {
   public:
@@ -13,25 +133,46 @@ namespace net {
     virtual ~client_interface() { disconnect(); }
 
   public:
-    // connect to server with hostname/ip-address and port
-    bool connect(const std::string &host, const uint16_t port)
+    // connect to server with hostname/ip-address and port. Returns straight
+    // away: name resolution and the connect itself run on the asio thread and
+    // progress is reported through the status callback.
+    bool connect(const std::string &host, const uint16_t port,
+                 std::chrono::milliseconds timeout = std::chrono::seconds(10))
     {
-      try {
-        // Resolve hostname/ip-address into tangiable physical address
-        tcp::resolver resolver(__io_context);
-        tcp::resolver::results_type endpoints = resolver.resolve(host, std::to_string(port));
+      // Start from a clean slate if this client was used before
+      disconnect();
+      __io_context.restart();
 
+      // Coming back after a previous session, which stamp_resume() can pick up
+      __session.on_reconnect();
+
+      try {
         // Create connection
         connect_ptr = std::make_unique<connection<T>>(connection<T>::owner::client, __io_context, tcp::socket(__io_context), __q_messages_in);
 
-        // Tell the connection object to connect to server
-        connect_ptr->connect_to_server(endpoints);
+        // Resolve hostname/ip-address into tangiable physical address, then
+        // tell the connection object to connect to server
+        set_status(connect_status::resolving, {});
+        __resolver.async_resolve(host, std::to_string(port),
+                                 [this, timeout](std::error_code ec, tcp::resolver::results_type endpoints) {
+                                   if (ec == std::errc::operation_canceled)
+                                     return;    // disconnect() cancelled it
+                                   if (ec) {
+                                     set_status(connect_status::failed, ec);
+                                     return;
+                                   }
+
+                                   set_status(connect_status::connecting, {});
+                                   connect_ptr->connect_to_server(endpoints, timeout, [this](std::error_code ec) {
+                                     set_status(ec ? connect_status::failed : connect_status::connected, ec);
+                                   });
+                                 });
 
         // Start Context Thread
         thrContext = std::thread([this]() { __io_context.run(); });
-        std::cerr << "leave connect function\n";
       } catch (std::exception &e) {
-        std::cerr << "Client Exception: " << e.what() << '\n';
+        log_error("Client Exception: ", e.what());
+        set_status(connect_status::failed, {});
         return false;
       }
       return true;
@@ -52,14 +193,40 @@ namespace net {
       if (thrContext.joinable())
         thrContext.join();
 
+      // The connection's handlers hold a plain pointer to it. Cancel what it
+      // still has under way and run those handlers out while it exists, or
+      // the next connect's run() would call them on a destroyed one.
+      __resolver.cancel();
+      if (connect_ptr) {
+        connect_ptr->abandon();
+        __io_context.restart();
+        __io_context.poll();
+      }
+
       // Destroy the connection object
-      connect_ptr.release();
+      connect_ptr.reset();
+      __status.store(connect_status::idle);
+    }
+
+    // Called from the asio thread whenever the connection state changes
+    void set_status_callback(std::function<void(connect_status, std::error_code)> callback)
+    {
+      __status_callback = std::move(callback);
+    }
+
+    connect_status get_status() const
+    {
+      connect_status status = __status.load(std::memory_order_acquire);
+      if (status == connect_status::connected && (!connect_ptr || !connect_ptr->is_connected()))
+        return connect_status::disconnected;
+      return status;
     }
 
     // Check if client is actually connected to a server
     bool is_connected()
     {
-      if (connect_ptr)
+      // The socket belongs to the asio thread until the connect completes
+      if (connect_ptr && __status.load(std::memory_order_acquire) == connect_status::connected)
         return connect_ptr->is_connected();
       else
         return false;
@@ -67,10 +234,101 @@ namespace net {
 
   public:
     // Send message to server
-    void send(const message<T> &msg)
+    void send(const message<T> &msg, priority prio = priority::normal)
     {
       if (is_connected())
-        connect_ptr->send(msg);
+        connect_ptr->send(msg, prio);
+    }
+
+    // Write a sequence number and the monotonic send time into a ping's payload.
+    // The server echoes pings untouched, so the reply carries them back.
+    void stamp_ping(message<T> &msg)
+    {
+      ping_payload payload{};
+      payload.seq = ++__ping_seq;
+      payload.sent_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(trace_clock::now().time_since_epoch()).count();
+      std::memcpy(msg.data.data(), &payload, sizeof(payload));
+      msg.header.size = sizeof(payload);
+
+      // A ping still unanswered when the next one goes out counts as lost
+      if (__ping_outstanding)
+        __quality.on_lost();
+      __ping_outstanding = true;
+      __quality.on_sent();
+    }
+
+    // Feed an echoed ping back, returns false if it was not one of ours
+    bool on_ping_reply(const message<T> &msg)
+    {
+      ping_payload payload{};
+      if (msg.header.size != sizeof(payload))
+        return false;
+      std::memcpy(&payload, msg.data.data(), sizeof(payload));
+      if (payload.seq == 0 || payload.seq > __ping_seq)
+        return false;
+
+      trace_clock::time_point sent{ std::chrono::duration_cast<trace_clock::duration>(std::chrono::nanoseconds(payload.sent_ns)) };
+      __quality.add_sample(trace_clock::now() - sent);
+      if (payload.seq == __ping_seq)
+        __ping_outstanding = false;
+      return true;
+    }
+
+    // RTT, jitter and loss measured from pings so far
+    connection_quality::snapshot get_connection_quality() const
+    {
+      return __quality.get();
+    }
+
+    // Resumable sessions (see net_session.h). As with pings, the application
+    // hands over the frames involved as it takes them from the queue.
+
+    // The current session's ticket, its seq being the newest frame seen
+    const session_ticket &session() const
+    {
+      return __session.ticket();
+    }
+
+    // Carry on a session from an earlier run, e.g. one kept with the room's
+    // history. Only taken up before the first connect.
+    void restore_session(const session_ticket &ticket)
+    {
+      __session.restore(ticket);
+    }
+
+    // A ticket came with the server's accept
+    void on_session_ticket(const message<T> &msg)
+    {
+      session_ticket ticket;
+      if (session_ticket::decode(msg.data, msg.header.size, ticket))
+        __session.on_ticket(ticket);
+    }
+
+    // After reconnecting, ask for what was missed since the previous session.
+    // Returns false, leaving msg alone, if there was no previous session.
+    bool stamp_resume(message<T> &msg)
+    {
+      if (!__session.resume_pending())
+        return false;
+      msg.header.size = static_cast<uint32_t>(__session.ticket().encode(msg.data));
+      return true;
+    }
+
+    // The server's answer to a resume, the missed frames follow it
+    std::optional<resume_result> on_resumed(const message<T> &msg)
+    {
+      resume_result result;
+      if (!__session.resume_pending() || !resume_result::decode(msg.data, msg.header.size, result))
+        return std::nullopt;
+      __session.on_resumed(result);
+      return result;
+    }
+
+    // Feed every frame carrying a sequence number through here. Returns false
+    // for a frame already seen.
+    bool on_sequenced(const message<T> &msg)
+    {
+      return __session.on_sequenced(msg.header.seq);
     }
 
     // Retrieve queue of messages from server
@@ -86,8 +344,35 @@ namespace net {
     std::thread thrContext;
     // The client has a single instance of a "connection" object, which handles data transfer
     std::unique_ptr<connection<T>> connect_ptr;
+    // Resolves the server address without blocking the caller
+    tcp::resolver __resolver{ __io_context };
 
   private:
+    void set_status(connect_status status, std::error_code ec)
+    {
+      __status.store(status, std::memory_order_release);
+      if (__status_callback)
+        __status_callback(status, ec);
+    }
+
+    std::atomic<connect_status> __status{ connect_status::idle };
+    std::function<void(connect_status, std::error_code)> __status_callback;
+
+    // Layout of the timing data carried in a ping's payload
+    struct ping_payload {
+      uint64_t seq;
+      int64_t sent_ns;
+    };
+    static_assert(sizeof(ping_payload) <= sizeof(message<T>::data), "ping payload does not fit");
+
+    connection_quality __quality;
+    uint64_t __ping_seq = 0;
+    bool __ping_outstanding = false;
+
+    // Session and resume bookkeeping, only touched by the thread taking
+    // frames from the queue (and by connect())
+    session_tracker __session;
+
     // This is the thread safe queue of in_comming messages from server
     ts_queue<owned_message<T>> __q_messages_in;
   };
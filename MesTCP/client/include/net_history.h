@@ -0,0 +1,391 @@
+#ifndef NET_HISTORY
+#define NET_HISTORY
+
+#include "net_common.h"
+#include "net_log.h"
+#include "net_session.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string_view>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define NET_HISTORY_MMAP 1
+#elif defined(_WIN32)
+#include <windows.h>
+#define NET_HISTORY_WIN32 1
+#endif
+
+namespace net {
+  // A client's transcript of one server's room, kept on disk between runs.
+  // The file is append-only and read through a memory mapping, so opening it
+  // touches only record headers and showing the newest lines is as cheap as
+  // reading them. Records are 8-aligned, so a file copied to another
+  // machine opens there as well.
+  //
+  //   file   : "MESHIST1" | record ...
+  //   record : u32 size | u32 seq | u64 token | i64 time (ms since epoch)
+  //            | u32 sender | u8 flags | u8 name length | u16 text length
+  //            | name bytes | text bytes | padding
+  //
+  // seq and token are those of the room's stream (see net_session.h); seq is
+  // 0 for lines that were never relayed, e.g. our own. A record that was cut
+  // short by a crash is dropped, with anything after it, on the next open.
+  //
+  // On Windows the mapping is writable and appends go straight into it. A
+  // mapping can't reach past the end of its file there, so the file is grown
+  // ahead of the records in it and cut back to them on close; after a crash
+  // the zeroed tail ends the scan like a torn record would.
+  struct history_entry {
+    uint32_t seq = 0;
+    uint64_t token = 0;
+    int64_t time_ms = 0;
+    uint32_t sender = 0;
+    uint8_t flags = 0;
+    std::string_view name;
+    std::string_view text;
+  };
+
+  constexpr uint8_t history_shown = 0x01;    // was displayed; otherwise it only marks progress
+
+  class history_log {
+  public:
+    static constexpr std::size_t header_bytes = 32;
+    static constexpr char magic[8] = { 'M', 'E', 'S', 'H', 'I', 'S', 'T', '1' };
+
+    history_log() = default;
+    history_log(const history_log &) = delete;
+    history_log &operator=(const history_log &) = delete;
+    ~history_log() { close(); }
+
+    // Open (or create) the log at path and index it. False if it can't be
+    // used, the log then stays closed and appends are ignored.
+    bool open(const std::filesystem::path &path)
+    {
+      close();
+      std::error_code ec;
+      std::filesystem::create_directories(path.parent_path(), ec);
+#ifdef NET_HISTORY_MMAP
+      __fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0600);
+      if (__fd < 0)
+        return false;
+      struct stat st;
+      if (::fstat(__fd, &st) != 0) {
+        close();
+        return false;
+      }
+      __size = static_cast<uint64_t>(st.st_size);
+      if (__size == 0 && ::pwrite(__fd, magic, sizeof(magic), 0) == static_cast<ssize_t>(sizeof(magic)))
+        __size = sizeof(magic);
+      if (!remap(__size)) {
+        close();
+        return false;
+      }
+#elif defined(NET_HISTORY_WIN32)
+      __file = ::CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+      if (__file == INVALID_HANDLE_VALUE)
+        return false;
+      LARGE_INTEGER bytes;
+      if (!::GetFileSizeEx(__file, &bytes) || !remap(static_cast<uint64_t>(bytes.QuadPart))) {
+        close();
+        return false;
+      }
+      __size = static_cast<uint64_t>(bytes.QuadPart);
+      if (__size == 0) {
+        std::memcpy(__map, magic, sizeof(magic));
+        __size = sizeof(magic);
+      }
+#else
+      {
+        std::ifstream in(path, std::ios::binary);
+        __bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+      }
+      if (__bytes.empty())
+        __bytes.assign(magic, magic + sizeof(magic));
+      __size = __bytes.size();
+      __path = path;
+#endif
+      if (__size < sizeof(magic) || std::memcmp(base(), magic, sizeof(magic)) != 0) {
+        close();
+        return false;
+      }
+      scan();
+      return true;
+    }
+
+    void close()
+    {
+#ifdef NET_HISTORY_MMAP
+      if (__map)
+        ::munmap(__map, __mapped);
+      if (__fd >= 0)
+        ::close(__fd);
+      __map = nullptr;
+      __mapped = 0;
+      __fd = -1;
+#elif defined(NET_HISTORY_WIN32)
+      if (__map)
+        ::UnmapViewOfFile(__map);
+      if (__mapping)
+        ::CloseHandle(__mapping);
+      if (__file != INVALID_HANDLE_VALUE) {
+        // Give back the room the mapping grew the file by
+        LARGE_INTEGER end;
+        end.QuadPart = static_cast<LONGLONG>(__size);
+        if (!::SetFilePointerEx(__file, end, nullptr, FILE_BEGIN) || !::SetEndOfFile(__file))
+          log_warning("Could not trim history log");
+        ::CloseHandle(__file);
+      }
+      __map = nullptr;
+      __mapping = nullptr;
+      __mapped = 0;
+      __file = INVALID_HANDLE_VALUE;
+#else
+      __bytes.clear();
+#endif
+      __size = 0;
+      __offsets.clear();
+      __by_seq.clear();
+    }
+
+    bool is_open() const { return __size != 0; }
+    std::size_t size() const { return __offsets.size(); }
+
+    // Record i, oldest first. The views point into the mapping and stay valid
+    // until the next append.
+    history_entry at(std::size_t i) const
+    {
+      const char *p = base() + __offsets[i];
+      history_entry e;
+      e.seq = get_le<uint32_t>(p + 4);
+      e.token = get_le<uint64_t>(p + 8);
+      e.time_ms = get_le<int64_t>(p + 16);
+      e.sender = get_le<uint32_t>(p + 24);
+      e.flags = static_cast<uint8_t>(p[28]);
+      const std::size_t name_bytes = static_cast<uint8_t>(p[29]);
+      const uint16_t text_bytes = get_le<uint16_t>(p + 30);
+      e.name = std::string_view(p + header_bytes, name_bytes);
+      e.text = std::string_view(p + header_bytes + name_bytes, text_bytes);
+      return e;
+    }
+
+    // Add a record at the end. A relayed line that is already in the log
+    // (seen again after a resume) is not added twice.
+    bool append(const history_entry &e)
+    {
+      if (!is_open() || (e.seq && find_seq(e.token, e.seq) != size()))
+        return false;
+      const std::size_t name_bytes = std::min<std::size_t>(e.name.size(), 255);
+      const std::size_t text_bytes = std::min<std::size_t>(e.text.size(), 0xffff);
+      const uint32_t record = static_cast<uint32_t>((header_bytes + name_bytes + text_bytes + 7) & ~std::size_t(7));
+
+      std::vector<char> &buf = __scratch;
+      buf.assign(record, 0);
+      put_le(buf.data(), record);
+      put_le(buf.data() + 4, e.seq);
+      put_le(buf.data() + 8, e.token);
+      put_le(buf.data() + 16, e.time_ms);
+      put_le(buf.data() + 24, e.sender);
+      buf[28] = static_cast<char>(e.flags);
+      buf[29] = static_cast<char>(name_bytes);
+      put_le(buf.data() + 30, static_cast<uint16_t>(text_bytes));
+      if (name_bytes > 0)
+        std::memcpy(buf.data() + header_bytes, e.name.data(), name_bytes);
+      if (text_bytes > 0)
+        std::memcpy(buf.data() + header_bytes + name_bytes, e.text.data(), text_bytes);
+
+#ifdef NET_HISTORY_MMAP
+      // One write per record, so a crash leaves at most one torn record
+      if (::pwrite(__fd, buf.data(), record, static_cast<off_t>(__size)) != static_cast<ssize_t>(record))
+        return false;
+      if (__size + record > __mapped && !remap(__size + record))
+        return false;
+#elif defined(NET_HISTORY_WIN32)
+      if (__size + record > __mapped && !remap(__size + record))
+        return false;
+      // The size goes in last, a record cut short still reads as the end
+      std::memcpy(__map + __size + 4, buf.data() + 4, record - 4);
+      std::memcpy(__map + __size, buf.data(), 4);
+#else
+      std::ofstream out(__path, std::ios::binary | std::ios::app);
+      if (!out.write(buf.data(), record))
+        return false;
+      __bytes.insert(__bytes.end(), buf.begin(), buf.end());
+#endif
+      index(__size, e.token, e.seq);
+      __size += record;
+      return true;
+    }
+
+    // The record for seq in token's stream, or size() if there is none
+    std::size_t find_seq(uint64_t token, uint32_t seq) const
+    {
+      const uint64_t key = seq_key(token, seq);
+      auto it = std::lower_bound(__by_seq.begin(), __by_seq.end(), key, [](const seq_ref &r, uint64_t k) { return r.key < k; });
+      return it != __by_seq.end() && it->key == key ? it->record : size();
+    }
+
+    // The first record received at or after time_ms
+    std::size_t find_time(int64_t time_ms) const
+    {
+      std::size_t lo = 0, hi = size();
+      while (lo < hi) {
+        const std::size_t mid = lo + (hi - lo) / 2;
+        if (get_le<int64_t>(base() + __offsets[mid] + 16) < time_ms)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      return lo;
+    }
+
+    // Ticket to resume the room with: the newest relayed line's stream and
+    // the highest seq seen in it. Empty if nothing was ever relayed.
+    session_ticket last_ticket() const
+    {
+      session_ticket ticket;
+      for (std::size_t i = size(); i-- > 0;) {
+        const history_entry e = at(i);
+        if (!e.seq)
+          continue;
+        ticket.token = e.token;
+        // Replays land after live lines, so the newest record need not hold
+        // the highest seq of its stream
+        const uint64_t stream = e.token >> 32;
+        auto it = std::upper_bound(__by_seq.begin(), __by_seq.end(), seq_key(e.token, UINT32_MAX),
+                                   [](uint64_t k, const seq_ref &r) { return k < r.key; });
+        ticket.seq = it != __by_seq.begin() && (std::prev(it)->key >> 32) == stream ? static_cast<uint32_t>(std::prev(it)->key) : e.seq;
+        break;
+      }
+      return ticket;
+    }
+
+  private:
+    // Relayed lines by stream and seq, in key order
+    struct seq_ref {
+      uint64_t key;
+      std::size_t record;
+    };
+
+    static uint64_t seq_key(uint64_t token, uint32_t seq)
+    {
+      return (token & 0xffffffff00000000ull) | seq;
+    }
+
+    const char *base() const
+    {
+#if defined(NET_HISTORY_MMAP) || defined(NET_HISTORY_WIN32)
+      return static_cast<const char *>(__map);
+#else
+      return __bytes.data();
+#endif
+    }
+
+    void index(uint64_t offset, uint64_t token, uint32_t seq)
+    {
+      if (seq) {
+        // Almost always the newest key, so this is an append
+        const seq_ref ref{ seq_key(token, seq), __offsets.size() };
+        auto it = std::upper_bound(__by_seq.begin(), __by_seq.end(), ref.key, [](uint64_t k, const seq_ref &r) { return k < r.key; });
+        __by_seq.insert(it, ref);
+      }
+      __offsets.push_back(offset);
+    }
+
+    // Index every whole record, cutting the file after the last one
+    void scan()
+    {
+      uint64_t offset = sizeof(magic);
+      while (offset + header_bytes <= __size) {
+        const char *p = base() + offset;
+        const uint32_t record = get_le<uint32_t>(p);
+        const uint16_t text_bytes = get_le<uint16_t>(p + 30);
+        if (record < header_bytes || record % 8 != 0 || offset + record > __size
+            || header_bytes + static_cast<uint8_t>(p[29]) + text_bytes > record)
+          break;
+        index(offset, get_le<uint64_t>(p + 8), get_le<uint32_t>(p + 4));
+        offset += record;
+      }
+      if (offset != __size) {
+#ifdef NET_HISTORY_MMAP
+        if (::ftruncate(__fd, static_cast<off_t>(offset)) != 0)
+          log_warning("Could not trim history log");
+#elif defined(NET_HISTORY_WIN32)
+        // Whatever is past the last whole record must not pass for one once
+        // appends have covered part of it; the file is cut on close
+        std::memset(__map + offset, 0, static_cast<std::size_t>(__size - offset));
+#else
+        __bytes.resize(offset);
+        std::filesystem::resize_file(__path, offset);
+#endif
+        __size = offset;
+      }
+    }
+
+#ifdef NET_HISTORY_MMAP
+    // Map at least bytes, with room to grow: pages past the end of the file
+    // become readable as appends reach them, so most appends need no remap
+    bool remap(uint64_t bytes)
+    {
+      const std::size_t want = std::max<std::size_t>(1 << 20, static_cast<std::size_t>(bytes) * 2);
+      void *map = ::mmap(nullptr, want, PROT_READ, MAP_SHARED, __fd, 0);
+      if (map == MAP_FAILED)
+        return false;
+      if (__map)
+        ::munmap(__map, __mapped);
+      __map = map;
+      __mapped = want;
+      return true;
+    }
+
+    int __fd = -1;
+    void *__map = nullptr;
+    std::size_t __mapped = 0;
+#elif defined(NET_HISTORY_WIN32)
+    // Map at least bytes, with room to grow. Mapping more than the file holds
+    // grows the file, see close() for cutting it back.
+    bool remap(uint64_t bytes)
+    {
+      const uint64_t want = std::max<uint64_t>(1 << 20, bytes * 2);
+      HANDLE mapping = ::CreateFileMappingW(__file, nullptr, PAGE_READWRITE, static_cast<DWORD>(want >> 32),
+                                            static_cast<DWORD>(want), nullptr);
+      if (!mapping)
+        return false;
+      char *map = static_cast<char *>(::MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, static_cast<SIZE_T>(want)));
+      if (!map) {
+        ::CloseHandle(mapping);
+        return false;
+      }
+      if (__map)
+        ::UnmapViewOfFile(__map);
+      if (__mapping)
+        ::CloseHandle(__mapping);
+      __mapping = mapping;
+      __map = map;
+      __mapped = static_cast<std::size_t>(want);
+      return true;
+    }
+
+    HANDLE __file = INVALID_HANDLE_VALUE;
+    HANDLE __mapping = nullptr;
+    char *__map = nullptr;
+    std::size_t __mapped = 0;
+#else
+    std::vector<char> __bytes;
+    std::filesystem::path __path;
+#endif
+    uint64_t __size = 0;
+    std::vector<uint64_t> __offsets;
+    std::vector<seq_ref> __by_seq;
+    std::vector<char> __scratch;
+  };
+}    // namespace net
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef NET_SEARCH
+#define NET_SEARCH
+
+#include "net_common.h"
+#include "net_history.h"
+#include "net_utf8.h"
+#include <string>
+#include <unordered_map>
+
+namespace net {
+  // Full-text search over a history_log. Every distinct token maps to the
+  // records holding it as a posting list: ascending record numbers,
+  // delta-encoded as varints, so an occurrence mostly costs a single byte.
+  // The log only grows at its end, so lists only ever grow at theirs. A
+  // query matches the records that hold all of its tokens.
+
+  // Calls fn(std::string_view) for each token of text: runs of letters and
+  // digits, ASCII and Cyrillic folded to lower case. Other code points past
+  // ASCII count as letters (bar common punctuation), so words of any
+  // script are kept whole.
+  template <typename Fn>
+  void for_each_search_token(std::string_view text, Fn &&fn)
+  {
+    std::string token;
+    auto flush = [&]() {
+      if (!token.empty()) {
+        fn(std::string_view(token));
+        token.clear();
+      }
+    };
+    utf8_for_each(text, [&](char32_t cp) {
+      if (cp < 0x80) {
+        if ((cp >= '0' && cp <= '9') || (cp >= 'a' && cp <= 'z'))
+          token += static_cast<char>(cp);
+        else if (cp >= 'A' && cp <= 'Z')
+          token += static_cast<char>(cp - 'A' + 'a');
+        else
+          flush();
+        return;
+      }
+      if (cp == 0xA0 || cp == 0xAB || cp == 0xBB || cp == utf_replacement || (cp >= 0x2000 && cp <= 0x206F)
+          || (cp >= 0x3000 && cp <= 0x303F)) {
+        flush();
+        return;
+      }
+      if (cp >= 0x410 && cp <= 0x42F)
+        cp += 0x20;
+      else if (cp >= 0x400 && cp <= 0x40F)
+        cp += 0x50;
+      utf8_detail::append_utf8(token, cp);
+    });
+    flush();
+  }
+
+  class search_index {
+  public:
+    // Records of the log taken in so far
+    std::size_t indexed() const { return __next; }
+
+    // Take in what was appended to log since the last call, up to
+    // max_records at a time so a long history can be caught up in steps.
+    // Only lines that were shown have text.
+    void update(const history_log &log, std::size_t max_records = std::numeric_limits<std::size_t>::max())
+    {
+      const std::size_t end = log.size() - __next > max_records ? __next + max_records : log.size();
+      for (; __next < end; ++__next) {
+        const history_entry e = log.at(__next);
+        if (e.flags & history_shown)
+          add(static_cast<uint32_t>(__next), e.text);
+      }
+    }
+
+    // Records holding every token of query, newest first, at most limit
+    std::vector<std::size_t> find(std::string_view query, std::size_t limit = 100) const
+    {
+      std::vector<const posting_list *> lists;
+      bool missing = false;
+      for_each_search_token(query, [&](std::string_view token) {
+        auto it = __terms.find(std::string(token));
+        if (it == __terms.end())
+          missing = true;
+        else
+          lists.push_back(&it->second);
+      });
+      if (missing || lists.empty())
+        return {};
+
+      // Start from the rarest token, every other list can only narrow it
+      std::sort(lists.begin(), lists.end(), [](const posting_list *a, const posting_list *b) { return a->count < b->count; });
+      lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+      std::vector<uint32_t> hits;
+      hits.reserve(lists.front()->count);
+      for (cursor c(*lists.front()); c.valid(); c.next())
+        hits.push_back(c.value());
+
+      std::vector<uint32_t> kept;
+      for (std::size_t i = 1; i < lists.size() && !hits.empty(); ++i) {
+        kept.clear();
+        cursor c(*lists[i]);
+        for (uint32_t hit : hits) {
+          while (c.valid() && c.value() < hit)
+            c.next();
+          if (!c.valid())
+            break;
+          if (c.value() == hit)
+            kept.push_back(hit);
+        }
+        hits.swap(kept);
+      }
+
+      std::vector<std::size_t> found;
+      for (auto hit = hits.rbegin(); hit != hits.rend() && found.size() < limit; ++hit)
+        found.push_back(*hit);
+      return found;
+    }
+
+  private:
+    struct posting_list {
+      std::vector<uint8_t> bytes;
+      uint32_t last = 0;
+      uint32_t count = 0;
+    };
+
+    // Walks a posting list, decoding as it goes
+    class cursor {
+    public:
+      explicit cursor(const posting_list &list)
+          : __p(list.bytes.data()), __end(list.bytes.data() + list.bytes.size())
+      {
+        next();
+      }
+
+      bool valid() const { return __valid; }
+      uint32_t value() const { return __value; }
+
+      void next()
+      {
+        __valid = __p != __end;
+        uint32_t delta = 0;
+        for (int shift = 0; __p != __end; shift += 7) {
+          const uint8_t byte = *__p++;
+          delta |= static_cast<uint32_t>(byte & 0x7f) << shift;
+          if (!(byte & 0x80))
+            break;
+        }
+        __value += delta;
+      }
+
+    private:
+      const uint8_t *__p;
+      const uint8_t *__end;
+      uint32_t __value = 0;
+      bool __valid = false;
+    };
+
+    void add(uint32_t record, std::string_view text)
+    {
+      for_each_search_token(text, [&](std::string_view token) {
+        posting_list &list = __terms[std::string(token)];
+        if (list.count && list.last == record)
+          return;    // said twice in one line
+        uint32_t delta = record - list.last;
+        while (delta >= 0x80) {
+          list.bytes.push_back(static_cast<uint8_t>(delta | 0x80));
+          delta >>= 7;
+        }
+        list.bytes.push_back(static_cast<uint8_t>(delta));
+        list.last = record;
+        list.count++;
+      });
+    }
+
+    std::unordered_map<std::string, posting_list> __terms;
+    std::size_t __next = 0;
+  };
+}    // namespace net
+
+#endif
@@ -1,7 +1,13 @@
+#include "chat_protocol.h"
 #include "net_client.h"
+#include "net_history.h"
+#include "net_search.h"
 #include <queue>
 #include <mutex>
 #include <memory>
+#include <atomic>
+#include <functional>
+#include <thread>
 #include <QApplication>
 #include <QWidget>
 #include <QTextEdit>
@@ -12,23 +18,26 @@
 #include <QTimer>
 #include <QInputDialog>
 #include <QString>
-#include <QListWidget>
+#include <QListView>
+#include <QAbstractListModel>
+#include <QHash>
+#include <QLabel>
 #include <QSet>
+#include <QFileDialog>
+#include <QStandardPaths>
+#include <QDir>
+#include <QDateTime>
+#include <QListWidget>
+#include <QScrollBar>
+#include <QTextCursor>
 // Windows API for detaching console at runtime
 #ifdef _WIN32
 #include <windows.h>
 #endif
 
 namespace user_detail {
-  enum class msg_type : uint32_t {
-    JoinServer,
-    ServerAccept,
-    ServerDeny,
-    ServerPing,
-    MessageAll,
-    ServerMessage,
-    PassString
-  };
+  using chat::msg_type;
+  using chat::protocol;
 
   class Client : public net::client_interface<msg_type> {
   public:
@@ -36,73 +45,650 @@ namespace user_detail {
     {
       net::message<msg_type> msg;
       msg.header.id = msg_type::ServerPing;
-      msg.header.name = user_name;
-      send(msg);
+      stamp_ping(msg);
+      send(msg, net::priority::control);
+    }
+
+    // Pick up where the previous connection left off, if there was one
+    bool resume_session()
+    {
+      net::message<msg_type> msg;
+      msg.header.id = msg_type::ResumeSession;
+      if (!stamp_resume(msg))
+        return false;
+      send(msg, net::priority::control);
+      return true;
     }
 
     void message_all()
     {
       net::message<msg_type> msg;
-      msg.header.id = msg_type::MessageAll;
-      msg.header.name = user_name;
+      protocol::encode<msg_type::MessageAll>(msg, {});
       send(msg);
     }
 
     void join_server()
     {
-      std::cout << "Input Your Name: ";
-      std::wcin.get(user_name.data(), user_name.size());
-      std::wcin.clear();
-      std::wcin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+      std::wcout << L"Input Your Name: " << std::flush;
+      std::wstring name;
+      std::getline(std::wcin, name);
+      net::set_field_text(user_name, net::wide_to_utf8(name));
 
       net::message<msg_type> msg;
-      msg.header.id = msg_type::JoinServer;
-      msg.header.name = user_name;
+      protocol::encode<msg_type::JoinServer>(msg, { net::field_text(user_name) });
       send(msg);
     }
 
     void send_msg(std::wstring &__data)
     {
       net::message<msg_type> msg;
-      msg.header.id = msg_type::PassString;
-      msg.header.name = user_name;
-      for (unsigned int i{}, j{}; j < __data.size(); ++i, ++j)
-        msg.data[i] = __data[j];
+      const std::string text = net::wide_to_utf8(__data);
+      protocol::encode<msg_type::PassString>(msg, { text });
+
+      send(msg);
+    }
+
+    // join using UTF-16 text (for Qt)
+    void join_server_utf16(std::u16string_view name)
+    {
+      net::set_field_text(user_name, net::utf16_to_utf8(name));
+
+      net::message<msg_type> msg;
+      protocol::encode<msg_type::JoinServer>(msg, { net::field_text(user_name) });
+      send(msg);
+    }
+
+    // send using UTF-16 text (for Qt), cut at a character boundary if too long
+    void send_msg_utf16(std::u16string_view __data)
+    {
+      net::message<msg_type> msg;
+      const std::string text = net::utf16_to_utf8(__data);
+      protocol::encode<msg_type::PassString>(msg, { text });
+
+      send(msg);
+    }
+
+    // Share a local file with the room, one upload at a time. Chunks go out
+    // on the bulk lane as far as the window allows and the rest follows as
+    // the server credits them, so chat is never stuck behind the file.
+    bool offer_file(const std::filesystem::path &path)
+    {
+      if (uploading) return false;
+      auto up = std::make_unique<net::upload_stream>();
+      if (!up->open(++last_transfer, path) || up->size() == 0) return false;
+
+      net::message<msg_type> msg;
+      protocol::encode<msg_type::FileOffer>(msg, { up->transfer(), up->size(), path.filename().u8string() });
+      send(msg);
+      uploading = std::move(up);
+      pump_upload();
+      return true;
+    }
+
+    void pump_upload()
+    {
+      if (!uploading) return;
+      net::message<msg_type> msg;
+      while (auto chunk = uploading->next_chunk()) {
+        protocol::encode<msg_type::FileChunk>(msg, *chunk);
+        send(msg, net::priority::bulk);
+      }
+    }
+
+    // Credit for our upload. True once the server has all of it.
+    bool on_upload_credit(const net::message<msg_type> &msg)
+    {
+      net::file_credit credit;
+      if (!uploading || !net::file_credit::decode(msg.data, msg.header.size, credit)) return false;
+      uploading->on_credit(credit);
+      if (uploading->done()) {
+        uploading.reset();
+        return true;
+      }
+      pump_upload();
+      return false;
+    }
+
+    // Download a file the server announced, into path
+    bool fetch_file(uint32_t id, uint64_t size, const std::filesystem::path &path)
+    {
+      if (downloading) return false;
+      auto down = std::make_unique<net::download_stream>();
+      if (!down->open(id, size, path)) return false;
 
+      net::message<msg_type> msg;
+      protocol::encode<msg_type::FileFetch>(msg, { id, 0 });
       send(msg);
+      downloading = std::move(down);
+      return true;
+    }
+
+    // Store a chunk of our download and credit it back. True once complete.
+    bool on_file_chunk(const net::message<msg_type> &msg)
+    {
+      net::file_chunk chunk;
+      if (!downloading || !net::file_chunk::decode(msg.data, msg.header.size, chunk)) return false;
+      net::message<msg_type> reply;
+      if (!downloading->write(chunk)) {
+        protocol::encode<msg_type::FileCancel>(reply, { downloading->transfer() });
+        send(reply, net::priority::control);
+        downloading.reset();
+        return false;
+      }
+      if (auto credit = downloading->credit_due()) {
+        protocol::encode<msg_type::FileCredit>(reply, *credit);
+        send(reply, net::priority::control);
+      }
+      if (!downloading->done()) return false;
+      downloading.reset();
+      return true;
     }
 
-    // join using std::wstring (for Qt)
-    void join_server_from_wstring(const std::wstring &name)
+    // The server refused or gave up on a transfer
+    void on_file_cancel(const net::message<msg_type> &msg)
     {
-      std::fill(user_name.begin(), user_name.end(), L'\0');
-      for (size_t i = 0; i < name.size() && i < user_name.size(); ++i)
-        user_name[i] = name[i];
+      net::file_cancel cancel;
+      if (!net::file_cancel::decode(msg.data, msg.header.size, cancel)) return;
+      if (uploading && uploading->transfer() == cancel.transfer) uploading.reset();
+      if (downloading && downloading->transfer() == cancel.transfer) downloading.reset();
+    }
 
+    // Topic subscriptions (see net_topic.h). The server forgets them with the
+    // connection, so they are kept here and made again after a reconnect.
+    bool subscribe_topic(std::u16string_view pattern)
+    {
+      std::string utf8 = net::utf16_to_utf8(pattern);
+      if (!net::topic_pattern_valid(utf8) || std::find(topics.begin(), topics.end(), utf8) != topics.end()) return false;
       net::message<msg_type> msg;
-      msg.header.id = msg_type::JoinServer;
-      msg.header.name = user_name;
+      protocol::encode<msg_type::Subscribe>(msg, { utf8 });
       send(msg);
+      topics.push_back(std::move(utf8));
+      return true;
     }
 
-    // send using std::wstring (for Qt)
-    void send_msg_w(const std::wstring &__data)
+    bool unsubscribe_topic(std::u16string_view pattern)
     {
+      auto it = std::find(topics.begin(), topics.end(), net::utf16_to_utf8(pattern));
+      if (it == topics.end()) return false;
       net::message<msg_type> msg;
-      msg.header.id = msg_type::PassString;
-      msg.header.name = user_name;
-      std::fill(msg.data.begin(), msg.data.end(), L'\0');
-      for (unsigned int i = 0; i < __data.size() && i < msg.data.size(); ++i)
-        msg.data[i] = __data[i];
+      protocol::encode<msg_type::Unsubscribe>(msg, { *it });
+      send(msg);
+      topics.erase(it);
+      return true;
+    }
+
+    void resubscribe()
+    {
+      for (const std::string &pattern : topics) {
+        net::message<msg_type> msg;
+        protocol::encode<msg_type::Subscribe>(msg, { pattern });
+        send(msg);
+      }
+    }
 
+    bool publish_utf16(std::u16string_view topic, std::u16string_view text)
+    {
+      const std::string topic8 = net::utf16_to_utf8(topic);
+      if (!net::topic_valid(topic8)) return false;
+      net::message<msg_type> msg;
+      protocol::encode<msg_type::Publish>(msg, { topic8, net::utf16_to_utf8(text) });
       send(msg);
+      return true;
     }
 
   public:
-    std::array<wchar_t, 256> user_name{};
+    std::array<char, net::max_name_bytes> user_name{};
+
+  private:
+    std::unique_ptr<net::upload_stream> uploading;
+    std::unique_ptr<net::download_stream> downloading;
+    uint32_t last_transfer = 0;
+    std::vector<std::string> topics;
   };
 }    // namespace user_detail
 
+// Users in the room as announced by the server's presence frames. Rows are
+// indexed by user id so every delta is O(1); a leaving user's row is refilled
+// with the last row instead of shifting everything below it.
+class UserListModel : public QAbstractListModel {
+public:
+  UserListModel(const QSet<QString> &muted, QObject *parent = nullptr)
+      : QAbstractListModel(parent), mutedUsers(muted) {}
+
+  int rowCount(const QModelIndex &parent = QModelIndex()) const override
+  {
+    return parent.isValid() ? 0 : static_cast<int>(rows.size());
+  }
+
+  QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override
+  {
+    if (!index.isValid() || index.row() >= static_cast<int>(rows.size())) return QVariant();
+    const QString &name = rows[index.row()].name;
+    if (role == Qt::DisplayRole)
+      return mutedUsers.contains(name) ? name + " (muted)" : name;
+    if (role == Qt::UserRole)
+      return name;
+    return QVariant();
+  }
+
+  // A whole roster, swapped in at once
+  void reset(const QVector<QPair<quint32, QString>> &users)
+  {
+    beginResetModel();
+    rows.clear();
+    rowById.clear();
+    rows.reserve(users.size());
+    for (const auto &u : users) {
+      if (rowById.contains(u.first)) continue;
+      rowById.insert(u.first, static_cast<int>(rows.size()));
+      rows.push_back({ u.first, u.second });
+    }
+    endResetModel();
+  }
+
+  // Join and rename
+  void upsert(quint32 id, const QString &name)
+  {
+    int row = rowById.value(id, -1);
+    if (row >= 0) {
+      rows[row].name = name;
+      refresh(row);
+      return;
+    }
+    row = static_cast<int>(rows.size());
+    beginInsertRows(QModelIndex(), row, row);
+    rowById.insert(id, row);
+    rows.push_back({ id, name });
+    endInsertRows();
+  }
+
+  void remove(quint32 id)
+  {
+    int row = rowById.value(id, -1);
+    if (row < 0) return;
+    int last = static_cast<int>(rows.size()) - 1;
+    rowById.remove(id);
+    if (row != last) {
+      rows[row] = rows.back();
+      rowById.insert(rows[row].id, row);
+      refresh(row);
+    }
+    beginRemoveRows(QModelIndex(), last, last);
+    rows.pop_back();
+    endRemoveRows();
+  }
+
+  // Repaint one row, e.g. after its user was muted
+  void refresh(int row)
+  {
+    QModelIndex idx = index(row);
+    dataChanged(idx, idx);
+  }
+
+private:
+  struct User {
+    quint32 id;
+    QString name;
+  };
+
+  const QSet<QString> &mutedUsers;
+  QVector<User> rows;
+  QHash<quint32, int> rowById;
+};
+
+// Everything that happens to an incoming frame before the GUI sees it, run on
+// a thread of its own: session, ping and transfer bookkeeping, UTF-8
+// decoding, the exclude / mute filters, sender names, and the history log
+// with its search index. What comes out are records ready to render, handed
+// over in batches, so a busy room costs the GUI thread one insert per batch.
+class InboundStage {
+public:
+  struct Record {
+    enum class Kind { Line, Roster, UserUpsert, UserLeave, FileShared, Quality };
+    Record(Kind kind = Kind::Line, quint32 id = 0, quint64 size = 0) : kind(kind), id(id), size(size) {}
+    Kind kind = Kind::Line;
+    quint32 id = 0;
+    quint64 size = 0;
+    QString text;    // the line as shown, a user's name, or a shared file's name
+    QVector<QPair<quint32, QString>> users;    // a whole roster
+  };
+
+  // client is only touched with clientMux held, which the GUI thread also
+  // takes around its own calls into it
+  InboundStage(user_detail::Client &client, std::mutex &clientMux)
+      : client(client), clientMux(clientMux)
+  {
+    client.get_in_comming().set_doorbell(&bell);
+  }
+
+  ~InboundStage() { stop(); }
+
+  // ready() is called from the worker whenever records start piling up
+  void start(std::function<void()> ready)
+  {
+    notify = std::move(ready);
+    worker = std::thread([this]() { run(); });
+  }
+
+  void stop()
+  {
+    stopping = true;
+    bell.ring();
+    if (worker.joinable()) worker.join();
+  }
+
+  // Everything prepared so far, oldest first
+  std::vector<Record> take()
+  {
+    std::scoped_lock lock(readyMux);
+    std::vector<Record> records;
+    records.swap(prepared);
+    return records;
+  }
+
+  // Who we are and whom we muted, as the filters should see it
+  void setFilter(const QSet<QString> &muted, const QString &me)
+  {
+    std::scoped_lock lock(filterMux);
+    mutedUsers = muted;
+    myName = me;
+  }
+
+  // Open the room's transcript. Returns its last screen of lines and the
+  // ticket to resume the room from.
+  QStringList openHistory(const std::filesystem::path &path, std::size_t screen, net::session_ticket &ticket)
+  {
+    std::scoped_lock lock(historyMux);
+    QStringList lines;
+    if (!history.open(path)) return lines;
+    std::vector<net::history_entry> shown;
+    for (std::size_t i = history.size(); i-- > 0 && shown.size() < screen;) {
+      net::history_entry e = history.at(i);
+      if (e.flags & net::history_shown)
+        shown.push_back(e);
+    }
+    for (auto e = shown.rbegin(); e != shown.rend(); ++e)
+      lines << fromWire(e->name) + ": " + fromWire(e->text);
+    ticket = history.last_ticket();
+    return lines;
+  }
+
+  // Add a line to the transcript. Relayed lines that were not shown are kept
+  // too (without their text) to mark how far the room's stream was read.
+  void remember(uint32_t seq, quint32 sender, const QString &name, const QString &text, bool shown)
+  {
+    const std::string name8 = net::utf16_to_utf8(toWire(name));
+    const std::string text8 = net::utf16_to_utf8(toWire(text));
+    net::history_entry e;
+    e.seq = seq;
+    e.token = seq ? roomToken : 0;
+    e.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    e.sender = sender;
+    if (shown) {
+      e.flags = net::history_shown;
+      e.name = name8;
+      e.text = text8;
+    }
+    std::scoped_lock lock(historyMux);
+    if (history.is_open()) history.append(e);
+  }
+
+  // Newest matches first, formatted for the results list. Only what the
+  // worker has indexed so far is searched, so this never waits on a long
+  // history; partial says whether anything was left out.
+  QStringList search(const QString &query, std::size_t limit, bool &partial)
+  {
+    std::scoped_lock lock(historyMux);
+    QStringList lines;
+    partial = false;
+    if (!history.is_open()) return lines;
+    partial = index.indexed() < history.size();
+    for (std::size_t record : index.find(net::utf16_to_utf8(toWire(query)), limit)) {
+      net::history_entry e = history.at(record);
+      QString when = QDateTime::fromMSecsSinceEpoch(e.time_ms).toString("yyyy-MM-dd hh:mm");
+      lines << QString("[%1] %2: %3").arg(when, fromWire(e.name), fromWire(e.text));
+    }
+    return lines;
+  }
+
+  // Wire text is UTF-8, QString is UTF-16 - both directions go through the
+  // shared (vectorised) transcoder
+  static QString fromWire(std::string_view utf8)
+  {
+    std::u16string u16 = net::utf8_to_utf16(utf8);
+    return QString(reinterpret_cast<const QChar *>(u16.data()), static_cast<int>(u16.size()));
+  }
+
+  static std::u16string_view toWire(const QString &text)
+  {
+    return std::u16string_view(reinterpret_cast<const char16_t *>(text.utf16()), static_cast<std::size_t>(text.size()));
+  }
+
+private:
+  void run()
+  {
+    auto &q = client.get_in_comming();
+    while (!stopping) {
+      // Catching up the search index on a long history keeps us busy,
+      // otherwise sleep until frames arrive
+      bool behind;
+      {
+        std::scoped_lock lock(historyMux);
+        behind = history.is_open() && index.indexed() < history.size();
+      }
+      bell.wait_for(std::chrono::milliseconds(behind ? 0 : 100), [&]() { return stopping || !q.empty(); });
+
+      std::vector<Record> batch;
+      {
+        std::scoped_lock lock(clientMux);
+        for (std::size_t n = 0; n < batchFrames && !q.empty(); ++n) {
+          auto owned = q.pop_front();
+          prepare(*owned.msg, batch);
+        }
+      }
+      {
+        std::scoped_lock lock(historyMux);
+        if (history.is_open()) index.update(history, searchBatch);
+      }
+      if (batch.empty()) continue;
+
+      bool wasEmpty;
+      {
+        std::scoped_lock lock(readyMux);
+        wasEmpty = prepared.empty();
+        std::move(batch.begin(), batch.end(), std::back_inserter(prepared));
+      }
+      if (wasEmpty && notify) notify();
+    }
+  }
+
+  void line(std::vector<Record> &out, QString text)
+  {
+    Record r;
+    r.text = std::move(text);
+    out.push_back(std::move(r));
+  }
+
+  // Frames only carry the sender's id, the name comes from the presence roster
+  QString senderName(quint32 id) const
+  {
+    QString name = names.value(id);
+    return name.isEmpty() ? QString("#%1").arg(id) : name;
+  }
+
+  void prepare(const net::message<user_detail::msg_type> &msg, std::vector<Record> &out)
+  {
+    using user_detail::msg_type;
+    std::string_view wire_data = net::field_text(msg.data);
+    switch (msg.header.id) {
+    case msg_type::ServerAccept: {
+      // Relayed lines on this connection belong to the stream of its ticket
+      net::session_ticket ticket;
+      if (net::session_ticket::decode(msg.data, msg.header.size, ticket))
+        roomToken = ticket.token;
+      client.on_session_ticket(msg);
+      line(out, "Server: Accepted connection");
+      break;
+    }
+    case msg_type::SessionResumed:
+      if (auto result = client.on_resumed(msg)) {
+        if (result->status == net::resume_status::unknown)
+          line(out, "Server: Could not resume, messages sent meanwhile are lost");
+        else if (result->status == net::resume_status::partial)
+          line(out, "Server: Resumed, but some older messages are lost");
+      }
+      break;
+    case msg_type::ServerPing:
+      if (client.on_ping_reply(msg))
+        out.push_back({ Record::Kind::Quality });
+      else
+        line(out, "Server: Ping reply");
+      break;
+    case msg_type::ServerMessage: {
+      // Replayed and live frames overlap after a resume, show each once
+      if (!client.on_sequenced(msg)) break;
+      QString qname = senderName(msg.header.sender), qdata;
+      const bool shown = visibleText(wire_data, qname, qdata);
+      remember(msg.header.seq, msg.header.sender, qname, qdata, shown);
+      if (shown) line(out, qname + ": " + qdata);
+      break;
+    }
+    case msg_type::PassString: {
+      // original sender of passstring (may be irrelevant)
+      QString qname = senderName(msg.header.sender), qdata;
+      if (visibleText(wire_data, qname, qdata)) line(out, qname + ": " + qdata);
+      break;
+    }
+    case msg_type::TopicMessage: {
+      net::topic_message topic;
+      if (!net::topic_message::decode(msg.data, msg.header.size, topic) || !net::utf8_validate(topic.topic)) break;
+      QString qname = senderName(msg.header.sender), qdata;
+      if (visibleText(topic.text, qname, qdata))
+        line(out, QString("[%1] %2: %3").arg(fromWire(topic.topic), qname, qdata));
+      break;
+    }
+    case msg_type::PresenceSnapshot: {
+      // Snapshot frames are collected and handed over at once when the last arrives
+      if (static_cast<uint8_t>(msg.data[0]) & net::presence_snapshot_first) roster.clear();
+      auto flags = net::read_presence_snapshot(msg.data, [&](const net::presence_entry &e) {
+        if (net::utf8_validate(e.name))
+          roster.push_back({ e.id, fromWire(e.name) });
+      });
+      if (flags && (*flags & net::presence_snapshot_last)) {
+        names.clear();
+        for (const auto &user : roster) names.insert(user.first, user.second);
+        Record r{ Record::Kind::Roster };
+        r.users.swap(roster);
+        out.push_back(std::move(r));
+      }
+      break;
+    }
+    case msg_type::PresenceJoin:
+    case msg_type::PresenceRename: {
+      net::presence_entry entry;
+      if (!net::read_presence_entry(msg.data, 0, entry) || !net::utf8_validate(entry.name)) break;
+      Record r{ Record::Kind::UserUpsert, entry.id };
+      r.text = fromWire(entry.name);
+      names.insert(entry.id, r.text);
+      out.push_back(std::move(r));
+      break;
+    }
+    case msg_type::PresenceLeave: {
+      const quint32 id = net::read_presence_id(msg.data);
+      names.remove(id);
+      out.push_back({ Record::Kind::UserLeave, id });
+      break;
+    }
+    case msg_type::FileReady: {
+      net::file_offer offer;
+      if (!net::file_offer::decode(msg.data, msg.header.size, offer) || !net::utf8_validate(offer.name)) break;
+      Record r{ Record::Kind::FileShared, offer.transfer, offer.size };
+      r.text = fromWire(offer.name);
+      line(out, QString("%1 shared %2 (%3 KB), type /get %4 to download")
+                  .arg(senderName(msg.header.sender), r.text)
+                  .arg(offer.size / 1024)
+                  .arg(offer.transfer));
+      out.push_back(std::move(r));
+      break;
+    }
+    // Transfers move on right here, the file I/O never reaches the GUI thread
+    case msg_type::FileCredit:
+      if (client.on_upload_credit(msg))
+        line(out, "Server: File shared");
+      break;
+    case msg_type::FileChunk:
+      if (client.on_file_chunk(msg))
+        line(out, "Server: Download complete");
+      break;
+    case msg_type::FileCancel:
+      client.on_file_cancel(msg);
+      line(out, "Server: Transfer cancelled");
+      break;
+    default:
+      break;
+    }
+  }
+
+  // The text of a relayed line as this user gets to see it, false if it is
+  // not to be shown at all
+  bool visibleText(std::string_view wire_data, const QString &qname, QString &qdata)
+  {
+    // Don't trust the relay, drop anything that is not valid UTF-8
+    if (!net::utf8_validate(wire_data)) return false;
+    qdata = fromWire(wire_data).trimmed();
+    std::scoped_lock lock(filterMux);
+    // If message contains per-message exclude header "/exclude:user1,user2;message"
+    const QString exclPrefix = "/exclude:";
+    if (qdata.startsWith(exclPrefix)) {
+      int sep = qdata.indexOf(';', exclPrefix.length());
+      // malformed header -> ignore entirely
+      if (sep <= 0) return false;
+      QString list = qdata.mid(exclPrefix.length(), sep - exclPrefix.length());
+      QStringList parts = list.split(',', Qt::SkipEmptyParts);
+      for (QString &p : parts) p = p.trimmed();
+      // if I am in the exclude list -> don't show
+      if (parts.contains(myName)) return false;
+      // otherwise strip header and continue with actual message
+      qdata = qdata.mid(sep + 1).trimmed();
+    }
+    // ignore legacy control commands (not shown in chat)
+    if (qdata.startsWith("/block:") || qdata.startsWith("/unblock:") ||
+        qdata.startsWith("/mute:") || qdata.startsWith("/unmute:"))
+      return false;
+    // if sender is muted locally, skip showing
+    return !mutedUsers.contains(qname);
+  }
+
+  static constexpr std::size_t batchFrames = 256;
+  static constexpr std::size_t searchBatch = 20000;
+
+  user_detail::Client &client;
+  std::mutex &clientMux;
+  net::doorbell bell;
+  std::thread worker;
+  std::atomic<bool> stopping{ false };
+  std::function<void()> notify;
+
+  std::mutex readyMux;
+  std::vector<Record> prepared;
+
+  // Copies of the GUI's mute list and name
+  std::mutex filterMux;
+  QSet<QString> mutedUsers;
+  QString myName;
+
+  // Worker only: the roster by id, and the snapshot being assembled
+  QHash<quint32, QString> names;
+  QVector<QPair<quint32, QString>> roster;
+
+  // Transcript on disk, its search index, and the stream relayed lines
+  // currently come from
+  std::mutex historyMux;
+  net::history_log history;
+  net::search_index index;
+  uint64_t roomToken{ 0 };
+};
+
 // Qt chat window (no Q_OBJECT)
 class ChatWindow : public QWidget {
 public:
@@ -112,18 +698,35 @@ public:
     textView->setReadOnly(true);
     input = new QLineEdit(this);
     sendBtn = new QPushButton("Send", this);
-    userList = new QListWidget(this);
+    fileBtn = new QPushButton("File...", this);
+    userModel = new UserListModel(mutedUsers, this);
+    userList = new QListView(this);
+    userList->setModel(userModel);
+    userList->setUniformItemSizes(true);    // keeps a 20k user list cheap to lay out
     userList->setMaximumWidth(180);
 
     // input + send horizontal
     auto *h = new QHBoxLayout();
     h->addWidget(input);
     h->addWidget(sendBtn);
+    h->addWidget(fileBtn);
+
+    statusLabel = new QLabel(this);
 
-    // left: chat (text + input), right: users
+    // History search, results only shown while there is a query
+    searchBox = new QLineEdit(this);
+    searchBox->setPlaceholderText("Search history");
+    searchResults = new QListWidget(this);
+    searchResults->setMaximumHeight(150);
+    searchResults->hide();
+
+    // left: search, chat (text + input + status), right: users
     auto *leftV = new QVBoxLayout();
+    leftV->addWidget(searchBox);
+    leftV->addWidget(searchResults);
     leftV->addWidget(textView);
     leftV->addLayout(h);
+    leftV->addWidget(statusLabel);
 
     auto *mainH = new QHBoxLayout(this);
     mainH->addLayout(leftV);
@@ -133,12 +736,72 @@ public:
 
     // Network client
     client = std::make_unique<user_detail::Client>();
+    // Connection progress arrives on the asio thread, hop over to the GUI thread
+    client->set_status_callback([this](net::connect_status status, std::error_code ec) {
+      QString text = net::connect_status_name(status);
+      if (ec)
+        text += QString(": ") + QString::fromStdString(ec.message());
+      QMetaObject::invokeMethod(this, [this, status, text]() { onConnectStatus(status, text); }, Qt::QueuedConnection);
+    });
+    statusLabel->setText(net::connect_status_name(net::connect_status::idle));
+    // Incoming frames are prepared off the GUI thread, which only gets to
+    // render them, a batch at a time
+    inbound = std::make_unique<InboundStage>(*client, clientMux);
+    inbound->start([this]() { QMetaObject::invokeMethod(this, [this]() { applyInbound(); }, Qt::QueuedConnection); });
+
+    connect(sendBtn, &QPushButton::clicked, [this]() { onSend(); });
+    connect(input, &QLineEdit::returnPressed, [this]() { onSend(); });
+    connect(fileBtn, &QPushButton::clicked, [this]() { onShareFile(); });
+    connect(searchBox, &QLineEdit::returnPressed, [this]() { onSearch(); });
+    connect(userList, &QListView::clicked, [this](const QModelIndex &index){
+      if(!index.isValid()) return;
+      toggleMuteForUser(userModel->data(index, Qt::UserRole).toString());
+      userModel->refresh(index.row());
+    });
+
+    // Periodic pings feed the RTT/jitter statistics shown in the status line
+    pingTimer = new QTimer(this);
+    connect(pingTimer, &QTimer::timeout, [this]() {
+      if (client && client->is_connected()) {
+        std::scoped_lock lock(clientMux);
+        client->ping_server();
+      }
+      else if (client && reconnectDue())
+        reconnect();
+      updateStatus();
+    });
+    pingTimer->start(2000);
+
+    // Show the window first, ask for server and name once it is up
+    QTimer::singleShot(0, this, [this]() { startSession(); });
+  }
+
+  ~ChatWindow() override
+  {
+    // The stage goes first, it uses the client
+    if (inbound) inbound->stop();
+    if (client) client->disconnect();
+  }
+
+private:
+  // helper to get my name from client
+  QString myName() const {
+    if(!client) return QString();
+    return InboundStage::fromWire(net::field_text(client->user_name));
+  }
+
+  void startSession()
+  {
     // Ask for server address (default localhost). This allows connecting to a server on another machine in the same LAN.
+    bool okHost = false;
+    QString host = QInputDialog::getText(this, "Server", "Server IP or hostname:", QLineEdit::Normal, QString("127.0.0.1"), &okHost);
+    if (!okHost || host.isEmpty())
+      host = QString("127.0.0.1");
+    // Non-blocking, the name dialog below runs while we connect
+    serverHost = host;
+    openHistory(host);
     {
-      bool okHost = false;
-      QString host = QInputDialog::getText(this, "Server", "Server IP or hostname:", QLineEdit::Normal, QString("127.0.0.1"), &okHost);
-      if (!okHost || host.isEmpty())
-        host = QString("127.0.0.1");
+      std::scoped_lock lock(clientMux);
       client->connect(host.toStdString(), 9030);
     }
 
@@ -147,54 +810,88 @@ public:
     QString qname = QInputDialog::getText(this, "Name", "Enter your name:", QLineEdit::Normal, QString(), &ok);
     if (!ok || qname.isEmpty())
       qname = QString("User");
-    client->join_server_from_wstring(qname.toStdWString());
+    joinName = qname;
+    wantConnected = true;
+    joinIfReady();
+  }
 
-    connect(sendBtn, &QPushButton::clicked, [this]() { onSend(); });
-    connect(input, &QLineEdit::returnPressed, [this]() { onSend(); });
-    connect(userList, &QListWidget::itemClicked, [this](QListWidgetItem *it){
-      if(!it) return;
-      QString name = it->data(Qt::UserRole).toString();
-      if(name.isEmpty()) name = it->text();
-      toggleMuteForUser(name);
-    });
+  // Join once we have both a name and a live connection, whichever comes last.
+  // Back after a dropped connection (or a restart), then ask for what was
+  // missed meanwhile: it arrives after the roster, so it comes with names.
+  void joinIfReady()
+  {
+    if (joined || joinName.isEmpty() || !client->is_connected()) return;
+    {
+      std::scoped_lock lock(clientMux);
+      client->join_server_utf16(InboundStage::toWire(joinName));
+      client->resubscribe();
+      client->resume_session();
+    }
+    joined = true;
+    inbound->setFilter(mutedUsers, myName());
+  }
 
-    pollTimer = new QTimer(this);
-    connect(pollTimer, &QTimer::timeout, [this]() { pollIncoming(); });
-    pollTimer->start(50);
+  // The room's transcript from earlier runs, one file per server. Its last
+  // screen is shown straight away, and the session resumes from its newest
+  // line so the server only sends what came after.
+  void openHistory(const QString &host)
+  {
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation);
+    QString name = QString(host).replace(':', '_') + "_9030.mlog";
+    net::session_ticket ticket;
+    appendLines(inbound->openHistory(std::filesystem::u8path(QDir(dir).filePath("history/" + name).toStdString()), historyScreen, ticket));
+    std::scoped_lock lock(clientMux);
+    client->restore_session(ticket);
   }
 
-  ~ChatWindow() override
+  // Once the user is in, a lost or failed connection is dialled again,
+  // waiting twice as long after each attempt that doesn't get through
+  bool reconnectDue() const
   {
-    if (client) client->disconnect();
+    if (!wantConnected) return false;
+    const net::connect_status status = client->get_status();
+    return (status == net::connect_status::disconnected || status == net::connect_status::failed)
+           && std::chrono::steady_clock::now() >= nextReconnect;
   }
 
-private:
-  // helper to get my name from client
-  QString myName() const {
-    if(!client) return QString();
-    std::wstring wn(client->user_name.data());
-    return QString::fromStdWString(wn);
+  // Dial again; joined is cleared so the join (and the resume) goes out once
+  // the connection is up
+  void reconnect()
+  {
+    if (reconnectDelay == reconnectDelayMin)
+      textView->append("Server: Connection lost, reconnecting...");
+    nextReconnect = std::chrono::steady_clock::now() + reconnectDelay;
+    reconnectDelay = std::min(reconnectDelay * 2, reconnectDelayMax);
+    joined = false;
+    std::scoped_lock lock(clientMux);
+    client->connect(serverHost.toStdString(), 9030);
   }
 
-  void addOrRefreshUser(const QString &name) {
-    if (name.isEmpty()) return;
-    // find by stored user role
-    for (int i = 0; i < userList->count(); ++i) {
-      auto *it = userList->item(i);
-      if (it->data(Qt::UserRole).toString() == name) {
-        // update text to show muted flag
-        QString display = name;
-        if (mutedUsers.contains(name)) display += " (muted)";
-        it->setText(display);
-        return;
-      }
+  void onConnectStatus(net::connect_status status, const QString &text)
+  {
+    statusLabel->setText(text);
+    if (status == net::connect_status::failed)
+      textView->append("Server: " + text);
+    if (status == net::connect_status::connected) {
+      reconnectDelay = reconnectDelayMin;
+      joinIfReady();
     }
-    // new
-    QString display = name;
-    if (mutedUsers.contains(name)) display += " (muted)";
-    auto *it = new QListWidgetItem(display);
-    it->setData(Qt::UserRole, name);
-    userList->addItem(it);
+  }
+
+  void updateStatus()
+  {
+    if (!client) return;
+    auto q = client->get_connection_quality();
+    if (!client->is_connected() || q.received == 0) {
+      net::connect_status status = client->get_status();
+      statusLabel->setText(status == net::connect_status::connected ? "Connected, measuring latency..." : net::connect_status_name(status));
+      return;
+    }
+    auto ms = [](std::chrono::microseconds us) { return QString::number(us.count() / 1000.0, 'f', 1); };
+    double loss = q.sent ? 100.0 * double(q.lost) / double(q.sent) : 0.0;
+    statusLabel->setText(QString("RTT %1 ms (avg %2, p50 %3, p95 %4, min %5, max %6)  jitter %7 ms  loss %8%")
+                           .arg(ms(q.last), ms(q.smoothed), ms(q.p50), ms(q.p95), ms(q.min), ms(q.max), ms(q.jitter))
+                           .arg(loss, 0, 'f', 1));
   }
 
   void toggleMuteForUser(const QString &name) {
@@ -209,15 +906,100 @@ private:
       mutedUsers.insert(name);
       nowMuted = true;
     }
-    addOrRefreshUser(name);
+    inbound->setFilter(mutedUsers, me);
     // NOTE: mute is local-only. To stop this client's messages reaching muted users,
     // we will mark outgoing messages with a per-message exclude list (handled in onSend).
   }
 
+  // Newest matches first; an empty query hides the results again
+  void onSearch()
+  {
+    searchResults->clear();
+    const QString query = searchBox->text();
+    if (query.trimmed().isEmpty()) {
+      searchResults->hide();
+      return;
+    }
+    bool partial = false;
+    for (const QString &line : inbound->search(query, 200, partial))
+      searchResults->addItem(line);
+    if (searchResults->count() == 0)
+      searchResults->addItem("No matches");
+    if (partial)
+      searchResults->addItem("Still indexing history, results may be incomplete");
+    searchResults->show();
+  }
+
+  void onShareFile()
+  {
+    QString path = QFileDialog::getOpenFileName(this, "Share file");
+    if (path.isEmpty()) return;
+    std::scoped_lock lock(clientMux);
+    if (!client->offer_file(std::filesystem::u8path(path.toStdString())))
+      textView->append("Server: Can't share that file now");
+    else
+      textView->append(QString("Me: Sharing %1...").arg(path));
+  }
+
+  // "/get <id>" downloads a file someone shared
+  void fetchFile(const QString &arg)
+  {
+    bool ok = false;
+    quint32 id = arg.trimmed().toUInt(&ok);
+    auto file = sharedFiles.find(id);
+    if (!ok || file == sharedFiles.end()) {
+      textView->append("Server: No such file");
+      return;
+    }
+    QString path = QFileDialog::getSaveFileName(this, "Save file", file->name);
+    if (path.isEmpty()) return;
+    std::scoped_lock lock(clientMux);
+    if (!client->fetch_file(id, file->size, std::filesystem::u8path(path.toStdString())))
+      textView->append("Server: Can't download now");
+    else
+      textView->append(QString("Me: Downloading %1...").arg(file->name));
+  }
+
+  // "/sub pattern", "/unsub pattern" and "/pub topic text", where patterns
+  // may use * for one level and # for the rest, e.g. alerts.*.critical
+  void topicCommand(const QString &txt)
+  {
+    const QString command = txt.section(' ', 0, 0);
+    const QString topic = txt.section(' ', 1, 1, QString::SectionSkipEmpty);
+    const QString text = txt.section(' ', 2, -1, QString::SectionSkipEmpty);
+    std::scoped_lock lock(clientMux);
+    if (command == "/sub") {
+      if (client->subscribe_topic(InboundStage::toWire(topic)))
+        textView->append(QString("Me: Subscribed to %1").arg(topic));
+      else
+        textView->append("Server: Not a topic pattern, or already subscribed");
+    }
+    else if (command == "/unsub") {
+      if (client->unsubscribe_topic(InboundStage::toWire(topic)))
+        textView->append(QString("Me: Unsubscribed from %1").arg(topic));
+      else
+        textView->append("Server: Not subscribed to that");
+    }
+    else if (text.isEmpty() || !client->publish_utf16(InboundStage::toWire(topic), InboundStage::toWire(text)))
+      textView->append("Server: Usage is /pub topic.name text");
+    else
+      textView->append(QString("Me: [%1] %2").arg(topic, text));
+  }
+
   void onSend()
   {
     QString txt = input->text();
     if (txt.isEmpty()) return;
+    if (txt.startsWith("/get ")) {
+      fetchFile(txt.mid(5));
+      input->clear();
+      return;
+    }
+    if (txt.startsWith("/sub ") || txt.startsWith("/unsub ") || txt.startsWith("/pub ")) {
+      topicCommand(txt);
+      input->clear();
+      return;
+    }
     // Показываем собственное сообщение локально
     textView->append(QString("Me: %1").arg(txt));
     // If we have locally muted users, add an exclude header so those users ignore this message.
@@ -227,110 +1009,97 @@ private:
       for (const QString &u : mutedUsers) excl << u;
       payload = QString("/exclude:%1;%2").arg(excl.join(',')).arg(txt);
     }
-    client->send_msg_w(payload.toStdWString());
+    {
+      std::scoped_lock lock(clientMux);
+      client->send_msg_utf16(InboundStage::toWire(payload));
+    }
+    inbound->remember(0, 0, myName(), txt, true);
     input->clear();
   }
 
-  void pollIncoming()
+  // Render what the stage has prepared since the last call
+  void applyInbound()
   {
-    if (!client) return;
-    auto &q = client->get_in_comming();
-    while (!q.empty()) {
-      auto owned = q.pop_front();
-      auto &msg = owned.msg;
-      switch (msg.header.id) {
-      case user_detail::msg_type::ServerAccept:
-        textView->append("Server: Accepted connection");
+    using Kind = InboundStage::Record::Kind;
+    QStringList lines;
+    bool quality = false;
+    for (InboundStage::Record &r : inbound->take()) {
+      switch (r.kind) {
+      case Kind::Line:
+        lines << r.text;
         break;
-      case user_detail::msg_type::ServerPing:
-        textView->append("Server: Ping reply");
+      case Kind::Roster:
+        userModel->reset(r.users);
         break;
-      case user_detail::msg_type::ServerMessage: {
-         std::wstring wname(msg.header.name.data());
-         std::wstring wdata(msg.data.data());
-         QString qname = QString::fromStdWString(wname);
-         QString qdata = QString::fromStdWString(wdata).trimmed();
-         // If message contains per-message exclude header "/exclude:user1,user2;message"
-         const QString exclPrefix = "/exclude:";
-         if (qdata.startsWith(exclPrefix)) {
-           int sep = qdata.indexOf(';', exclPrefix.length());
-           if (sep > 0) {
-             QString list = qdata.mid(exclPrefix.length(), sep - exclPrefix.length());
-             QStringList parts = list.split(',', Qt::SkipEmptyParts);
-             for (QString &p : parts) p = p.trimmed();
-             // update user list even if message is excluded
-             addOrRefreshUser(qname);
-             // if I am in the exclude list -> don't show
-             if (parts.contains(myName())) break;
-             // otherwise strip header and continue with actual message
-             qdata = qdata.mid(sep + 1).trimmed();
-           } else {
-             // malformed header -> ignore entirely
-             break;
-           }
-         }
-         // ignore legacy control commands (not shown in chat)
-         if (qdata.startsWith("/block:") || qdata.startsWith("/unblock:") ||
-             qdata.startsWith("/mute:") || qdata.startsWith("/unmute:")) {
-           break;
-         }
-         // update user list
-         addOrRefreshUser(qname);
-         // if sender is muted locally, skip showing
-         if (mutedUsers.contains(qname)) break;
-         QString line = qname + ": " + qdata;
-         textView->append(line);
-         break;
-       }
-      case user_detail::msg_type::PassString: {
-        std::wstring wname(msg.header.name.data()); // original sender of passstring (may be irrelevant)
-        std::wstring wdata(msg.data.data());
-        QString qdata = QString::fromStdWString(wdata).trimmed();
-        // If PassString contains per-message exclude header, process same as ServerMessage
-        const QString exclPrefix2 = "/exclude:";
-        if (qdata.startsWith(exclPrefix2)) {
-          int sep = qdata.indexOf(';', exclPrefix2.length());
-          if (sep > 0) {
-            QString list = qdata.mid(exclPrefix2.length(), sep - exclPrefix2.length());
-            QStringList parts = list.split(',', Qt::SkipEmptyParts);
-            for (QString &p : parts) p = p.trimmed();
-            QString qname = QString::fromStdWString(wname);
-            addOrRefreshUser(qname);
-            if (parts.contains(myName())) break;
-            qdata = qdata.mid(sep + 1).trimmed();
-            if (!mutedUsers.contains(qname)) textView->append(qname + ": " + qdata);
-          }
-          // malformed -> ignore
-          break;
-        }
-        // ignore legacy control commands
-        if (qdata.startsWith("/block:") || qdata.startsWith("/unblock:") ||
-            qdata.startsWith("/mute:") || qdata.startsWith("/unmute:")) {
-          break;
-        }
-        // plain pass string
-        {
-          QString qname = QString::fromStdWString(wname);
-          addOrRefreshUser(qname);
-          if (!mutedUsers.contains(qname)) {
-            textView->append(qname + ": " + qdata);
-          }
-        }
+      case Kind::UserUpsert:
+        userModel->upsert(r.id, r.text);
         break;
-       }
-      default:
+      case Kind::UserLeave:
+        userModel->remove(r.id);
+        break;
+      case Kind::FileShared:
+        sharedFiles.insert(r.id, { r.text, r.size });
+        break;
+      case Kind::Quality:
+        quality = true;
         break;
       }
     }
+    appendLines(lines);
+    if (quality) updateStatus();
+  }
+
+  // One edit for the whole batch instead of a relayout per line. The view
+  // only follows the new lines if it was scrolled to the bottom.
+  void appendLines(const QStringList &lines)
+  {
+    if (lines.isEmpty()) return;
+    QScrollBar *bar = textView->verticalScrollBar();
+    const bool atBottom = bar->value() == bar->maximum();
+    QTextCursor cursor(textView->document());
+    cursor.movePosition(QTextCursor::End);
+    cursor.beginEditBlock();
+    for (const QString &line : lines) {
+      if (!textView->document()->isEmpty()) cursor.insertBlock();
+      cursor.insertText(line);
+    }
+    cursor.endEditBlock();
+    if (atBottom) bar->setValue(bar->maximum());
   }
 
   QTextEdit *textView{nullptr};
   QLineEdit *input{nullptr};
   QPushButton *sendBtn{nullptr};
-  QListWidget *userList{nullptr};
+  QPushButton *fileBtn{nullptr};
+  QListView *userList{nullptr};
+  UserListModel *userModel{nullptr};
   QSet<QString> mutedUsers;
-  QTimer *pollTimer{nullptr};
+  QLabel *statusLabel{nullptr};
+  QTimer *pingTimer{nullptr};
+  QString serverHost;
+  QString joinName;
+  // Set once a name is entered: from then on the connection is kept up
+  bool wantConnected{false};
+  // The join went out on the current connection
+  bool joined{false};
+  static constexpr std::chrono::seconds reconnectDelayMin{ 2 };
+  static constexpr std::chrono::seconds reconnectDelayMax{ 32 };
+  std::chrono::seconds reconnectDelay{ reconnectDelayMin };
+  std::chrono::steady_clock::time_point nextReconnect{};
+  // Files announced to the room, by their id on the server
+  struct SharedFile {
+    QString name;
+    quint64 size;
+  };
+  QHash<quint32, SharedFile> sharedFiles;
+  // Lines of the transcript shown on start
+  static constexpr std::size_t historyScreen = 200;
+  QLineEdit *searchBox{nullptr};
+  QListWidget *searchResults{nullptr};
   std::unique_ptr<user_detail::Client> client;
+  // Held around every call into client, the stage calls into it too
+  std::mutex clientMux;
+  std::unique_ptr<InboundStage> inbound;
 };
 
 // main
@@ -0,0 +1,147 @@
+#ifndef CHAT_PROTOCOL
+#define CHAT_PROTOCOL
+
+#include "net_common.h"
+#include "net_message.h"
+#include "net_presence.h"
+#include "net_registry.h"
+#include "net_session.h"
+#include "net_topic.h"
+#include "net_transfer.h"
+
+// The chat protocol spoken by the server, its clients and its peers: every
+// message type and the payload its frames carry. Frames are only as long as
+// their payload, and connections drop anything not listed here (or larger
+// than its type allows) before borrowing a buffer for it.
+namespace chat {
+  enum class msg_type : uint32_t {
+    JoinServer,
+    ServerAccept,
+    ServerDeny,
+    ServerPing,
+    MessageAll,
+    ServerMessage,
+    PassString,
+    PresenceSnapshot,
+    PresenceJoin,
+    PresenceLeave,
+    PresenceRename,
+    PeerHello,
+    ResumeSession,
+    SessionResumed,
+    FileOffer,
+    FileChunk,
+    FileCredit,
+    FileReady,
+    FileFetch,
+    FileCancel,
+    Subscribe,
+    Unsubscribe,
+    Publish,
+    TopicMessage
+  };
+
+  // Sequence number and send time, written and read by client_interface
+  using ping_payload = net::bytes_payload<16>;
+
+  // File sharing (see net_transfer.h). An upload is a FileOffer followed by
+  // FileChunks, credited back by the server with FileCredit. Once complete
+  // the server announces it to the room with FileReady, carrying the file's
+  // id on the server; a FileFetch for that id (from offset) streams it back
+  // the same way, credited by the downloader. FileCancel ends either early.
+
+  // Topics (see net_topic.h). A client subscribes to patterns and publishes
+  // to a topic; the server relays each Publish as a TopicMessage, tagged with
+  // the sender, to the clients subscribed to a matching pattern and to its
+  // peers, which do the same for theirs. Topic traffic is not part of the
+  // room's stream and is not replayed on resume.
+  using topic_pattern_payload = net::text_payload<net::topic_max_bytes + 1>;
+
+  // One user on the roster (join / rename), see net_presence.h
+  struct presence_entry_payload {
+    static constexpr std::size_t max_size = 5 + net::presence_max_name;
+    net::presence_entry entry;
+
+    std::size_t encode(std::array<char, net::max_text_bytes> &data) const
+    {
+      return net::write_presence_entry(data, 0, entry);
+    }
+
+    static bool decode(const std::array<char, net::max_text_bytes> &data, std::size_t size, presence_entry_payload &out)
+    {
+      const std::size_t end = net::read_presence_entry(data, 0, out.entry);
+      return end != 0 && end <= size;
+    }
+  };
+
+  // A user leaving
+  struct presence_id_payload {
+    static constexpr std::size_t max_size = 4;
+    uint32_t id = 0;
+
+    std::size_t encode(std::array<char, net::max_text_bytes> &data) const
+    {
+      net::write_presence_id(data, id);
+      return max_size;
+    }
+
+    static bool decode(const std::array<char, net::max_text_bytes> &data, std::size_t size, presence_id_payload &out)
+    {
+      out.id = net::read_presence_id(data);
+      return size == max_size;
+    }
+  };
+
+  // A server introducing itself to a peer
+  struct hello_payload {
+    static constexpr std::size_t max_size = 1;
+    uint8_t node = 0;
+
+    std::size_t encode(std::array<char, net::max_text_bytes> &data) const
+    {
+      data[0] = static_cast<char>(node);
+      return max_size;
+    }
+
+    static bool decode(const std::array<char, net::max_text_bytes> &data, std::size_t size, hello_payload &out)
+    {
+      out.node = static_cast<uint8_t>(data[0]);
+      return size == max_size;
+    }
+  };
+
+  using protocol = net::message_registry<
+    net::message_spec<msg_type::JoinServer, net::text_payload<net::max_name_bytes>>,
+    net::message_spec<msg_type::ServerAccept, net::session_ticket>,
+    net::message_spec<msg_type::ServerDeny, net::empty_payload>,
+    net::message_spec<msg_type::ServerPing, ping_payload>,
+    net::message_spec<msg_type::MessageAll, net::empty_payload>,
+    net::message_spec<msg_type::ServerMessage, net::text_payload<net::max_text_bytes>>,
+    net::message_spec<msg_type::PassString, net::text_payload<net::max_text_bytes>>,
+    net::message_spec<msg_type::PresenceSnapshot, net::bytes_payload<net::max_text_bytes>>,
+    net::message_spec<msg_type::PresenceJoin, presence_entry_payload>,
+    net::message_spec<msg_type::PresenceLeave, presence_id_payload>,
+    net::message_spec<msg_type::PresenceRename, presence_entry_payload>,
+    net::message_spec<msg_type::PeerHello, hello_payload>,
+    net::message_spec<msg_type::ResumeSession, net::session_ticket>,
+    net::message_spec<msg_type::SessionResumed, net::resume_result>,
+    net::message_spec<msg_type::FileOffer, net::file_offer>,
+    net::message_spec<msg_type::FileChunk, net::file_chunk>,
+    net::message_spec<msg_type::FileCredit, net::file_credit>,
+    net::message_spec<msg_type::FileReady, net::file_offer>,
+    net::message_spec<msg_type::FileFetch, net::file_credit>,
+    net::message_spec<msg_type::FileCancel, net::file_cancel>,
+    net::message_spec<msg_type::Subscribe, topic_pattern_payload>,
+    net::message_spec<msg_type::Unsubscribe, topic_pattern_payload>,
+    net::message_spec<msg_type::Publish, net::topic_message>,
+    net::message_spec<msg_type::TopicMessage, net::topic_message>>;
+}    // namespace chat
+
+namespace net {
+  template <>
+  struct registry_of<chat::msg_type> {
+    using type = chat::protocol;
+  };
+}    // namespace net
+
+#endif
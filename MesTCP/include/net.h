@@ -2,7 +2,13 @@
 #define NET_HPP
 
 #include "net_common.h"
+#include "net_log.h"
+#include "net_trace.h"
+#include "net_utf8.h"
+#include "net_capture.h"
+#include "net_pool.h"
 #include "net_message.h"
+#include "net_presence.h"
 #include "net_queue.h"
 #include "net_connection.h"
 
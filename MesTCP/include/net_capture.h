@@ -0,0 +1,208 @@
+#ifndef NET_CAPTURE
+#define NET_CAPTURE
+
+#include "net_common.h"
+#include "net_log.h"
+#include "net_message.h"
+#include "net_trace.h"
+#include <atomic>
+#include <cstring>
+#include <fstream>
+
+namespace net {
+  // Binary traffic capture: a file header followed by one record per inbound
+  // frame, nothing padded. The headers are little-endian; a record body is
+  // the frame exactly as it arrived.
+  //
+  //   file header   : magic "MTCP" | u16 version | u16 reserved | u32 max frame size | i64 start (unix ns)
+  //   record header : u64 offset from start (ns) | u32 connection id | u32 length
+  //   record body   : `length` raw frame bytes, header plus payload
+  //
+  // Version 2 records variable-length frames; version 1 frames were all
+  // frame size bytes long.
+  constexpr char capture_magic[4] = { 'M', 'T', 'C', 'P' };
+  constexpr uint16_t capture_version = 2;
+
+  struct capture_file_header {
+    static constexpr std::size_t size = 20;
+    char magic[4];
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t frame_size;
+    int64_t start_unix_ns;
+
+    void encode(char *out) const
+    {
+      std::memcpy(out, magic, 4);
+      put_le(out + 4, version);
+      put_le(out + 6, reserved);
+      put_le(out + 8, frame_size);
+      put_le(out + 12, start_unix_ns);
+    }
+
+    void decode(const char *in)
+    {
+      std::memcpy(magic, in, 4);
+      version = get_le<uint16_t>(in + 4);
+      reserved = get_le<uint16_t>(in + 6);
+      frame_size = get_le<uint32_t>(in + 8);
+      start_unix_ns = get_le<int64_t>(in + 12);
+    }
+  };
+
+  struct capture_record_header {
+    static constexpr std::size_t size = 16;
+    uint64_t offset_ns;
+    uint32_t connection_id;
+    uint32_t length;
+
+    void encode(char *out) const
+    {
+      put_le(out, offset_ns);
+      put_le(out + 8, connection_id);
+      put_le(out + 12, length);
+    }
+
+    void decode(const char *in)
+    {
+      offset_ns = get_le<uint64_t>(in);
+      connection_id = get_le<uint32_t>(in + 8);
+      length = get_le<uint32_t>(in + 12);
+    }
+  };
+
+  // Appends frames to a capture file. Connections call record() straight from
+  // their read handlers; when no capture is running that is a single relaxed
+  // load.
+  class capture_writer {
+  public:
+    ~capture_writer() { stop(); }
+
+    bool start(const std::string &path, uint32_t frame_size)
+    {
+      std::scoped_lock lock(__mux);
+      if (__file.is_open())
+        return false;
+
+      __file.rdbuf()->pubsetbuf(__buffer.data(), __buffer.size());
+      __file.open(path, std::ios::binary | std::ios::trunc);
+      if (!__file) {
+        log_error("[CAPTURE] Can't open ", path);
+        return false;
+      }
+
+      capture_file_header header{};
+      std::memcpy(header.magic, capture_magic, sizeof(header.magic));
+      header.version = capture_version;
+      header.frame_size = frame_size;
+      header.start_unix_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+      char bytes[capture_file_header::size];
+      header.encode(bytes);
+      __file.write(bytes, sizeof(bytes));
+
+      __start = trace_clock::now();
+      __frames = 0;
+      __last_flush_ns = 0;
+      __active.store(true, std::memory_order_release);
+      log_info("[CAPTURE] Recording inbound traffic to ", path);
+      return true;
+    }
+
+    void stop()
+    {
+      std::scoped_lock lock(__mux);
+      if (!__file.is_open())
+        return;
+      __active.store(false, std::memory_order_release);
+      __file.close();
+      log_info("[CAPTURE] Stopped, ", __frames, " frame(s) written");
+    }
+
+    bool active() const
+    {
+      return __active.load(std::memory_order_relaxed);
+    }
+
+    void record(uint32_t connection_id, const void *data, std::size_t length)
+    {
+      if (!active())
+        return;
+
+      capture_record_header header{};
+      header.connection_id = connection_id;
+      header.length = static_cast<uint32_t>(length);
+
+      std::scoped_lock lock(__mux);
+      if (!__file.is_open())
+        return;
+      // Stamp under the lock so records are in file order and time order
+      header.offset_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(trace_clock::now() - __start).count());
+      char bytes[capture_record_header::size];
+      header.encode(bytes);
+      __file.write(bytes, sizeof(bytes));
+      __file.write(static_cast<const char *>(data), static_cast<std::streamsize>(length));
+      __frames++;
+
+      // The server usually dies by signal, keep at most a second of frames in memory
+      if (header.offset_ns - __last_flush_ns > 1000000000ull) {
+        __file.flush();
+        __last_flush_ns = header.offset_ns;
+      }
+    }
+
+  private:
+    std::mutex __mux;
+    std::ofstream __file;
+    std::array<char, 1 << 16> __buffer{};
+    std::atomic<bool> __active{ false };
+    trace_clock::time_point __start;
+    uint64_t __frames = 0;
+    uint64_t __last_flush_ns = 0;
+  };
+
+  // Reads a capture file back record by record
+  class capture_reader {
+  public:
+    struct record {
+      std::chrono::nanoseconds offset{ 0 };
+      uint32_t connection_id = 0;
+      std::vector<char> data;
+    };
+
+    bool open(const std::string &path)
+    {
+      __file.open(path, std::ios::binary);
+      char bytes[capture_file_header::size];
+      if (!__file.read(bytes, sizeof(bytes)))
+        return false;
+      __header.decode(bytes);
+      return std::memcmp(__header.magic, capture_magic, sizeof(__header.magic)) == 0 &&
+             __header.version == capture_version;
+    }
+
+    const capture_file_header &header() const
+    {
+      return __header;
+    }
+
+    bool next(record &out)
+    {
+      char bytes[capture_record_header::size];
+      if (!__file.read(bytes, sizeof(bytes)))
+        return false;
+      capture_record_header header{};
+      header.decode(bytes);
+
+      out.offset = std::chrono::nanoseconds(header.offset_ns);
+      out.connection_id = header.connection_id;
+      out.data.resize(header.length);
+      return static_cast<bool>(__file.read(out.data.data(), header.length));
+    }
+
+  private:
+    std::ifstream __file;
+    capture_file_header __header{};
+  };
+}    // namespace net
+
+#endif
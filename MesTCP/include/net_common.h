@@ -10,12 +10,23 @@
 #include <chrono>
 #include <limits>
 #include <array>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <optional>
 
 #ifdef _WIN32
 #define _WIN32_WINNT 0x0A00
 #endif
 
 #define ASIO_STANDALONE
+
+// Build with -DMESTCP_IO_URING (and link liburing) to run every io_context on
+// io_uring instead of epoll. Linux only, needs Boost 1.78 or newer.
+#if defined(MESTCP_IO_URING) && defined(__linux__)
+#define BOOST_ASIO_HAS_IO_URING
+#define BOOST_ASIO_DISABLE_EPOLL
+#endif
 #include <D:/Boost/include/boost-1_90/boost/asio.hpp>
 
 #endif
\ No newline at end of file
@@ -2,13 +2,32 @@
 #define NET_CONNECTION
 
 #include "net_common.h"
+#include "net_log.h"
+#include "net_capture.h"
 #include "net_queue.h"
 #include "net_message.h"
+#include "net_registry.h"
+#include "net_transfer.h"
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 using boost::asio::ip::tcp;
 
 
 namespace net {
+  // Outbound priority classes, most urgent first. Control frames (accept, ping
+  // replies, ...) go in the control lane, chat traffic in normal, and anything
+  // large or deferrable in bulk.
+  enum class priority : uint8_t {
+    control,
+    normal,
+    bulk
+  };
+
+  constexpr std::size_t priority_count = 3;
+
   template <typename T>
   class connection : public std::enable_shared_from_this<connection<T>> {
   public:
@@ -50,24 +69,53 @@ namespace net {
       }
     }
 
-    void connect_to_server(const tcp::resolver::results_type &endpoints)
+    // Connect to the first endpoint that answers. Attempts are started in
+    // parallel across the resolved endpoints (happy eyeballs, RFC 8305): address
+    // families are interleaved, a new attempt starts every attempt_delay or as
+    // soon as the previous one fails, the first socket to connect wins and the
+    // others are dropped. on_result gets an empty error code on success,
+    // timed_out if nothing connected within timeout, or the last failure.
+    void connect_to_server(const tcp::resolver::results_type &endpoints,
+                           std::chrono::milliseconds timeout,
+                           std::function<void(std::error_code)> on_result)
     {
-      // Only clients can connect to servers
-      if (__owerner_type == owner::client) {
-        // Request asio attempts to connect to an endpoint
-        boost::asio::async_connect(__socket, endpoints,
-                                   [this](std::error_code ec, tcp::endpoint endpoint) {
-                                     if (!ec)
-                                       read_data();
-                                   });
+      // Only clients can connect to servers, and not once abandoned
+      if (__owerner_type != owner::client || __abandoned)
+        return;
+
+      auto attempt = std::make_shared<connect_attempt>(__io_context, std::move(on_result));
+      __attempt = attempt;
+
+      // Interleave address families so a dead IPv6 route can't hold up IPv4
+      std::vector<tcp::endpoint> v6, v4;
+      for (const auto &entry : endpoints)
+        (entry.endpoint().address().is_v6() ? v6 : v4).push_back(entry.endpoint());
+      for (std::size_t i = 0; i < std::max(v6.size(), v4.size()); ++i) {
+        if (i < v6.size())
+          attempt->endpoints.push_back(v6[i]);
+        if (i < v4.size())
+          attempt->endpoints.push_back(v4[i]);
       }
+
+      if (attempt->endpoints.empty()) {
+        attempt->finish(boost::system::error_code(boost::asio::error::host_not_found));
+        return;
+      }
+
+      attempt->deadline.expires_after(timeout);
+      attempt->deadline.async_wait([attempt](std::error_code ec) {
+        if (!ec)
+          attempt->finish(boost::system::error_code(boost::asio::error::timed_out));
+      });
+
+      start_connect_attempt(attempt);
     }
 
 
     void disconnect()
     {
       if (is_connected())
-        boost::asio::post(__io_context, [this]() { __socket.close(); });
+        boost::asio::post(__io_context, [this, self = keep_alive()]() { __socket.close(); });
     }
 
     bool is_connected() const
@@ -75,6 +123,73 @@ namespace net {
       return __socket.is_open();
     }
 
+    // Stop everything under way - a connect, reads, writes - without reporting
+    // it. Their handlers are queued cancelled and still have to run: an owner
+    // whose connection isn't kept alive by them (a client) calls this with its
+    // context stopped, then runs the context dry before destroying it. A
+    // connect asked for while it drains (a resolve that had already finished)
+    // is ignored.
+    void abandon()
+    {
+      __abandoned = true;
+      if (auto attempt = __attempt.lock()) {
+        attempt->on_result = nullptr;
+        attempt->finish({});
+      }
+      boost::system::error_code ignored;
+      __socket.close(ignored);
+    }
+
+    // Attach the owner's stage tracer, received messages are then sampled for
+    // latency tracing and anything sent while they are dispatched is followed
+    // until it leaves the socket
+    void set_tracer(stage_tracer *tracer)
+    {
+      __tracer = tracer;
+    }
+
+    // Attach the owner's traffic capture, every complete inbound frame is
+    // handed to it while a recording is running
+    void set_capture(capture_writer *capture)
+    {
+      __capture = capture;
+    }
+
+    // Which of the owner's shards runs this connection (see
+    // listener_options::shard_fanout), set before it starts
+    void set_shard(uint16_t shard)
+    {
+      __shard = shard;
+    }
+
+    uint16_t get_shard() const
+    {
+      return __shard;
+    }
+
+    // By default an idle connection waits for readability before it borrows a
+    // receive buffer (see read_data). Turning that off reads straight into a
+    // pooled buffer: one operation per message instead of two, at the cost of
+    // a buffer per idle connection. Worth it on io_uring, where the kernel
+    // polls internally and every extra operation is another submission.
+    void set_idle_wait(bool wait)
+    {
+      __idle_wait = wait;
+    }
+
+    // Outbound batching. With a flush interval, frames queued while nothing is
+    // being written are held back for up to that long, or until max_bytes of
+    // them are waiting, and then leave together in one gather write - a busy
+    // room costs each recipient one send per tick instead of one per line.
+    // Control frames are never held back. With an interval of zero frames go
+    // out as soon as they are queued; whatever piles up during a write is
+    // batched either way.
+    void set_flush_policy(std::chrono::microseconds interval, std::size_t max_bytes = 64 * 1024)
+    {
+      __flush_interval = interval;
+      __flush_bytes = std::max(max_bytes, sizeof(message_header<T>) + max_text_bytes);
+    }
+
     // Prime the connection to wait for incoming messages
     void start_listening()
     {
@@ -82,112 +197,576 @@ namespace net {
 
   public:
     // ASYNC - send a message, connections are one-to-one so no need to specifiy
-    // the target, for a client, the target is the server and vice versa
-    void send(const message<T> &msg)
+    // the target, for a client, the target is the server and vice versa.
+    // Messages of a higher priority overtake anything still queued below them.
+    void send(const message<T> &msg, priority prio = priority::normal)
     {
+      send(frame_lease<T>::copy_of(msg), prio);
+    }
+
+    // Same, but queue a lease on a frame that is already in a pooled buffer -
+    // a received frame, or one fanned out to many connections - without
+    // copying it
+    void send(frame_lease<T> frame, priority prio = priority::normal)
+    {
+      // When called from inside a traced dispatch, carry its stamps along
+      trace_stamps trace{};
+      trace_stamps *origin = stage_tracer::current();
+      if (__tracer && origin && origin->sampled) {
+        trace = *origin;
+        trace.stamp(trace_stage::enqueued_out);
+      }
+
+      // The frame stays leased until it has been written
       boost::asio::post(__io_context,
-                        [this, msg]() {
-                          // If the queue has a message in it, then we must
-                          // assume that it is in the process of asynchronously being written.
-                          // Either way add the message to the queue to be output. If no messages
-                          // were available to be written, then start the process of writing the
-                          // message at the front of the queue.
-                          bool bWritingMessage = !__q_messages_out.empty();
-                          try {
-                            __q_messages_out.push_back(msg);
-                          } catch (std::exception &e) {
-                            std::cerr << "post exception: " << e.what() << '\n';
+                        [this, self = keep_alive(), frame = std::move(frame), prio, trace]() mutable {
+                          // If a write is in flight, asio will come back for the next
+                          // messages once it completes. Either way add the message to its
+                          // lane. If nothing was being written, then start (or schedule)
+                          // writing the most urgent messages. The lanes themselves only
+                          // exist while something is queued.
+                          bool bWritingMessage = __writing_message;
+                          enqueue({ std::move(frame), trace, nullptr, 0, 0 }, prio);
+                          if (!bWritingMessage && __q_messages_out) {
+                            schedule_write(prio);
                           }
-                          if (!bWritingMessage) {
-                            write_data();
+                        });
+    }
+
+    // Queue a frame whose payload ends in bytes of a file: head carries the
+    // header (its size counting the file bytes) and the start of the
+    // payload, the rest is sent straight from the file when the frame's turn
+    // comes - with sendfile on Linux, so it never passes through user space.
+    void send_file(frame_lease<T> head, std::shared_ptr<const spool_file> file, uint64_t offset, uint32_t bytes,
+                   priority prio = priority::bulk)
+    {
+      boost::asio::post(__io_context,
+                        [this, self = keep_alive(), head = std::move(head), file = std::move(file), offset, bytes, prio]() mutable {
+                          bool bWritingMessage = __writing_message;
+                          enqueue({ std::move(head), {}, std::move(file), offset, bytes }, prio);
+                          if (!bWritingMessage && __q_messages_out) {
+                            schedule_write(prio);
+                          }
+                        });
+    }
+
+    // Queue a run of frames in one go, back to back in one lane, so they leave
+    // in as few writes as the batch size allows (a resume replay, say)
+    void send_burst(std::vector<frame_lease<T>> frames, priority prio = priority::normal)
+    {
+      if (frames.empty())
+        return;
+      boost::asio::post(__io_context,
+                        [this, self = keep_alive(), frames = std::move(frames), prio]() mutable {
+                          bool bWritingMessage = __writing_message;
+                          for (frame_lease<T> &frame : frames)
+                            enqueue({ std::move(frame), {}, nullptr, 0, 0 }, prio);
+                          if (!bWritingMessage && __q_messages_out) {
+                            schedule_write(prio);
                           }
                         });
     }
 
 
 
+  protected:
+    struct outbound_message;
+
   private:
-    // ASYNC - Prime context to write a message header
+    // Handlers hold on to this so a server-side connection outlives every
+    // operation it started, even once the server has dropped it. Clients own
+    // their connection outright and stop the context before destroying it, for
+    // them this is empty.
+    std::shared_ptr<connection> keep_alive()
+    {
+      return this->weak_from_this().lock();
+    }
+
+    // ASIO thread - add a frame to its lane, allocating the lanes if need be
+    void enqueue(outbound_message out, priority prio)
+    {
+      try {
+        if (!__q_messages_out)
+          __q_messages_out = std::make_unique<outbound_queue>();
+        const std::size_t bytes = out.wire_bytes();
+        __q_messages_out->lanes[static_cast<std::size_t>(prio)].push_back(std::move(out));
+        __q_messages_out->queued_bytes += bytes;
+      } catch (std::exception &e) {
+        log_error("post exception: ", e.what());
+      }
+    }
+
+    // Index of the most urgent non-empty outgoing lane, or priority_count if all are empty
+    std::size_t next_lane() const
+    {
+      if (!__q_messages_out)
+        return priority_count;
+      std::size_t lane = 0;
+      while (lane < priority_count && __q_messages_out->lanes[lane].empty())
+        ++lane;
+      return lane;
+    }
+
+    // Nothing is being written and a message was just queued: write now, or
+    // let the flush tick collect a few more first
+    void schedule_write(priority prio)
+    {
+      outbound_queue &q = *__q_messages_out;
+      if (__flush_interval.count() == 0 || prio == priority::control || q.queued_bytes >= __flush_bytes) {
+        write_data();
+        return;
+      }
+      if (q.flush_armed)
+        return;
+
+      if (!q.flush_timer)
+        q.flush_timer.emplace(__io_context);
+      q.flush_armed = true;
+      q.flush_timer->expires_after(__flush_interval);
+      q.flush_timer->async_wait([this, self = keep_alive()](std::error_code ec) {
+        // Aborted when the queue drained (and was released) before the tick
+        if (ec || !__q_messages_out)
+          return;
+        __q_messages_out->flush_armed = false;
+        if (!__writing_message && next_lane() < priority_count)
+          write_data();
+      });
+    }
+
+    // ASYNC - Prime context to write the queued messages
     void write_data()
     {
-      // If this function is called, we know the outgoing message queue must have
-      // at least one message to send. So allocate a transmission buffer to hold
-      // the message, and issue the work - asio, send these bytes
-      boost::asio::async_write(__socket, boost::asio::buffer(&__q_messages_out.front(), sizeof(message<T>)),
-                               [this](std::error_code ec, std::size_t length) {
-                                 if (!ec) {
-                                   __q_messages_out.pop_front();
-
-                                   if (!__q_messages_out.empty())
-                                     write_data();
-                                 }
-                                 else {
-                                   std::cerr << "[" << id << "] Write Data Fail.\n";
-                                   __socket.close();
-                                 }
+      // If this function is called, we know at least one outgoing lane has a
+      // message to send. Messages are taken strictly in priority order, up to
+      // __flush_bytes of them, and written with a single gather write. A control
+      // frame never waits behind a backlog of bulk traffic - at most behind the
+      // one batch already on the wire.
+      outbound_queue &q = *__q_messages_out;
+      __writing_message = true;
+      q.batch.clear();
+      q.buffers.clear();
+
+      // A frame with file bytes ends the batch, they follow the gather write
+      std::size_t bytes = 0;
+      bool file_tail = false;
+      for (auto &lane : q.lanes) {
+        while (!file_tail && !lane.empty() && (q.batch.empty() || bytes + lane.front().wire_bytes() <= __flush_bytes)) {
+          bytes += lane.front().wire_bytes();
+          file_tail = lane.front().file != nullptr;
+          q.batch.push_back(std::move(lane.front()));
+          lane.pop_front();
+        }
+      }
+      q.queued_bytes -= bytes;
+      for (const outbound_message &out : q.batch)
+        q.buffers.push_back(boost::asio::buffer(&*out.msg, out.head_bytes()));
+
+      boost::asio::async_write(__socket, q.buffers,
+                               [this, self = keep_alive(), file_tail](std::error_code ec, std::size_t) {
+                                 if (ec)
+                                   write_failed();
+                                 else if (file_tail)
+                                   write_file_bytes();
+                                 else
+                                   write_complete();
                                });
     }
 
-    // ASYNC - Prime context ready to read a message header
+    // ASYNC - The batch ended in a frame with file bytes, send them. sendfile
+    // goes as far as the socket buffer allows, then we wait for room.
+    void write_file_bytes()
+    {
+      outbound_message &out = __q_messages_out->batch.back();
+#ifdef __linux__
+      __socket.native_non_blocking(true);
+      while (out.file_bytes > 0) {
+        off_t offset = static_cast<off_t>(out.file_offset);
+        const ssize_t sent = ::sendfile(__socket.native_handle(), out.file->native_handle(), &offset, out.file_bytes);
+        if (sent > 0) {
+          out.file_offset += static_cast<uint64_t>(sent);
+          out.file_bytes -= static_cast<uint32_t>(sent);
+        }
+        else if (sent < 0 && errno == EINTR)
+          continue;
+        else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          __socket.async_wait(tcp::socket::wait_write, [this, self = keep_alive()](std::error_code ec) {
+            if (ec)
+              write_failed();
+            else
+              write_file_bytes();
+          });
+          return;
+        }
+        else {
+          write_failed();
+          return;
+        }
+      }
+      write_complete();
+#else
+      // No sendfile here, read the bytes into a buffer and write that
+      outbound_queue &q = *__q_messages_out;
+      q.file_buffer.resize(out.file_bytes);
+      if (!out.file->read(out.file_offset, q.file_buffer.data(), q.file_buffer.size())) {
+        write_failed();
+        return;
+      }
+      boost::asio::async_write(__socket, boost::asio::buffer(q.file_buffer),
+                               [this, self = keep_alive()](std::error_code ec, std::size_t length) {
+                                 if (ec)
+                                   write_failed();
+                                 else
+                                   write_complete();
+                               });
+#endif
+    }
+
+    // The batch is out: account for it, then carry on with whatever is next
+    void write_complete()
+    {
+      outbound_queue &q = *__q_messages_out;
+      for (outbound_message &sent : q.batch) {
+        if (sent.trace.sampled) {
+          sent.trace.stamp(trace_stage::write_complete);
+          __tracer->record_outbound(sent.trace);
+        }
+      }
+      q.batch.clear();
+
+      if (next_lane() < priority_count)
+        write_data();
+      else {
+        // Drained - give the lanes and their buffers back
+        __writing_message = false;
+        __q_messages_out.reset();
+      }
+    }
+
+    void write_failed()
+    {
+      log_error("[", id, "] Write Data Fail.");
+      __writing_message = false;
+      __q_messages_out.reset();
+      __socket.close();
+    }
+
+    // ASYNC - Prime context to wait for the next message
     void read_data()
     {
-      // If this function is called, we are expecting asio to wait until it receives
-      // enough bytes to form a header of a message. We know the headers are a fixed
-      // size, so allocate a transmission buffer large enough to store it. In fact,
-      // we will construct the message in a "temporary" message object as it's
-      // convenient to work with.
-      boost::asio::async_read(__socket, boost::asio::buffer(&__temp_msg_in, sizeof(message<T>)),
-                              [this](std::error_code ec, std::size_t length) {
+      if (!__idle_wait) {
+        read_frame();
+        return;
+      }
+
+      // A zero-byte read: wait until the socket is readable without handing asio
+      // any buffer. Most connections spend most of their life right here, and
+      // this way an idle connection holds no receive memory at all.
+      __socket.async_wait(tcp::socket::wait_read,
+                          [this, self = keep_alive()](std::error_code ec) {
+                            if (!ec) {
+                              read_frame();
+                            }
+                            else {
+                              log_info("[", id, "] Leave the server...");
+                              __socket.close();
+                            }
+                          });
+    }
+
+    // ASYNC - Bytes have arrived, read the frame header
+    void read_frame()
+    {
+      // The header says what follows and how much of it. It is checked before
+      // any buffer is borrowed: an unknown type or a payload larger than its
+      // type allows ends the connection right here.
+      boost::asio::async_read(__socket, boost::asio::buffer(&__read_header, sizeof(message_header<T>)),
+                              [this, self = keep_alive()](std::error_code ec, std::size_t) {
+                                if (ec) {
+                                  // Reading form the client went wrong, most likely a disconnect
+                                  // has occurred. Close the socket and let the system tidy it up later.
+                                  log_info("[", id, "] Leave the server...");
+                                  __socket.close();
+                                }
+                                else if (!frame_accepted<T>(__read_header)) {
+                                  log_warning("[", id, "] Rejected frame of type ",
+                                              static_cast<uint32_t>(__read_header.id), ", ", __read_header.size, " bytes.");
+                                  __socket.close();
+                                }
+                                else if (__read_header.size > max_text_bytes) {
+                                  read_split_head();
+                                }
+                                else {
+                                  read_payload();
+                                }
+                              });
+    }
+
+    // ASYNC - Borrow a frame buffer and read the payload the header announced
+    void read_payload()
+    {
+      __read_buffer = message_pool<T>::get().acquire();
+      message<T> &msg = __read_buffer->msg;
+      msg.header = __read_header;
+      // Pooled buffers hold whatever the last frame left in them, make sure
+      // text fields end where this payload does
+      if (msg.header.size < max_text_bytes)
+        msg.data[msg.header.size] = '\0';
+      if (msg.header.size == 0) {
+        add_to_incomming_message_queue();
+        return;
+      }
+
+      boost::asio::async_read(__socket, boost::asio::buffer(msg.data.data(), msg.header.size),
+                              [this, self = keep_alive()](std::error_code ec, std::size_t) {
                                 if (!ec) {
                                   add_to_incomming_message_queue();
                                 }
                                 else {
-                                  // Reading form the client went wrong, most likely a disconnect
-                                  // has occurred. Close the socket and let the system tidy it up later.
-                                  std::cerr << "[" << id << "] Leave the server...\n";
+                                  log_info("[", id, "] Leave the server...");
+                                  __read_buffer.reset();
+                                  __socket.close();
+                                }
+                              });
+    }
+
+    // ASYNC - A frame too large for a buffer, one its type allows to be split
+    // (see split_rule). Read the head its pieces all start with, then the
+    // pieces one buffer at a time, each queued as a frame of its own.
+    void read_split_head()
+    {
+      __split = frame_split<T>(__read_header);
+      __split_left = __read_header.size - __split.head;
+      boost::asio::async_read(__socket, boost::asio::buffer(__split_head.data(), __split.head),
+                              [this, self = keep_alive()](std::error_code ec, std::size_t) {
+                                if (!ec) {
+                                  read_split_piece();
+                                }
+                                else {
+                                  log_info("[", id, "] Leave the server...");
+                                  __split_left = 0;
+                                  __socket.close();
+                                }
+                              });
+    }
+
+    // ASYNC - The next piece of a split frame
+    void read_split_piece()
+    {
+      const std::size_t bytes = std::min(__split_left, max_text_bytes - __split.head);
+      __read_buffer = message_pool<T>::get().acquire();
+      message<T> &msg = __read_buffer->msg;
+      msg.header = __read_header;
+      msg.header.size = static_cast<uint32_t>(__split.head + bytes);
+      std::memcpy(msg.data.data(), __split_head.data(), __split.head);
+      if (msg.header.size < max_text_bytes)
+        msg.data[msg.header.size] = '\0';
+
+      boost::asio::async_read(__socket, boost::asio::buffer(msg.data.data() + __split.head, bytes),
+                              [this, self = keep_alive(), bytes](std::error_code ec, std::size_t) {
+                                if (!ec) {
+                                  __split.advance(__split_head.data(), bytes);
+                                  __split_left -= bytes;
+                                  add_to_incomming_message_queue();
+                                }
+                                else {
+                                  log_info("[", id, "] Leave the server...");
+                                  __split_left = 0;
+                                  __read_buffer.reset();
                                   __socket.close();
                                 }
                               });
     }
 
+    // State shared by the parallel connect attempts of connect_to_server()
+    struct connect_attempt {
+      connect_attempt(boost::asio::io_context &ctx, std::function<void(std::error_code)> cb)
+          : stagger(ctx), deadline(ctx), on_result(std::move(cb)) {}
+
+      void finish(std::error_code ec)
+      {
+        if (done)
+          return;
+        done = true;
+        stagger.cancel();
+        deadline.cancel();
+        for (auto &s : sockets) {
+          boost::system::error_code ignored;
+          s->close(ignored);
+        }
+        if (on_result)
+          on_result(ec);
+      }
+
+      static constexpr std::chrono::milliseconds attempt_delay{ 250 };
+
+      std::vector<tcp::endpoint> endpoints;
+      std::vector<std::unique_ptr<tcp::socket>> sockets;
+      boost::asio::steady_timer stagger;
+      boost::asio::steady_timer deadline;
+      std::function<void(std::error_code)> on_result;
+      std::size_t next = 0;
+      std::size_t failed = 0;
+      bool done = false;
+    };
+
+    // ASYNC - Start connecting to the next endpoint, and arm the stagger timer
+    // that starts the one after it if this attempt is slow
+    void start_connect_attempt(std::shared_ptr<connect_attempt> attempt)
+    {
+      if (attempt->done || attempt->next >= attempt->endpoints.size())
+        return;
+
+      const tcp::endpoint endpoint = attempt->endpoints[attempt->next++];
+      attempt->sockets.push_back(std::make_unique<tcp::socket>(__io_context));
+      tcp::socket &sock = *attempt->sockets.back();
+
+      sock.async_connect(endpoint, [this, attempt, &sock](std::error_code ec) {
+        if (attempt->done)
+          return;
+
+        if (!ec) {
+          // Winner - adopt its socket, then drop the other attempts
+          __socket = std::move(sock);
+          attempt->finish({});
+          read_data();
+          return;
+        }
+
+        // Failed early, don't wait out the stagger delay before the next one
+        if (++attempt->failed == attempt->endpoints.size())
+          attempt->finish(ec);
+        else
+          start_connect_attempt(attempt);
+      });
+
+      if (attempt->next < attempt->endpoints.size()) {
+        attempt->stagger.expires_after(connect_attempt::attempt_delay);
+        attempt->stagger.async_wait([this, attempt](std::error_code ec) {
+          if (!ec && !attempt->done)
+            start_connect_attempt(attempt);
+        });
+      }
+    }
+
     // Once a full message is received, add it to the incoming queue
     void add_to_incomming_message_queue()
     {
       // Shove it in queue, converting it to an "owned message", by initialising
       // with the a shared pointer from this connection object
-      if (__owerner_type == owner::server)
-        __q_messages_in.push_back({ this->shared_from_this(), __temp_msg_in });
-      else
-        __q_messages_in.push_back({ nullptr, __temp_msg_in });
+      if (__capture)
+        __capture->record(id, &__read_buffer->msg, frame_bytes(__read_buffer->msg));
+
+      // Every shared connection (a server's clients and its peer links) tags
+      // the message with itself, a client's own connection leaves it empty.
+      // The receive buffer itself moves on with the message, no copy is made.
+      owned_message<T> owned{ keep_alive(), frame_lease<T>(std::move(__read_buffer)) };
+      if (__tracer)
+        __tracer->begin(owned.trace);
+      __q_messages_in.push_back(std::move(owned));
 
       // We must now prime the asio context to receive the next message. It
       // wil just sit and wait for bytes to arrive, and the message construction
-      // process repeats itself. Clever huh?
-      read_data();
+      // process repeats itself. Clever huh? Unless a split frame has more
+      // pieces to come.
+      if (__split_left > 0)
+        read_split_piece();
+      else
+        read_data();
     }
 
   protected:
+    // An outgoing message plus the trace stamps of the dispatch that produced it
+    struct outbound_message {
+      frame_lease<T> msg;
+      trace_stamps trace;
+
+      // Payload bytes that follow msg on the wire straight from a file
+      std::shared_ptr<const spool_file> file;
+      uint64_t file_offset = 0;
+      uint32_t file_bytes = 0;
+
+      // What is written from msg itself. A frame with file bytes may be larger
+      // than its buffer, only the start of its payload is in there.
+      std::size_t head_bytes() const
+      {
+        return file ? sizeof(message_header<T>) + msg->header.size - file_bytes : frame_bytes(*msg);
+      }
+
+      std::size_t wire_bytes() const
+      {
+        return head_bytes() + file_bytes;
+      }
+    };
+
+    // Everything needed to send, allocated only while something is queued
+    struct outbound_queue {
+      std::array<std::deque<outbound_message>, priority_count> lanes;
+      std::size_t queued_bytes = 0;
+
+      // The batch on the wire, and the gather list pointing into it
+      std::vector<outbound_message> batch;
+      std::vector<boost::asio::const_buffer> buffers;
+#ifndef __linux__
+      std::vector<char> file_buffer;
+#endif
+
+      // Flush tick, only created when a flush interval is set
+      std::optional<boost::asio::steady_timer> flush_timer;
+      bool flush_armed = false;
+    };
+
     // Each connection has a unique socket to a remote
     tcp::socket __socket;
 
     // This context is shared with the whole asio instance
     boost::asio::io_context &__io_context;
 
-    // This queue holds all messages to be sent to the remote side
-    // of this connection
-    ts_queue<message<T>> __q_messages_out;
+    // These lanes hold all messages to be sent to the remote side of this
+    // connection, one FIFO per priority. They are only touched from handlers
+    // running on the asio context, so they need no locking of their own, and
+    // are only allocated while there is something to send.
+    std::unique_ptr<outbound_queue> __q_messages_out;
+    bool __writing_message = false;
+
+    // Outbound batching, see set_flush_policy()
+    std::chrono::microseconds __flush_interval{ 0 };
+    std::size_t __flush_bytes = 64 * 1024;
 
     // This references the incoming queue of the parent object
     ts_queue<owned_message<T>> &__q_messages_in;
 
-    // Incoming messages are constructed asynchronously, so we will
-    // store the part assembled message here, until it is ready
-    message<T> __temp_msg_in;
+    // Incoming messages are constructed asynchronously, so we will store the
+    // part assembled message here until it is ready. Borrowed from the message
+    // pool once the header has been read, empty while the connection is idle.
+    message_header<T> __read_header{};
+    typename message_pool<T>::handle __read_buffer;
+
+    // A split frame being read: the head of its next piece and the bytes
+    // still to come
+    split_rule __split;
+    std::array<char, max_split_head> __split_head{};
+    std::size_t __split_left = 0;
 
     // The "owner" decides how some of the connection behaves
     owner __owerner_type = owner::server;
 
     uint32_t id = 0;
+
+    // Wait for readability before borrowing a receive buffer
+    bool __idle_wait = true;
+
+    // The connect under way, see abandon()
+    std::weak_ptr<connect_attempt> __attempt;
+    bool __abandoned = false;
+
+    // Owner's shard running this connection, see set_shard()
+    uint16_t __shard = 0;
+
+    // Optional latency tracer of the owner
+    stage_tracer *__tracer = nullptr;
+
+    // Optional traffic capture of the owner
+    capture_writer *__capture = nullptr;
   };
 }    // namespace net
 #endif
\ No newline at end of file
@@ -0,0 +1,279 @@
+#ifndef NET_LOG
+#define NET_LOG
+
+#include "net_common.h"
+#include "net_utf8.h"
+#include <atomic>
+#include <condition_variable>
+#include <cwchar>
+#include <type_traits>
+
+namespace net {
+  enum class log_level : uint8_t {
+    trace,
+    debug,
+    info,
+    warning,
+    error
+  };
+
+  // Asynchronous logger. Producers format straight into a slot of a bounded
+  // lock-free ring (Vyukov MPMC scheme) and return; a background thread drains
+  // the ring to std::wcout. When the ring is full the line is dropped instead of
+  // blocking the caller, and the flusher reports how many lines were lost.
+  class logger {
+  public:
+    static constexpr std::size_t line_capacity = 256;    // wchar_t per line
+    static constexpr std::size_t ring_capacity = 4096;    // must be a power of two
+
+    static logger &get()
+    {
+      static logger instance;
+      return instance;
+    }
+
+    logger(const logger &) = delete;
+    logger &operator=(const logger &) = delete;
+
+    ~logger()
+    {
+      __stop.store(true, std::memory_order_release);
+      __cv_flush.notify_one();
+      if (__flush_thread.joinable())
+        __flush_thread.join();
+    }
+
+  public:
+    // Lines below this level are discarded before any formatting happens
+    void set_level(log_level lvl)
+    {
+      __min_level.store(static_cast<uint8_t>(lvl), std::memory_order_relaxed);
+    }
+
+    // Keep only every n-th line of the given level (1 keeps everything)
+    void set_sampling(log_level lvl, uint32_t every_nth)
+    {
+      __sampling[static_cast<std::size_t>(lvl)].store(every_nth ? every_nth : 1, std::memory_order_relaxed);
+    }
+
+    bool enabled(log_level lvl) const
+    {
+      return static_cast<uint8_t>(lvl) >= __min_level.load(std::memory_order_relaxed);
+    }
+
+    uint64_t dropped() const
+    {
+      return __dropped_total.load(std::memory_order_relaxed);
+    }
+
+    template <typename... Args>
+    void write(log_level lvl, const Args &...args)
+    {
+      if (!enabled(lvl))
+        return;
+
+      const std::size_t lvl_idx = static_cast<std::size_t>(lvl);
+      const uint32_t every_nth = __sampling[lvl_idx].load(std::memory_order_relaxed);
+      if (every_nth > 1 && __sample_counter[lvl_idx].fetch_add(1, std::memory_order_relaxed) % every_nth != 0)
+        return;
+
+      // Claim a slot; if the consumer has not caught up, give up immediately
+      cell *c = nullptr;
+      std::size_t pos = __enqueue_pos.load(std::memory_order_relaxed);
+      for (;;) {
+        c = &__ring[pos & (ring_capacity - 1)];
+        std::size_t seq = c->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+          if (__enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            break;
+        }
+        else if (diff < 0) {
+          __dropped.fetch_add(1, std::memory_order_relaxed);
+          __dropped_total.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+        else {
+          pos = __enqueue_pos.load(std::memory_order_relaxed);
+        }
+      }
+
+      // Format in place, then publish the slot to the consumer
+      c->length = 0;
+      (append(*c, args), ...);
+      c->text[c->length] = L'\0';
+      c->sequence.store(pos + 1, std::memory_order_release);
+
+      if (lvl == log_level::error)
+        __cv_flush.notify_one();
+    }
+
+  private:
+    struct cell {
+      std::atomic<std::size_t> sequence{ 0 };
+      std::size_t length = 0;
+      std::array<wchar_t, line_capacity> text{};
+    };
+
+    logger()
+    {
+      for (std::size_t i = 0; i < ring_capacity; ++i)
+        __ring[i].sequence.store(i, std::memory_order_relaxed);
+      for (auto &s : __sampling)
+        s.store(1, std::memory_order_relaxed);
+
+      __flush_thread = std::thread([this]() { flush_loop(); });
+    }
+
+    static void append_char(cell &c, wchar_t ch)
+    {
+      if (c.length + 1 < line_capacity)
+        c.text[c.length++] = ch;
+    }
+
+    static void append(cell &c, const wchar_t *s)
+    {
+      while (s && *s)
+        append_char(c, *s++);
+    }
+
+    static void append(cell &c, wchar_t *s)
+    {
+      append(c, static_cast<const wchar_t *>(s));
+    }
+
+    // Narrow strings are UTF-8 (literals, and every text field on the wire)
+    static void append(cell &c, std::string_view s)
+    {
+      utf8_for_each(s, [&c](char32_t cp) {
+        if (sizeof(wchar_t) == sizeof(char16_t) && cp >= 0x10000) {
+          cp -= 0x10000;
+          append_char(c, static_cast<wchar_t>(0xD800 + (cp >> 10)));
+          append_char(c, static_cast<wchar_t>(0xDC00 + (cp & 0x3FF)));
+        }
+        else {
+          append_char(c, static_cast<wchar_t>(cp));
+        }
+      });
+    }
+
+    static void append(cell &c, const char *s)
+    {
+      if (s)
+        append(c, std::string_view(s));
+    }
+
+    static void append(cell &c, char *s)
+    {
+      append(c, static_cast<const char *>(s));
+    }
+
+    static void append(cell &c, const std::string &s)
+    {
+      append(c, std::string_view(s));
+    }
+
+    static void append(cell &c, const std::wstring &s)
+    {
+      append(c, s.c_str());
+    }
+
+    static void append(cell &c, char ch)
+    {
+      append_char(c, static_cast<wchar_t>(static_cast<unsigned char>(ch)));
+    }
+
+    static void append(cell &c, wchar_t ch)
+    {
+      append_char(c, ch);
+    }
+
+    template <typename N, typename = std::enable_if_t<std::is_arithmetic_v<N>>>
+    static void append(cell &c, N value)
+    {
+      wchar_t buf[32];
+      int n = 0;
+      if constexpr (std::is_floating_point_v<N>)
+        n = std::swprintf(buf, 32, L"%.3f", static_cast<double>(value));
+      else if constexpr (std::is_signed_v<N>)
+        n = std::swprintf(buf, 32, L"%lld", static_cast<long long>(value));
+      else
+        n = std::swprintf(buf, 32, L"%llu", static_cast<unsigned long long>(value));
+      for (int i = 0; i < n; ++i)
+        append_char(c, buf[i]);
+    }
+
+    // Consumer side: pop everything available, write it out in one go, then sleep
+    void flush_loop()
+    {
+      for (;;) {
+        bool wrote = false;
+        for (;;) {
+          cell &c = __ring[__dequeue_pos & (ring_capacity - 1)];
+          std::size_t seq = c.sequence.load(std::memory_order_acquire);
+          if (seq != __dequeue_pos + 1)
+            break;
+
+          std::wcout << c.text.data() << L'\n';
+          c.sequence.store(__dequeue_pos + ring_capacity, std::memory_order_release);
+          ++__dequeue_pos;
+          wrote = true;
+        }
+
+        uint64_t lost = __dropped.exchange(0, std::memory_order_relaxed);
+        if (lost) {
+          std::wcout << L"[LOG] " << lost << L" line(s) dropped, log buffer full\n";
+          wrote = true;
+        }
+        if (wrote)
+          std::wcout.flush();
+
+        // A character the console locale can't encode fails the stream, don't
+        // let that swallow every later line
+        if (!std::wcout)
+          std::wcout.clear();
+
+        if (__stop.load(std::memory_order_acquire) &&
+            __ring[__dequeue_pos & (ring_capacity - 1)].sequence.load(std::memory_order_acquire) != __dequeue_pos + 1)
+          break;
+
+        std::unique_lock<std::mutex> ul(__mux_flush);
+        __cv_flush.wait_for(ul, std::chrono::milliseconds(20));
+      }
+    }
+
+  private:
+    std::array<cell, ring_capacity> __ring;
+    alignas(64) std::atomic<std::size_t> __enqueue_pos{ 0 };
+    alignas(64) std::size_t __dequeue_pos = 0;
+
+    std::atomic<uint8_t> __min_level{ static_cast<uint8_t>(log_level::info) };
+    std::array<std::atomic<uint32_t>, 5> __sampling;
+    std::array<std::atomic<uint32_t>, 5> __sample_counter{};
+    std::atomic<uint64_t> __dropped{ 0 };
+    std::atomic<uint64_t> __dropped_total{ 0 };
+
+    std::atomic<bool> __stop{ false };
+    std::mutex __mux_flush;
+    std::condition_variable __cv_flush;
+    std::thread __flush_thread;
+  };
+
+  // Short-hands used across the code base
+  template <typename... Args>
+  void log_trace(const Args &...args) { logger::get().write(log_level::trace, args...); }
+
+  template <typename... Args>
+  void log_debug(const Args &...args) { logger::get().write(log_level::debug, args...); }
+
+  template <typename... Args>
+  void log_info(const Args &...args) { logger::get().write(log_level::info, args...); }
+
+  template <typename... Args>
+  void log_warning(const Args &...args) { logger::get().write(log_level::warning, args...); }
+
+  template <typename... Args>
+  void log_error(const Args &...args) { logger::get().write(log_level::error, args...); }
+}    // namespace net
+
+#endif
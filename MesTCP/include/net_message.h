@@ -2,22 +2,163 @@
 #define NET_MESSAGE
 
 #include "net_common.h"
+#include "net_pool.h"
+#include "net_trace.h"
+#include "net_utf8.h"
+#include <type_traits>
 
 namespace net {
 
+  // Text fields travel as NUL-terminated UTF-8 (see net_utf8.h), which keeps
+  // the layout identical no matter how wide wchar_t is on either end. Names
+  // are sent once, when joining, and reach other clients through presence
+  // (see net_presence.h); every other frame only carries the sender's id.
+  constexpr std::size_t max_name_bytes = 256;
+  constexpr std::size_t max_text_bytes = 1024;
+
+  // Connection ids carry the node id of the server that handed them out in
+  // their top byte, so they stay unique across federated servers
+  constexpr uint32_t node_id_shift = 24;
+  constexpr uint32_t local_id_mask = (1u << node_id_shift) - 1;
+
+  inline uint32_t make_global_id(uint8_t node, uint32_t local)
+  {
+    return (static_cast<uint32_t>(node) << node_id_shift) | (local & local_id_mask);
+  }
+
+  inline uint8_t origin_node(uint32_t id)
+  {
+    return static_cast<uint8_t>(id >> node_id_shift);
+  }
+
+  // Integers inside payloads, and in the files the library writes (captures,
+  // the client's history), are little-endian whatever the host, so either
+  // end can read them without knowing the other. Each format spells out its
+  // layout next to its code and goes through put_le()/get_le(), which take
+  // any integer type. The frame header alone is sent as it sits in memory.
+  template <typename Int>
+  inline void put_le(char *out, Int value)
+  {
+    auto bits = static_cast<std::make_unsigned_t<Int>>(value);
+    for (std::size_t i = 0; i < sizeof(Int); ++i, bits >>= 8)
+      out[i] = static_cast<char>(bits & 0xff);
+  }
+
+  template <typename Int>
+  inline Int get_le(const char *in)
+  {
+    std::make_unsigned_t<Int> bits = 0;
+    for (std::size_t i = sizeof(Int); i-- > 0;)
+      bits = static_cast<std::make_unsigned_t<Int>>((bits << 8) | static_cast<unsigned char>(in[i]));
+    return static_cast<Int>(bits);
+  }
+
+  // On the wire a frame is its header followed by header.size payload bytes.
+  // In memory every message has room for the largest payload; only the first
+  // header.size bytes of data mean anything.
   template <typename T>
   struct message_header {
     T id{};    // for what type the message is
-    std::array<wchar_t, 256> name{};    // who pass this massage
+    uint32_t sender = 0;    // who pass this massage, the connection id of the sender
+    uint32_t size = 0;    // payload bytes in data
+    uint32_t seq = 0;    // place in the room's stream for relayed frames, else 0 (see net_session.h)
   };
 
   template <typename T>
   struct message {
     message_header<T> header{};
-    std::array<wchar_t, 256> data{};    // message content
-    std::chrono::system_clock::time_point time = std::chrono::system_clock::now();
+    std::array<char, max_text_bytes> data{};    // message content
+  };
+
+  // Bytes a message takes on the wire
+  template <typename T>
+  std::size_t frame_bytes(const message<T> &msg)
+  {
+    return sizeof(message_header<T>) + std::min<std::size_t>(msg.header.size, max_text_bytes);
+  }
+
+  // A pooled frame buffer, shared by leases (see frame_lease)
+  template <typename T>
+  struct frame_block {
+    std::atomic<uint32_t> leases{ 0 };
+    message<T> msg;
+  };
+
+  // Frame buffers borrowed by connections while a message is in flight
+  template <typename T>
+  using message_pool = block_pool<frame_block<T>>;
+
+  // Shared hold on a pooled frame. A received frame travels from the socket to
+  // the handler and on to every connection it is forwarded to as leases on the
+  // buffer it was read into - nothing is copied on the way, and the last lease
+  // to go hands the buffer back to the pool. Reading is free for all holders;
+  // edit() writes in place only while there is no other lease.
+  template <typename T>
+  class frame_lease {
+  public:
+    frame_lease() = default;
+
+    // Take over a block fresh from the pool
+    explicit frame_lease(typename message_pool<T>::handle block)
+        : __block(block.release())
+    {
+      if (__block)
+        __block->leases.store(1, std::memory_order_relaxed);
+    }
+
+    frame_lease(const frame_lease &other)
+        : __block(other.__block)
+    {
+      if (__block)
+        __block->leases.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    frame_lease(frame_lease &&other) noexcept
+        : __block(std::exchange(other.__block, nullptr))
+    {
+    }
+
+    frame_lease &operator=(frame_lease other) noexcept
+    {
+      std::swap(__block, other.__block);
+      return *this;
+    }
+
+    ~frame_lease() { reset(); }
+
+    // A lease on a pooled copy of msg
+    static frame_lease copy_of(const message<T> &msg)
+    {
+      auto block = message_pool<T>::get().acquire();
+      block->msg = msg;
+      return frame_lease(std::move(block));
+    }
+
+    void reset()
+    {
+      if (__block && __block->leases.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        typename message_pool<T>::releaser{}(__block);
+      __block = nullptr;
+    }
+
+    // Writable frame: this very buffer if nobody else holds it, otherwise a
+    // private copy this lease switches over to
+    message<T> &edit()
+    {
+      if (__block->leases.load(std::memory_order_acquire) != 1)
+        *this = copy_of(__block->msg);
+      return __block->msg;
+    }
+
+    const message<T> &operator*() const { return __block->msg; }
+    const message<T> *operator->() const { return &__block->msg; }
+    explicit operator bool() const { return __block != nullptr; }
+
+  private:
+    frame_block<T> *__block = nullptr;
   };
-  // An "owned" message is identical to a regular message, but it is associated with
+
+  // An "owned" message is a regular message, but it is associated with
   // a connection. On a server, the owner would be the client that sent the message,
   // on a client the owner would be the server.
 
@@ -28,12 +169,15 @@ namespace net {
   template <typename T>
   struct owned_message {
     std::shared_ptr<connection<T>> remote = nullptr;
-    message<T> msg;
+    frame_lease<T> msg;    // the buffer the frame was received into
+
+    // Stage timestamps, only filled in when this message was picked for tracing
+    trace_stamps trace{};
 
     // Again, a friendly string maker
     friend std::ostream &operator<<(std::ostream &os, const owned_message<T> &msg)
     {
-      os << msg.msg;
+      os << *msg.msg;
       return os;
     }
   };
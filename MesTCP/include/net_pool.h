@@ -0,0 +1,171 @@
+#ifndef NET_POOL
+#define NET_POOL
+
+#include "net_common.h"
+#include <atomic>
+
+namespace net {
+  // Process wide pool of fixed-size blocks. Connections borrow their receive
+  // and send buffers from here only while a frame is actually in flight and
+  // hand them straight back afterwards, so an idle connection holds none. Up
+  // to max_idle released blocks are kept for reuse, anything above that goes
+  // back to the heap. Every thread also keeps a few released blocks to itself,
+  // so a thread that takes and gives back blocks all the time (an io thread
+  // fanning out a broadcast) rarely touches the shared lock.
+  template <typename B>
+  class block_pool {
+  public:
+    struct releaser {
+      void operator()(B *block) const { block_pool::get().release(block); }
+    };
+
+    using handle = std::unique_ptr<B, releaser>;
+
+    // Never destroyed: handles may still be released by objects that outlive
+    // main(), e.g. connections owned by a static client
+    static block_pool &get()
+    {
+      static block_pool *instance = new block_pool();
+      return *instance;
+    }
+
+    block_pool(const block_pool &) = delete;
+    block_pool &operator=(const block_pool &) = delete;
+
+    // Contents of a reused block are whatever its last user left there
+    handle acquire()
+    {
+      B *block = nullptr;
+      local_cache *cache = thread_cache();
+      if (cache && !cache->blocks.empty()) {
+        block = cache->blocks.back();
+        cache->blocks.pop_back();
+      }
+      else {
+        std::scoped_lock lock(__mux);
+        if (!__free.empty()) {
+          block = __free.back();
+          __free.pop_back();
+        }
+      }
+      if (!block)
+        block = new B();
+
+      __in_use.fetch_add(1, std::memory_order_relaxed);
+      return handle(block);
+    }
+
+    // Allocate `blocks` more blocks up front as one contiguous slab. Slab blocks
+    // are never returned to the heap, so a server that reserves its expected
+    // working set stops allocating once it is warm.
+    void reserve(std::size_t blocks)
+    {
+      if (blocks == 0)
+        return;
+      auto slab = std::make_unique<B[]>(blocks);
+      std::scoped_lock lock(__mux);
+      for (std::size_t i = 0; i < blocks; ++i)
+        __free.push_back(&slab[i]);
+      __slabs.push_back({ slab.get(), slab.get() + blocks });
+      __slab_storage.push_back(std::move(slab));
+    }
+
+    void set_max_idle(std::size_t blocks)
+    {
+      std::scoped_lock lock(__mux);
+      __max_idle = blocks;
+      auto keep = std::stable_partition(__free.begin(), __free.end(), [this](B *block) { return from_slab(block); });
+      while (__free.size() > __max_idle && __free.end() != keep) {
+        delete __free.back();
+        __free.pop_back();
+      }
+    }
+
+    // Blocks currently lent out
+    std::size_t in_use() const
+    {
+      return __in_use.load(std::memory_order_relaxed);
+    }
+
+    // Blocks parked for reuse in the shared list
+    std::size_t idle()
+    {
+      std::scoped_lock lock(__mux);
+      return __free.size();
+    }
+
+  private:
+    block_pool() = default;
+
+    // Blocks a thread keeps to itself, handed to the shared list when the
+    // thread exits
+    struct local_cache {
+      std::vector<B *> blocks;
+
+      ~local_cache()
+      {
+        block_pool &pool = block_pool::get();
+        std::scoped_lock lock(pool.__mux);
+        for (B *block : blocks)
+          pool.__free.push_back(block);
+        cache_gone() = true;
+      }
+    };
+
+    static constexpr std::size_t local_cache_size = 32;
+
+    // Trivially destructible, so still readable while the thread's other
+    // thread_locals (and, on the main thread, statics) are torn down
+    static bool &cache_gone()
+    {
+      static thread_local bool gone = false;
+      return gone;
+    }
+
+    // The calling thread's cache, nothing once it has been destroyed
+    static local_cache *thread_cache()
+    {
+      if (cache_gone())
+        return nullptr;
+      static thread_local local_cache cache;
+      return &cache;
+    }
+
+    void release(B *block)
+    {
+      __in_use.fetch_sub(1, std::memory_order_relaxed);
+      local_cache *cache = thread_cache();
+      if (cache && cache->blocks.size() < local_cache_size) {
+        cache->blocks.push_back(block);
+        return;
+      }
+      {
+        std::scoped_lock lock(__mux);
+        if (__free.size() < __max_idle || from_slab(block)) {
+          __free.push_back(block);
+          return;
+        }
+      }
+      delete block;
+    }
+
+    // Called with the lock held
+    bool from_slab(const B *block) const
+    {
+      std::less<const B *> before;
+      for (const auto &slab : __slabs)
+        if (!before(block, slab.first) && before(block, slab.second))
+          return true;
+      return false;
+    }
+
+    std::mutex __mux;
+    std::vector<B *> __free;
+    std::vector<std::pair<const B *, const B *>> __slabs;
+    std::vector<std::unique_ptr<B[]>> __slab_storage;
+    std::size_t __max_idle = 4096;
+    std::atomic<std::size_t> __in_use{ 0 };
+  };
+}    // namespace net
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef NET_PRESENCE
+#define NET_PRESENCE
+
+#include "net_common.h"
+#include "net_message.h"
+#include <cstring>
+#include <optional>
+#include <string_view>
+
+namespace net {
+  // Presence payloads, carried in message::data. Users are keyed by the id the
+  // server gave their connection; a joining client gets the whole roster as a
+  // snapshot and from then on only join / leave / rename deltas. Names are
+  // UTF-8 without a terminator.
+  //
+  //   entry          : u32 id | u8 name length | name bytes
+  //   snapshot       : u8 flags | u16 count | count * entry
+  //   join / rename  : entry
+  //   leave          : u32 id
+  struct presence_entry {
+    uint32_t id = 0;
+    std::string_view name;
+  };
+
+  constexpr uint8_t presence_snapshot_first = 0x01;    // drop the old roster before applying
+  constexpr uint8_t presence_snapshot_last = 0x02;    // the roster is complete
+  constexpr std::size_t presence_max_name = 255;
+
+  // Writes an entry at offset, returns the offset past it or 0 if it doesn't fit
+  template <std::size_t N>
+  std::size_t write_presence_entry(std::array<char, N> &data, std::size_t offset, const presence_entry &entry)
+  {
+    const std::size_t length = std::min(entry.name.size(), presence_max_name);
+    if (offset + 5 + length > N)
+      return 0;
+    put_le(data.data() + offset, entry.id);
+    data[offset + 4] = static_cast<char>(length);
+    std::memcpy(data.data() + offset + 5, entry.name.data(), length);
+    return offset + 5 + length;
+  }
+
+  // Reads an entry at offset, returns the offset past it or 0 if it is malformed
+  template <std::size_t N>
+  std::size_t read_presence_entry(const std::array<char, N> &data, std::size_t offset, presence_entry &entry)
+  {
+    if (offset + 5 > N)
+      return 0;
+    entry.id = get_le<uint32_t>(data.data() + offset);
+    const std::size_t length = static_cast<uint8_t>(data[offset + 4]);
+    if (offset + 5 + length > N)
+      return 0;
+    entry.name = std::string_view(data.data() + offset + 5, length);
+    return offset + 5 + length;
+  }
+
+  template <std::size_t N>
+  void write_presence_id(std::array<char, N> &data, uint32_t id)
+  {
+    put_le(data.data(), id);
+  }
+
+  template <std::size_t N>
+  uint32_t read_presence_id(const std::array<char, N> &data)
+  {
+    return get_le<uint32_t>(data.data());
+  }
+
+  // Packs a roster into as few snapshot payloads as it takes and hands each
+  // one to emit(const std::array<char, N> &, std::size_t used). An empty
+  // roster still produces one (empty, first and last) payload.
+  template <std::size_t N, typename Emit>
+  void pack_presence_snapshot(const std::vector<presence_entry> &roster, Emit &&emit)
+  {
+    std::array<char, N> data{};
+    std::size_t offset = 3;
+    uint16_t count = 0;
+    uint8_t flags = presence_snapshot_first;
+
+    auto flush = [&](bool last) {
+      if (last)
+        flags |= presence_snapshot_last;
+      data[0] = static_cast<char>(flags);
+      put_le(data.data() + 1, count);
+      emit(data, offset);
+      data.fill(0);
+      offset = 3;
+      count = 0;
+      flags = 0;
+    };
+
+    for (const presence_entry &entry : roster) {
+      std::size_t next = write_presence_entry(data, offset, entry);
+      if (next == 0 || count == std::numeric_limits<uint16_t>::max()) {
+        flush(false);
+        next = write_presence_entry(data, offset, entry);
+      }
+      offset = next;
+      ++count;
+    }
+    flush(true);
+  }
+
+  // Walks one snapshot payload, calls fn(const presence_entry &) per entry and
+  // returns its flags, or nothing if the payload is malformed
+  template <std::size_t N, typename Fn>
+  std::optional<uint8_t> read_presence_snapshot(const std::array<char, N> &data, Fn &&fn)
+  {
+    const uint8_t flags = static_cast<uint8_t>(data[0]);
+    const uint16_t count = get_le<uint16_t>(data.data() + 1);
+
+    std::size_t offset = 3;
+    presence_entry entry;
+    for (uint16_t i = 0; i < count; ++i) {
+      offset = read_presence_entry(data, offset, entry);
+      if (offset == 0)
+        return std::nullopt;
+      fn(entry);
+    }
+    return flags;
+  }
+}    // namespace net
+
+#endif
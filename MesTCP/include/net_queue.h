@@ -5,6 +5,43 @@
 
 namespace net {
 
+  // Lets one thread sleep until any of several queues gets something. Queues
+  // sharing a doorbell ring it on every push (see ts_queue::set_doorbell).
+  class doorbell {
+  public:
+    void ring()
+    {
+      std::unique_lock<std::mutex> ul(__mux);
+      __rings++;
+      __cv.notify_one();
+    }
+
+    // Wait until ready() holds or timeout passes, returns ready(). A ring
+    // between looking at ready() and going to sleep is not lost.
+    template <typename Rep, typename Period, typename Ready>
+    bool wait_for(const std::chrono::duration<Rep, Period> &timeout, Ready &&ready)
+    {
+      auto deadline = std::chrono::steady_clock::now() + timeout;
+      while (true) {
+        uint64_t seen;
+        {
+          std::unique_lock<std::mutex> ul(__mux);
+          seen = __rings;
+        }
+        if (ready())
+          return true;
+        std::unique_lock<std::mutex> ul(__mux);
+        if (!__cv.wait_until(ul, deadline, [&] { return __rings != seen; }))
+          return ready();
+      }
+    }
+
+  private:
+    std::mutex __mux;
+    std::condition_variable __cv;
+    uint64_t __rings = 0;
+  };
+
   template <typename T>
   class ts_queue {
   public:
@@ -53,6 +90,19 @@ namespace net {
 
       std::unique_lock<std::mutex> ul(mux_blocking);
       cvBlocking.notify_one();
+      if (__doorbell)
+        __doorbell->ring();
+    }
+
+    void push_back(T &&item)
+    {
+      std::scoped_lock lock(mux_queue);
+      deqQueue.push_back(std::move(item));
+
+      std::unique_lock<std::mutex> ul(mux_blocking);
+      cvBlocking.notify_one();
+      if (__doorbell)
+        __doorbell->ring();
     }
 
     // Adds an item to front of Queue
@@ -63,6 +113,8 @@ namespace net {
 
       std::unique_lock<std::mutex> ul(mux_blocking);
       cvBlocking.notify_one();
+      if (__doorbell)
+        __doorbell->ring();
     }
 
     // Returns true if Queue has no items
@@ -79,6 +131,12 @@ namespace net {
       return deqQueue.size();
     }
 
+    // Also ring bell on every push. Set it before anything pushes.
+    void set_doorbell(doorbell *bell)
+    {
+      __doorbell = bell;
+    }
+
     // Clears Queue
     void clear()
     {
@@ -94,11 +152,26 @@ namespace net {
       }
     }
 
+    // Like wait(), but gives up after timeout. Returns true if there is something
+    // in the Queue.
+    template <typename Rep, typename Period>
+    bool wait_for(const std::chrono::duration<Rep, Period> &timeout)
+    {
+      auto deadline = std::chrono::steady_clock::now() + timeout;
+      while (empty()) {
+        std::unique_lock<std::mutex> ul(mux_blocking);
+        if (cvBlocking.wait_until(ul, deadline) == std::cv_status::timeout)
+          return !empty();
+      }
+      return true;
+    }
+
   protected:
     std::mutex mux_queue;
     std::deque<T> deqQueue;
     std::condition_variable cvBlocking;
     std::mutex mux_blocking;
+    doorbell *__doorbell = nullptr;
   };
 }    // namespace net
 
@@ -0,0 +1,88 @@
+#ifndef NET_RATELIMIT
+#define NET_RATELIMIT
+
+#include "net_common.h"
+
+namespace net {
+  // What happens to a message that exceeds its limit
+  enum class rate_policy : uint8_t {
+    delay,         // hold it back until there are tokens again (bounded backlog)
+    drop,          // throw it away
+    disconnect     // throw it away and hang up on the sender (sender limit only,
+                   // a room limit treats it as drop)
+  };
+
+  inline const char *rate_policy_name(rate_policy policy)
+  {
+    switch (policy) {
+    case rate_policy::delay:
+      return "delay";
+    case rate_policy::drop:
+      return "drop";
+    case rate_policy::disconnect:
+      return "disconnect";
+    }
+    return "?";
+  }
+
+  struct rate_limit {
+    double rate = 0;     // tokens per second, 0 turns the limit off
+    double burst = 0;    // bucket depth, never less than one token
+    rate_policy policy = rate_policy::drop;
+
+    bool enabled() const { return rate > 0; }
+  };
+
+  // Classic token bucket. A cost larger than the whole bucket (a broadcast to
+  // a big room, say) is let through once the bucket is full and leaves it in
+  // debt, so expensive messages are slowed down rather than starved.
+  class token_bucket {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    bool try_take(const rate_limit &limit, double cost, clock::time_point now)
+    {
+      if (!limit.enabled() || cost <= 0)
+        return true;
+
+      const double depth = std::max(limit.burst, 1.0);
+      if (!__started) {
+        __tokens = depth;
+        __started = true;
+      }
+      else {
+        __tokens = std::min(depth, __tokens + std::chrono::duration<double>(now - __last).count() * limit.rate);
+      }
+      __last = now;
+
+      if (__tokens < std::min(cost, depth))
+        return false;
+      __tokens -= cost;
+      return true;
+    }
+
+    // Give back what a message took when a later check turned it away
+    void refund(double cost)
+    {
+      if (__started && cost > 0)
+        __tokens += cost;
+    }
+
+  private:
+    double __tokens = 0;
+    bool __started = false;
+    clock::time_point __last;
+  };
+
+  // How often a limit let messages through and how often each policy fired
+  struct rate_meter {
+    uint64_t admitted = 0;
+    uint64_t delayed = 0;
+    uint64_t dropped = 0;
+    uint64_t disconnected = 0;
+
+    uint64_t limited() const { return delayed + dropped + disconnected; }
+  };
+}    // namespace net
+
+#endif
@@ -0,0 +1,299 @@
+#ifndef NET_REGISTRY
+#define NET_REGISTRY
+
+#include "net_common.h"
+#include "net_message.h"
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+
+namespace net {
+  // Compile-time message registry. An application lists its message types
+  // once, each with the payload struct its frames carry:
+  //
+  //   using protocol = message_registry<
+  //     message_spec<msg_type::Ping, bytes_payload<16>>,
+  //     message_spec<msg_type::Chat, text_payload>>;
+  //
+  // and gets from it, all resolved at compile time:
+  //   - accepts(header): whether a frame header names a known type with a
+  //     payload no larger than that type allows. Connections check this on the
+  //     bare header, before any buffer is borrowed for the payload, once
+  //     registry_of<T> points at the registry.
+  //   - encode<Id>(msg, payload): fills in the frame, its type and its size.
+  //   - dispatch(handler, msg, args...): decodes the payload and calls
+  //     handler.on(message_tag<Id>{}, args..., payload) through a jump table
+  //     indexed by type. Types the handler has no on() for, and payloads that
+  //     fail to decode, are rejected (dispatch returns false).
+  //
+  // A payload struct provides
+  //   static constexpr std::size_t max_size;
+  //   std::size_t encode(std::array<char, max_text_bytes> &data) const;   // bytes written
+  //   static bool decode(const std::array<char, max_text_bytes> &data, std::size_t size, Payload &out);
+  //
+  // A payload that may travel in frames larger than a buffer (file chunks sent
+  // from disk) also provides
+  //   static constexpr std::size_t max_wire_size;    // payload on the wire
+  //   static constexpr std::size_t split_head;       // bytes every piece starts with
+  //   static void split_advance(char *head, std::size_t bytes);
+  // The receiving connection cuts such a frame into pieces of up to max_size,
+  // each one the head followed by the next bytes, and moves the head on past
+  // the bytes of every piece. Handlers only ever see the pieces.
+
+  // remove_cv: Spec::id is a const static member, its tag must still match
+  // the one handlers spell with the plain enumerator
+  template <auto Id>
+  using message_tag = std::integral_constant<std::remove_cv_t<decltype(Id)>, Id>;
+
+  template <auto Id, typename Payload>
+  struct message_spec {
+    static constexpr auto id = Id;
+    using payload = Payload;
+    static_assert(Payload::max_size <= max_text_bytes, "payload does not fit in a frame");
+  };
+
+  // Largest head of a split payload, see above
+  constexpr std::size_t max_split_head = 16;
+
+  // How the pieces of an oversized frame are made, head 0 for types that are
+  // never split
+  struct split_rule {
+    std::size_t head = 0;
+    void (*advance)(char *head, std::size_t bytes) = nullptr;
+  };
+
+  template <typename Payload, typename = void>
+  struct split_payload : std::false_type {};
+
+  template <typename Payload>
+  struct split_payload<Payload, std::void_t<decltype(Payload::split_head)>> : std::true_type {
+    static_assert(Payload::split_head > 0 && Payload::split_head <= max_split_head, "split head too large");
+    static_assert(Payload::max_size == max_text_bytes, "the pieces of a split payload fill a frame");
+  };
+
+  // Point this at an application's registry to have connections validate
+  // incoming frame headers against it
+  template <typename T>
+  struct registry_of {
+    using type = void;
+  };
+
+  template <typename T>
+  constexpr bool frame_accepted(const message_header<T> &header)
+  {
+    using registry = typename registry_of<T>::type;
+    if constexpr (std::is_void_v<registry>)
+      return header.size <= max_text_bytes;
+    else
+      return registry::accepts(header);
+  }
+
+  template <typename T>
+  constexpr split_rule frame_split(const message_header<T> &header)
+  {
+    using registry = typename registry_of<T>::type;
+    if constexpr (std::is_void_v<registry>)
+      return {};
+    else
+      return registry::split_of(header.id);
+  }
+
+  // No payload at all
+  struct empty_payload {
+    static constexpr std::size_t max_size = 0;
+
+    std::size_t encode(std::array<char, max_text_bytes> &) const { return 0; }
+
+    static bool decode(const std::array<char, max_text_bytes> &, std::size_t size, empty_payload &)
+    {
+      return size == 0;
+    }
+  };
+
+  // Up to N opaque bytes, laid out by whoever reads them
+  template <std::size_t N>
+  struct bytes_payload {
+    static constexpr std::size_t max_size = N;
+    std::string_view bytes;
+
+    std::size_t encode(std::array<char, max_text_bytes> &data) const
+    {
+      const std::size_t size = std::min(bytes.size(), N);
+      std::memcpy(data.data(), bytes.data(), size);
+      return size;
+    }
+
+    static bool decode(const std::array<char, max_text_bytes> &data, std::size_t size, bytes_payload &out)
+    {
+      out.bytes = std::string_view(data.data(), size);
+      return size <= N;
+    }
+  };
+
+  // UTF-8 text of up to N bytes, terminator included (see set_field_text)
+  template <std::size_t N>
+  struct text_payload {
+    static constexpr std::size_t max_size = N;
+    std::string_view text;
+
+    std::size_t encode(std::array<char, max_text_bytes> &data) const
+    {
+      const std::size_t len = utf8_fit(text, N - 1);
+      std::memcpy(data.data(), text.data(), len);
+      data[len] = '\0';
+      return len + 1;
+    }
+
+    static bool decode(const std::array<char, max_text_bytes> &data, std::size_t size, text_payload &out)
+    {
+      if (size > N)
+        return false;
+      out.text = std::string_view(data.data(), std::find(data.data(), data.data() + size, '\0') - data.data());
+      return true;
+    }
+  };
+
+  template <typename... Specs>
+  class message_registry {
+    static_assert(sizeof...(Specs) > 0, "a registry needs at least one message type");
+
+  public:
+    using id_type = std::common_type_t<std::remove_const_t<decltype(Specs::id)>...>;
+
+  private:
+    static constexpr std::size_t index(id_type id)
+    {
+      return static_cast<std::size_t>(id);
+    }
+
+    static constexpr std::size_t table_size = std::max({ index(Specs::id)... }) + 1;
+    static constexpr std::size_t rejected = std::numeric_limits<std::size_t>::max();
+
+    static constexpr std::array<std::size_t, table_size> make_limits()
+    {
+      std::array<std::size_t, table_size> limits{};
+      for (auto &limit : limits)
+        limit = rejected;
+      ((limits[index(Specs::id)] = wire_size<typename Specs::payload>()), ...);
+      return limits;
+    }
+
+    template <typename Payload>
+    static constexpr std::size_t wire_size()
+    {
+      if constexpr (split_payload<Payload>::value)
+        return Payload::max_wire_size;
+      else
+        return Payload::max_size;
+    }
+
+    static constexpr std::array<split_rule, table_size> make_splits()
+    {
+      std::array<split_rule, table_size> splits{};
+      (
+        [&splits] {
+          if constexpr (split_payload<typename Specs::payload>::value)
+            splits[index(Specs::id)] = { Specs::payload::split_head, &Specs::payload::split_advance };
+        }(),
+        ...);
+      return splits;
+    }
+
+    static constexpr std::array<std::size_t, table_size> __limits = make_limits();
+    static constexpr std::array<split_rule, table_size> __splits = make_splits();
+
+    template <id_type Id, typename Spec, typename... Rest>
+    static constexpr auto find_spec()
+    {
+      if constexpr (Spec::id == Id)
+        return Spec{};
+      else {
+        static_assert(sizeof...(Rest) > 0, "message type is not in the registry");
+        return find_spec<Id, Rest...>();
+      }
+    }
+
+  public:
+    template <id_type Id>
+    using payload_of = typename decltype(find_spec<Id, Specs...>())::payload;
+
+    static constexpr bool accepts(const message_header<id_type> &header)
+    {
+      const std::size_t i = index(header.id);
+      return i < table_size && __limits[i] != rejected && header.size <= __limits[i];
+    }
+
+    // How frames of a type larger than a buffer are cut up, see split_rule
+    static constexpr split_rule split_of(id_type id)
+    {
+      const std::size_t i = index(id);
+      return i < table_size ? __splits[i] : split_rule{};
+    }
+
+    // Largest payload a type may carry on the wire, nothing for unknown types
+    static constexpr std::optional<std::size_t> max_payload(id_type id)
+    {
+      const std::size_t i = index(id);
+      if (i >= table_size || __limits[i] == rejected)
+        return std::nullopt;
+      return __limits[i];
+    }
+
+    template <id_type Id>
+    static message<id_type> &encode(message<id_type> &msg, const payload_of<Id> &payload)
+    {
+      msg.header.id = Id;
+      msg.header.size = static_cast<uint32_t>(payload.encode(msg.data));
+      return msg;
+    }
+
+    template <typename Handler, typename... Args>
+    static bool dispatch(Handler &handler, const message<id_type> &msg, Args &&...args)
+    {
+      static constexpr auto table = make_table<Handler, Args &&...>();
+      const std::size_t i = index(msg.header.id);
+      if (i >= table_size || !table[i])
+        return false;
+      return table[i](handler, msg, std::forward<Args>(args)...);
+    }
+
+  private:
+    template <typename Spec, typename Handler, typename... Args>
+    static bool invoke(Handler &handler, const message<id_type> &msg, Args... args)
+    {
+      typename Spec::payload payload{};
+      if (msg.header.size > Spec::payload::max_size || !Spec::payload::decode(msg.data, msg.header.size, payload))
+        return false;
+      handler.on(message_tag<Spec::id>{}, std::forward<Args>(args)..., static_cast<const typename Spec::payload &>(payload));
+      return true;
+    }
+
+    template <typename... Args>
+    struct arg_list {};
+
+    template <typename Spec, typename Handler, typename ArgList, typename = void>
+    struct handles : std::false_type {};
+
+    template <typename Spec, typename Handler, typename... Args>
+    struct handles<Spec, Handler, arg_list<Args...>,
+                   std::void_t<decltype(std::declval<Handler &>().on(message_tag<Spec::id>{}, std::declval<Args>()...,
+                                                                       std::declval<const typename Spec::payload &>()))>>
+        : std::true_type {};
+
+    template <typename Handler, typename... Args>
+    static constexpr auto make_table()
+    {
+      using entry = bool (*)(Handler &, const message<id_type> &, Args...);
+      std::array<entry, table_size> table{};
+      (
+        [&table] {
+          if constexpr (handles<Specs, Handler, arg_list<Args...>>::value)
+            table[index(Specs::id)] = &invoke<Specs, Handler, Args...>;
+        }(),
+        ...);
+      return table;
+    }
+  };
+}    // namespace net
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef NET_SESSION
+#define NET_SESSION
+
+#include "net_common.h"
+#include "net_message.h"
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <random>
+
+namespace net {
+  // Resumable sessions. Relayed room traffic carries a sequence number in
+  // header.seq, counting up from 1 per room; frames outside the room's stream
+  // leave it at 0. Every session is handed a ticket when it connects, and a
+  // client that lost its connection presents the old ticket plus the last
+  // sequence number it saw. The server answers with a resume_result and then
+  // the frames it missed, straight from the room's replay_buffer, queued as
+  // one burst.
+  //
+  //   ticket        : u64 token | u32 seq (the room's newest frame when issued)
+  //   resume result : u32 from | u32 to | u8 status   (replays from+1 ... to)
+
+  struct session_ticket {
+    static constexpr std::size_t max_size = 12;
+    uint64_t token = 0;
+    uint32_t seq = 0;
+
+    std::size_t encode(std::array<char, max_text_bytes> &data) const
+    {
+      put_le(data.data(), token);
+      put_le(data.data() + 8, seq);
+      return max_size;
+    }
+
+    static bool decode(const std::array<char, max_text_bytes> &data, std::size_t size, session_ticket &out)
+    {
+      out.token = get_le<uint64_t>(data.data());
+      out.seq = get_le<uint32_t>(data.data() + 8);
+      return size == max_size;
+    }
+  };
+
+  enum class resume_status : uint8_t {
+    complete,    // every missed frame follows
+    partial,     // the oldest missed frames are gone, the rest follow
+    unknown      // not a ticket of this server's stream, nothing follows
+  };
+
+  struct resume_result {
+    static constexpr std::size_t max_size = 9;
+    uint32_t from = 0;
+    uint32_t to = 0;
+    resume_status status = resume_status::unknown;
+
+    std::size_t encode(std::array<char, max_text_bytes> &data) const
+    {
+      put_le(data.data(), from);
+      put_le(data.data() + 4, to);
+      data[8] = static_cast<char>(status);
+      return max_size;
+    }
+
+    static bool decode(const std::array<char, max_text_bytes> &data, std::size_t size, resume_result &out)
+    {
+      out.from = get_le<uint32_t>(data.data());
+      out.to = get_le<uint32_t>(data.data() + 4);
+      out.status = static_cast<resume_status>(data[8]);
+      return size == max_size && out.status <= resume_status::unknown && out.from <= out.to;
+    }
+  };
+
+  // Tokens carry a random stream id in their top half, drawn once per server
+  // run, so a ticket from before a restart (or from another server) is told
+  // apart from a live one without keeping any state per session.
+  class session_tokens {
+  public:
+    session_tokens()
+        : __stream(std::random_device{}() | 1u)
+    {
+    }
+
+    uint64_t issue()
+    {
+      return (static_cast<uint64_t>(__stream) << 32) | __issued.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool known(uint64_t token) const
+    {
+      return static_cast<uint32_t>(token >> 32) == __stream;
+    }
+
+  private:
+    const uint32_t __stream;
+    std::atomic<uint32_t> __issued{ 1 };
+  };
+
+  // A client's side of a session: the ticket to resume with, and which
+  // sequenced frames are new. After a reconnect the live stream may overtake
+  // the server's answer to the resume, so the replay that follows the answer
+  // and the live frames seen meanwhile overlap; each frame is let through once.
+  class session_tracker {
+  public:
+    const session_ticket &ticket() const { return __session; }
+    bool resume_pending() const { return __resume_pending; }
+
+    // Only taken up if there is no session yet
+    void restore(const session_ticket &ticket)
+    {
+      if (!__session.token)
+        __session = ticket;
+    }
+
+    // Called on every connect: coming back after a previous session means
+    // resuming it
+    void on_reconnect()
+    {
+      if (!__session.token)
+        return;
+      __resume_pending = true;
+      __next_ticket = {};
+      __first_live = std::numeric_limits<uint32_t>::max();
+      __live_max = 0;
+      __replay_to = 0;
+    }
+
+    // A ticket came with the server's accept. On a reconnect it is only taken
+    // up once the server has answered the resume.
+    void on_ticket(const session_ticket &ticket)
+    {
+      if (__resume_pending)
+        __next_ticket = ticket;
+      else
+        __session = ticket;
+    }
+
+    void on_resumed(const resume_result &result)
+    {
+      __resume_pending = false;
+      if (__next_ticket.token)
+        __session.token = __next_ticket.token;
+      if (result.status == resume_status::unknown) {
+        // Another stream altogether, start over from where it is now
+        __session.seq = std::max(__next_ticket.seq, __live_max);
+      }
+      else if (result.to > result.from)
+        __replay_to = result.to;
+      else
+        __session.seq = std::max(__session.seq, __live_max);
+    }
+
+    // False for a frame already seen
+    bool on_sequenced(uint32_t seq)
+    {
+      if (seq == 0)
+        return true;
+
+      // Live frames overtaking the answer to a resume
+      if (__resume_pending) {
+        __first_live = std::min(__first_live, seq);
+        __live_max = std::max(__live_max, seq);
+        return true;
+      }
+
+      // The replay, up to where the live stream took over
+      if (__replay_to && seq <= __replay_to) {
+        const bool fresh = seq < __first_live && seq > __session.seq;
+        if (fresh)
+          __session.seq = seq;
+        if (seq == __replay_to) {
+          __session.seq = std::max(__session.seq, __live_max);
+          __replay_to = 0;
+        }
+        return fresh;
+      }
+      if (__replay_to) {
+        __session.seq = std::max(__session.seq, __live_max);
+        __replay_to = 0;
+      }
+
+      if (seq <= __session.seq)
+        return false;
+      __session.seq = seq;
+      return true;
+    }
+
+  private:
+    session_ticket __session;
+    session_ticket __next_ticket;
+    bool __resume_pending = false;
+    uint32_t __first_live = std::numeric_limits<uint32_t>::max();
+    uint32_t __live_max = 0;
+    uint32_t __replay_to = 0;
+  };
+
+  // The newest frames of a room's stream, kept as leases on the frames that
+  // went out (nothing is copied). stamp() and collect() belong to the thread
+  // that relays; head() may be read from anywhere.
+  template <typename T>
+  class replay_buffer {
+  public:
+    explicit replay_buffer(std::size_t capacity = 1024)
+        : __frames(std::max<std::size_t>(capacity, 1))
+    {
+    }
+
+    // Give frame the next sequence number and keep a lease on it. Call this
+    // before the frame is fanned out, while it can still be written in place.
+    uint32_t stamp(frame_lease<T> &frame)
+    {
+      const uint32_t seq = __head.load(std::memory_order_relaxed) + 1;
+      frame.edit().header.seq = seq;
+      __frames[seq % __frames.size()] = frame;
+      __head.store(seq, std::memory_order_release);
+      return seq;
+    }
+
+    // Newest sequence number handed out, 0 before the first
+    uint32_t head() const
+    {
+      return __head.load(std::memory_order_acquire);
+    }
+
+    // Append everything after seq that is still buffered to out, oldest
+    // first. Returns what the replay covers.
+    resume_result collect(uint32_t seq, std::vector<frame_lease<T>> &out) const
+    {
+      resume_result result;
+      result.to = head();
+      const uint32_t oldest = result.to >= __frames.size() ? result.to - static_cast<uint32_t>(__frames.size()) + 1 : 1;
+      result.from = std::min(std::max(seq, oldest - 1), result.to);
+      result.status = seq + 1 >= oldest || seq >= result.to ? resume_status::complete : resume_status::partial;
+      for (uint32_t s = result.from + 1; s <= result.to; ++s)
+        out.push_back(__frames[s % __frames.size()]);
+      return result;
+    }
+
+  private:
+    std::vector<frame_lease<T>> __frames;
+    std::atomic<uint32_t> __head{ 0 };
+  };
+}    // namespace net
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef NET_SNAPSHOT
+#define NET_SNAPSHOT
+
+#include "net_common.h"
+#include "net_log.h"
+#include <atomic>
+
+namespace net {
+  // Epoch-based reclamation shared by every snapshot_list. Each thread that
+  // reads a snapshot owns a slot where it announces the epoch it entered at;
+  // writers only free a retired version once no slot announces an epoch at or
+  // before the one it was retired in.
+  class epoch_domain {
+  public:
+    static constexpr std::size_t max_threads = 256;
+    static constexpr uint64_t idle = std::numeric_limits<uint64_t>::max();
+
+    static epoch_domain &get()
+    {
+      static epoch_domain instance;
+      return instance;
+    }
+
+    // Reader side - two stores and a load, never waits on anyone
+    void enter()
+    {
+      thread_state &state = local();
+      if (state.depth++ == 0 && state.owned)
+        state.owned->epoch.store(__epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+    }
+
+    void leave()
+    {
+      thread_state &state = local();
+      if (--state.depth == 0 && state.owned)
+        state.owned->epoch.store(idle, std::memory_order_release);
+    }
+
+    // Writer side - call after unpublishing something, returns its retire epoch
+    uint64_t retire_epoch()
+    {
+      return __epoch.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    // True once no reader can still see something retired at `epoch`
+    bool quiescent(uint64_t epoch) const
+    {
+      for (const slot &s : __slots)
+        if (s.epoch.load(std::memory_order_seq_cst) <= epoch)
+          return false;
+      return true;
+    }
+
+  private:
+    struct alignas(64) slot {
+      std::atomic<uint64_t> epoch{ idle };
+      std::atomic<bool> in_use{ false };
+    };
+
+    // Claims a slot on first use and hands it back when the thread exits
+    struct thread_state {
+      slot *owned = nullptr;
+      uint32_t depth = 0;
+
+      explicit thread_state(epoch_domain &domain)
+      {
+        for (auto &s : domain.__slots) {
+          bool expected = false;
+          if (s.in_use.compare_exchange_strong(expected, true)) {
+            owned = &s;
+            return;
+          }
+        }
+        log_error("[EPOCH] Out of reader slots, snapshots read without protection");
+      }
+
+      ~thread_state()
+      {
+        if (owned) {
+          owned->epoch.store(idle, std::memory_order_release);
+          owned->in_use.store(false, std::memory_order_release);
+        }
+      }
+    };
+
+    thread_state &local()
+    {
+      static thread_local thread_state state(*this);
+      return state;
+    }
+
+    std::atomic<uint64_t> __epoch{ 0 };
+    std::array<slot, max_threads> __slots;
+  };
+
+  // A list published as immutable versions (RCU). Readers get the current
+  // version without taking any lock and can iterate it while writers build and
+  // publish the next one; old versions are reclaimed once every reader that
+  // might still see them has moved on. Every publish copies the list, so
+  // frequent small changes should be batched: stage() additions and publish
+  // them together, remove with one remove_if per sweep.
+  template <typename T>
+  class snapshot_list {
+  public:
+    using list_type = std::vector<T>;
+
+    snapshot_list()
+        : __current(new list_type()) {}
+
+    snapshot_list(const snapshot_list &) = delete;
+    snapshot_list &operator=(const snapshot_list &) = delete;
+
+    ~snapshot_list()
+    {
+      delete __current.load(std::memory_order_relaxed);
+      for (auto &r : __retired)
+        delete r.version;
+    }
+
+    // Keeps one version alive and readable for as long as the guard lives
+    class read_guard {
+    public:
+      explicit read_guard(const snapshot_list &list)
+      {
+        epoch_domain::get().enter();
+        __version = list.__current.load(std::memory_order_seq_cst);
+      }
+
+      ~read_guard() { epoch_domain::get().leave(); }
+
+      read_guard(const read_guard &) = delete;
+      read_guard &operator=(const read_guard &) = delete;
+
+      const list_type &operator*() const { return *__version; }
+      const list_type *operator->() const { return __version; }
+
+    private:
+      const list_type *__version;
+    };
+
+    read_guard read() const
+    {
+      return read_guard(*this);
+    }
+
+    // Copy the current version, let `fn` edit the copy, publish it
+    template <typename Fn>
+    void update(Fn &&fn)
+    {
+      std::scoped_lock lock(__mux_writer);
+      auto *next = new list_type(*__current.load(std::memory_order_relaxed));
+      fn(*next);
+      publish(next);
+    }
+
+    void push_back(T item)
+    {
+      update([&item](list_type &items) { items.push_back(std::move(item)); });
+    }
+
+    // Queue an item for the next publish_staged(). Readers don't see it
+    // before then; a burst of additions costs one copy of the list in all.
+    void stage(T item)
+    {
+      std::scoped_lock lock(__mux_staged);
+      __staged.push_back(std::move(item));
+      __has_staged.store(true, std::memory_order_release);
+    }
+
+    // Publish everything staged so far as one new version. Cheap when
+    // nothing is staged.
+    void publish_staged()
+    {
+      if (!__has_staged.load(std::memory_order_acquire))
+        return;
+      list_type staged;
+      {
+        std::scoped_lock lock(__mux_staged);
+        staged.swap(__staged);
+        __has_staged.store(false, std::memory_order_relaxed);
+      }
+      if (!staged.empty())
+        update([&staged](list_type &items) { items.insert(items.end(), std::make_move_iterator(staged.begin()), std::make_move_iterator(staged.end())); });
+    }
+
+    // Remove every element matching pred, returns the removed elements so the
+    // caller can act on exactly the ones it took out
+    template <typename Pred>
+    list_type remove_if(Pred &&pred)
+    {
+      list_type removed;
+      std::scoped_lock lock(__mux_writer);
+      const list_type &now = *__current.load(std::memory_order_relaxed);
+      if (std::none_of(now.begin(), now.end(), pred))
+        return removed;
+
+      auto *next = new list_type();
+      next->reserve(now.size());
+      for (const T &item : now)
+        (pred(item) ? removed : *next).push_back(item);
+      publish(next);
+      return removed;
+    }
+
+    std::size_t size() const
+    {
+      return read()->size();
+    }
+
+  private:
+    struct retired_version {
+      const list_type *version;
+      uint64_t epoch;
+    };
+
+    // Called with the writer lock held
+    void publish(const list_type *next)
+    {
+      const list_type *old = __current.exchange(next, std::memory_order_seq_cst);
+      __retired.push_back({ old, epoch_domain::get().retire_epoch() });
+
+      // Reclaim whatever no reader can reach any more
+      auto keep = std::remove_if(__retired.begin(), __retired.end(), [](const retired_version &r) {
+        if (!epoch_domain::get().quiescent(r.epoch))
+          return false;
+        delete r.version;
+        return true;
+      });
+      __retired.erase(keep, __retired.end());
+    }
+
+    std::atomic<const list_type *> __current;
+    std::mutex __mux_writer;
+    std::vector<retired_version> __retired;
+
+    std::mutex __mux_staged;
+    list_type __staged;
+    std::atomic<bool> __has_staged{ false };
+  };
+}    // namespace net
+
+#endif
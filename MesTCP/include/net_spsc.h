@@ -0,0 +1,68 @@
+#ifndef NET_SPSC
+#define NET_SPSC
+
+#include "net_common.h"
+#include <atomic>
+
+namespace net {
+  // Bounded single-producer single-consumer ring. One thread pushes, one other
+  // thread pops, and neither ever takes a lock: each side owns one index and
+  // only reads the other's. The indices live on cache lines of their own so
+  // the two cores don't keep stealing each other's line.
+  template <typename T, std::size_t Capacity>
+  class spsc_ring {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+  public:
+    spsc_ring() = default;
+    spsc_ring(const spsc_ring &) = delete;
+    spsc_ring &operator=(const spsc_ring &) = delete;
+
+    // Producer side. Returns false, leaving item untouched, when the ring is full.
+    bool try_push(T &&item)
+    {
+      const std::size_t tail = __tail.load(std::memory_order_relaxed);
+      if (tail - __head_cache == Capacity) {
+        __head_cache = __head.load(std::memory_order_acquire);
+        if (tail - __head_cache == Capacity)
+          return false;
+      }
+      __slots[tail & (Capacity - 1)] = std::move(item);
+      __tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Consumer side. Returns false when the ring is empty.
+    bool try_pop(T &item)
+    {
+      const std::size_t head = __head.load(std::memory_order_relaxed);
+      if (head == __tail_cache) {
+        __tail_cache = __tail.load(std::memory_order_acquire);
+        if (head == __tail_cache)
+          return false;
+      }
+      item = std::move(__slots[head & (Capacity - 1)]);
+      __head.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Only a hint from any thread but the consumer
+    bool empty() const
+    {
+      return __head.load(std::memory_order_acquire) == __tail.load(std::memory_order_acquire);
+    }
+
+  private:
+    // Consumer's index, and its last look at the producer's
+    alignas(64) std::atomic<std::size_t> __head{ 0 };
+    std::size_t __tail_cache = 0;
+
+    // Producer's index, and its last look at the consumer's
+    alignas(64) std::atomic<std::size_t> __tail{ 0 };
+    std::size_t __head_cache = 0;
+
+    alignas(64) std::array<T, Capacity> __slots{};
+  };
+}    // namespace net
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef NET_TOPIC
+#define NET_TOPIC
+
+#include "net_common.h"
+#include "net_message.h"
+#include "net_utf8.h"
+#include <cstring>
+#include <map>
+#include <string_view>
+#include <vector>
+
+namespace net {
+  // Topics. A topic names what a message is about as levels separated by
+  // dots, e.g. "alerts.db.critical". Subscriptions are patterns over those
+  // levels: "*" stands for exactly one level, "#" (last level only) for any
+  // number of them, none included - "team.#" matches "team" and
+  // "team.ops.oncall" alike. Levels are non-empty UTF-8 and only patterns may
+  // use "*" and "#", which must then be a whole level.
+  //
+  //   message : u8 topic length | topic bytes | text bytes (UTF-8)
+  constexpr std::size_t topic_max_bytes = 255;
+  constexpr std::size_t topic_max_levels = 32;
+
+  namespace topic_detail {
+    // Calls fn(level) for each level of topic, returns how many there were,
+    // or 0 if an empty level (or too many levels) makes topic invalid
+    template <typename Fn>
+    std::size_t for_each_level(std::string_view topic, Fn &&fn)
+    {
+      if (topic.empty() || topic.size() > topic_max_bytes)
+        return 0;
+      std::size_t levels = 0;
+      for (std::size_t start = 0;;) {
+        const std::size_t dot = std::min(topic.find('.', start), topic.size());
+        if (dot == start || ++levels > topic_max_levels)
+          return 0;
+        fn(topic.substr(start, dot - start), dot == topic.size());
+        if (dot == topic.size())
+          return levels;
+        start = dot + 1;
+      }
+    }
+  }    // namespace topic_detail
+
+  // A topic messages may be published to: no wildcards
+  inline bool topic_valid(std::string_view topic)
+  {
+    bool plain = true;
+    const std::size_t levels = topic_detail::for_each_level(topic, [&](std::string_view level, bool) {
+      plain = plain && level.find_first_of("*#") == std::string_view::npos;
+    });
+    return levels && plain && utf8_validate(topic);
+  }
+
+  // A pattern that may be subscribed to
+  inline bool topic_pattern_valid(std::string_view pattern)
+  {
+    bool valid = true;
+    const std::size_t levels = topic_detail::for_each_level(pattern, [&](std::string_view level, bool last) {
+      if (level == "*" || (level == "#" && last))
+        return;
+      valid = valid && level.find_first_of("*#") == std::string_view::npos;
+    });
+    return levels && valid && utf8_validate(pattern);
+  }
+
+  struct topic_message {
+    static constexpr std::size_t max_size = max_text_bytes;
+    std::string_view topic;
+    std::string_view text;
+
+    std::size_t encode(std::array<char, max_text_bytes> &data) const
+    {
+      const std::size_t topic_bytes = utf8_fit(topic, topic_max_bytes);
+      const std::size_t text_bytes = utf8_fit(text, max_size - 1 - topic_bytes);
+      data[0] = static_cast<char>(topic_bytes);
+      std::memcpy(data.data() + 1, topic.data(), topic_bytes);
+      if (text_bytes > 0)
+        std::memcpy(data.data() + 1 + topic_bytes, text.data(), text_bytes);
+      return 1 + topic_bytes + text_bytes;
+    }
+
+    static bool decode(const std::array<char, max_text_bytes> &data, std::size_t size, topic_message &out)
+    {
+      if (size < 1)
+        return false;
+      const std::size_t topic_bytes = static_cast<uint8_t>(data[0]);
+      if (1 + topic_bytes > size)
+        return false;
+      out.topic = std::string_view(data.data() + 1, topic_bytes);
+      out.text = std::string_view(data.data() + 1 + topic_bytes, size - 1 - topic_bytes);
+      return true;
+    }
+  };
+
+  // Subscriptions by pattern, one trie level per topic level. A topic is
+  // matched by walking its levels once, following at each step the literal
+  // child and the "*" child and picking up the "#" subscribers on the way, so
+  // the cost depends on the topic's depth, not on how many subscriptions
+  // there are. The resulting fan-out list is cached per topic until the
+  // subscriptions next change. Sub only needs == and <, e.g. a connection
+  // pointer.
+  template <typename Sub>
+  class topic_trie {
+  public:
+    using fanout = std::shared_ptr<const std::vector<Sub>>;
+
+    // False if sub already has this pattern (or it is not a valid pattern)
+    bool subscribe(std::string_view pattern, const Sub &sub)
+    {
+      if (!topic_pattern_valid(pattern))
+        return false;
+      std::vector<Sub> &subs = subscribers(*find_or_add(pattern), pattern);
+      if (std::find(subs.begin(), subs.end(), sub) != subs.end())
+        return false;
+      subs.push_back(sub);
+      __cache.clear();
+      return true;
+    }
+
+    // False if sub did not have this pattern
+    bool unsubscribe(std::string_view pattern, const Sub &sub)
+    {
+      node *n = find(pattern);
+      if (!n)
+        return false;
+      std::vector<Sub> &subs = subscribers(*n, pattern);
+      auto it = std::find(subs.begin(), subs.end(), sub);
+      if (it == subs.end())
+        return false;
+      *it = std::move(subs.back());
+      subs.pop_back();
+      prune(pattern);
+      __cache.clear();
+      return true;
+    }
+
+    // Everyone subscribed to a pattern matching topic, each once. The list
+    // stays valid for as long as it is held, subscriptions may change
+    // meanwhile.
+    fanout match(std::string_view topic)
+    {
+      auto cached = __cache.find(topic);
+      if (cached != __cache.end())
+        return cached->second;
+
+      std::vector<Sub> subs;
+      std::vector<const node *> at{ &__root }, next;
+      const std::size_t levels = topic_detail::for_each_level(topic, [&](std::string_view level, bool) {
+        next.clear();
+        for (const node *n : at) {
+          subs.insert(subs.end(), n->rest.begin(), n->rest.end());
+          if (auto child = n->children.find(level); child != n->children.end())
+            next.push_back(child->second.get());
+          if (auto any = n->children.find(std::string_view("*")); any != n->children.end())
+            next.push_back(any->second.get());
+        }
+        at.swap(next);
+      });
+      if (!levels)
+        at.clear();
+      // "#" matches no level at all too
+      for (const node *n : at) {
+        subs.insert(subs.end(), n->here.begin(), n->here.end());
+        subs.insert(subs.end(), n->rest.begin(), n->rest.end());
+      }
+      // One client may hold several patterns that match
+      std::sort(subs.begin(), subs.end());
+      subs.erase(std::unique(subs.begin(), subs.end()), subs.end());
+
+      // Publishers rarely use many distinct topics; if they do, start over
+      // rather than grow without bound
+      if (__cache.size() >= max_cached_topics)
+        __cache.clear();
+      auto result = std::make_shared<const std::vector<Sub>>(std::move(subs));
+      __cache.emplace(std::string(topic), result);
+      return result;
+    }
+
+  private:
+    struct node {
+      std::map<std::string, std::unique_ptr<node>, std::less<>> children;
+      std::vector<Sub> here;    // patterns ending at this level
+      std::vector<Sub> rest;    // patterns ending in "#" after this level
+    };
+
+    static constexpr std::size_t max_cached_topics = 4096;
+
+    // The node a pattern's subscribers hang off: the one its "#" follows, or
+    // the one for its last level
+    static std::string_view path_of(std::string_view pattern)
+    {
+      if (pattern == "#")
+        return {};
+      if (pattern.size() >= 2 && pattern.substr(pattern.size() - 2) == ".#")
+        return pattern.substr(0, pattern.size() - 2);
+      return pattern;
+    }
+
+    static std::vector<Sub> &subscribers(node &n, std::string_view pattern)
+    {
+      return path_of(pattern).size() == pattern.size() ? n.here : n.rest;
+    }
+
+    node *find_or_add(std::string_view pattern)
+    {
+      node *n = &__root;
+      const std::string_view path = path_of(pattern);
+      if (!path.empty())
+        topic_detail::for_each_level(path, [&](std::string_view level, bool) {
+          auto child = n->children.find(level);
+          if (child == n->children.end())
+            child = n->children.emplace(std::string(level), std::make_unique<node>()).first;
+          n = child->second.get();
+        });
+      return n;
+    }
+
+    node *find(std::string_view pattern)
+    {
+      if (!topic_pattern_valid(pattern))
+        return nullptr;
+      node *n = &__root;
+      const std::string_view path = path_of(pattern);
+      if (!path.empty())
+        topic_detail::for_each_level(path, [&](std::string_view level, bool) {
+          if (!n)
+            return;
+          auto child = n->children.find(level);
+          n = child == n->children.end() ? nullptr : child->second.get();
+        });
+      return n;
+    }
+
+    // Drop the nodes along pattern's path that no longer lead anywhere
+    void prune(std::string_view pattern)
+    {
+      std::vector<std::pair<node *, std::string_view>> path;
+      node *n = &__root;
+      const std::string_view levels = path_of(pattern);
+      if (!levels.empty())
+        topic_detail::for_each_level(levels, [&](std::string_view level, bool) {
+          path.emplace_back(n, level);
+          n = n->children.find(level)->second.get();
+        });
+      for (auto step = path.rbegin(); step != path.rend(); ++step) {
+        auto child = step->first->children.find(step->second);
+        const node &c = *child->second;
+        if (!c.children.empty() || !c.here.empty() || !c.rest.empty())
+          break;
+        step->first->children.erase(child);
+      }
+    }
+
+    node __root;
+    std::map<std::string, fanout, std::less<>> __cache;
+  };
+}    // namespace net
+
+#endif
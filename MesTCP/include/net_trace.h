@@ -0,0 +1,211 @@
+#ifndef NET_TRACE
+#define NET_TRACE
+
+#include "net_common.h"
+#include "net_log.h"
+#include <atomic>
+#include <cmath>
+
+namespace net {
+  // Monotonic clock used for every latency measurement (message<T>::time is
+  // wall-clock and only meaningful to humans)
+  using trace_clock = std::chrono::steady_clock;
+
+  // Points in a message's life inside this process
+  enum class trace_stage : uint8_t {
+    recv_complete,    // last byte read from the socket
+    dequeued,    // popped from the incoming queue by update()
+    dispatched,    // __on_message returned
+    enqueued_out,    // a reply/relay was handed to a connection
+    write_complete,    // that reply/relay left through the socket
+    count
+  };
+
+  // Intervals aggregated into histograms
+  enum class trace_span : uint8_t {
+    inbound_queue,    // recv_complete -> dequeued
+    handler,    // dequeued -> dispatched
+    to_outbound,    // dequeued -> enqueued_out
+    outbound_write,    // enqueued_out -> write_complete
+    end_to_end,    // recv_complete -> write_complete
+    count
+  };
+
+  inline const char *trace_span_name(trace_span span)
+  {
+    switch (span) {
+    case trace_span::inbound_queue: return "inbound queue";
+    case trace_span::handler: return "handler";
+    case trace_span::to_outbound: return "to outbound";
+    case trace_span::outbound_write: return "outbound+write";
+    case trace_span::end_to_end: return "end to end";
+    default: return "?";
+    }
+  }
+
+  // Per-message stamps. Only sampled messages carry meaningful values.
+  struct trace_stamps {
+    std::array<trace_clock::time_point, static_cast<std::size_t>(trace_stage::count)> at{};
+    bool sampled = false;
+
+    void stamp(trace_stage stage)
+    {
+      if (sampled)
+        at[static_cast<std::size_t>(stage)] = trace_clock::now();
+    }
+
+    trace_clock::duration between(trace_stage from, trace_stage to) const
+    {
+      return at[static_cast<std::size_t>(to)] - at[static_cast<std::size_t>(from)];
+    }
+  };
+
+  // Log2-bucketed histogram of nanosecond latencies. Recording is a couple of
+  // relaxed atomic increments so any thread may record concurrently.
+  class latency_histogram {
+  public:
+    static constexpr std::size_t bucket_count = 40;    // 2^39 ns ~ 9 minutes
+
+    void record(trace_clock::duration d)
+    {
+      int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+      uint64_t v = ns > 0 ? static_cast<uint64_t>(ns) : 0;
+
+      std::size_t bucket = 0;
+      while ((v >> bucket) > 1 && bucket + 1 < bucket_count)
+        ++bucket;
+
+      __buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+      __count.fetch_add(1, std::memory_order_relaxed);
+      __sum_ns.fetch_add(v, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const
+    {
+      return __count.load(std::memory_order_relaxed);
+    }
+
+    std::chrono::nanoseconds mean() const
+    {
+      uint64_t n = count();
+      return std::chrono::nanoseconds(n ? __sum_ns.load(std::memory_order_relaxed) / n : 0);
+    }
+
+    // Upper bound of the bucket holding the p-th percentile (p in [0, 1])
+    std::chrono::nanoseconds percentile(double p) const
+    {
+      uint64_t n = count();
+      if (n == 0)
+        return std::chrono::nanoseconds(0);
+
+      uint64_t rank = static_cast<uint64_t>(std::ceil(p * static_cast<double>(n)));
+      if (rank == 0)
+        rank = 1;
+      uint64_t seen = 0;
+      for (std::size_t i = 0; i < bucket_count; ++i) {
+        seen += __buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+          return std::chrono::nanoseconds(int64_t(2) << i);
+      }
+      return std::chrono::nanoseconds(int64_t(2) << (bucket_count - 1));
+    }
+
+    void reset()
+    {
+      for (auto &b : __buckets)
+        b.store(0, std::memory_order_relaxed);
+      __count.store(0, std::memory_order_relaxed);
+      __sum_ns.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    std::array<std::atomic<uint64_t>, bucket_count> __buckets{};
+    std::atomic<uint64_t> __count{ 0 };
+    std::atomic<uint64_t> __sum_ns{ 0 };
+  };
+
+  // Decides which messages get traced and aggregates their stamps into one
+  // histogram per span. With sampling at 1/N the cost for the other messages
+  // is a single relaxed increment at receive time.
+  class stage_tracer {
+  public:
+    // Trace one message out of every sample_every; 0 switches tracing off
+    void enable(uint32_t sample_every)
+    {
+      __sample_every.store(sample_every, std::memory_order_relaxed);
+    }
+
+    bool enabled() const
+    {
+      return __sample_every.load(std::memory_order_relaxed) != 0;
+    }
+
+    // Called once per received message, decides whether it is traced
+    void begin(trace_stamps &stamps)
+    {
+      uint32_t every = __sample_every.load(std::memory_order_relaxed);
+      stamps.sampled = every != 0 && __counter.fetch_add(1, std::memory_order_relaxed) % every == 0;
+      stamps.stamp(trace_stage::recv_complete);
+    }
+
+    // Inbound half, once the handler has returned
+    void record_inbound(const trace_stamps &stamps)
+    {
+      if (!stamps.sampled)
+        return;
+      span(trace_span::inbound_queue).record(stamps.between(trace_stage::recv_complete, trace_stage::dequeued));
+      span(trace_span::handler).record(stamps.between(trace_stage::dequeued, trace_stage::dispatched));
+    }
+
+    // Outbound half, once a message produced while dispatching left the socket
+    void record_outbound(const trace_stamps &stamps)
+    {
+      if (!stamps.sampled)
+        return;
+      span(trace_span::to_outbound).record(stamps.between(trace_stage::dequeued, trace_stage::enqueued_out));
+      span(trace_span::outbound_write).record(stamps.between(trace_stage::enqueued_out, trace_stage::write_complete));
+      span(trace_span::end_to_end).record(stamps.between(trace_stage::recv_complete, trace_stage::write_complete));
+    }
+
+    const latency_histogram &histogram(trace_span s) const
+    {
+      return __spans[static_cast<std::size_t>(s)];
+    }
+
+    // Dump mean/p50/p99 of every span through the logger
+    void report() const
+    {
+      for (std::size_t i = 0; i < __spans.size(); ++i) {
+        const latency_histogram &h = __spans[i];
+        if (h.count() == 0)
+          continue;
+        log_info("[TRACE] ", trace_span_name(static_cast<trace_span>(i)),
+                 ": n=", h.count(),
+                 " mean=", h.mean().count() / 1000.0, "us",
+                 " p50<", h.percentile(0.50).count() / 1000.0, "us",
+                 " p99<", h.percentile(0.99).count() / 1000.0, "us");
+      }
+    }
+
+    // The stamps of the message currently being dispatched on this thread.
+    // Connections copy them into anything sent from inside __on_message so the
+    // outbound half can be tied back to the original receive.
+    static trace_stamps *&current()
+    {
+      static thread_local trace_stamps *stamps = nullptr;
+      return stamps;
+    }
+
+  private:
+    latency_histogram &span(trace_span s)
+    {
+      return __spans[static_cast<std::size_t>(s)];
+    }
+
+    std::atomic<uint32_t> __sample_every{ 0 };
+    std::atomic<uint32_t> __counter{ 0 };
+    std::array<latency_histogram, static_cast<std::size_t>(trace_span::count)> __spans;
+  };
+}    // namespace net
+
+#endif
@@ -0,0 +1,330 @@
+#ifndef NET_TRANSFER
+#define NET_TRANSFER
+
+#include "net_common.h"
+#include "net_message.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#define NET_TRANSFER_POSIX 1
+#endif
+
+namespace net {
+  // Streaming transfers. A file travels as a run of chunk frames on the bulk
+  // lane, so chat (normal lane) and control frames overtake it between any
+  // two chunks. Flow control is by credit: the receiving side acknowledges
+  // how far it has got, and the sending side never runs more than
+  // transfer_window bytes ahead of that.
+  //
+  //   offer  : u32 transfer | u64 size | name bytes (UTF-8)
+  //   chunk  : u32 transfer | u64 offset | data bytes (up to
+  //            transfer_frame_bytes, split on arrival, see file_chunk)
+  //   credit : u32 transfer | u64 offset (everything before it has arrived)
+  //   cancel : u32 transfer
+  constexpr std::size_t transfer_header_bytes = 12;
+  constexpr std::size_t transfer_chunk_bytes = max_text_bytes - transfer_header_bytes;
+  constexpr std::size_t transfer_frame_bytes = 64 * 1024;
+  constexpr uint64_t transfer_window = 4 * transfer_frame_bytes;
+
+  namespace transfer_detail {
+    inline void write_header(std::array<char, max_text_bytes> &data, uint32_t transfer, uint64_t value)
+    {
+      put_le(data.data(), transfer);
+      put_le(data.data() + 4, value);
+    }
+
+    inline void read_header(const std::array<char, max_text_bytes> &data, uint32_t &transfer, uint64_t &value)
+    {
+      transfer = get_le<uint32_t>(data.data());
+      value = get_le<uint64_t>(data.data() + 4);
+    }
+  }    // namespace transfer_detail
+
+  struct file_offer {
+    static constexpr std::size_t max_size = transfer_header_bytes + 255;
+    uint32_t transfer = 0;
+    uint64_t size = 0;
+    std::string_view name;
+
+    std::size_t encode(std::array<char, max_text_bytes> &data) const
+    {
+      transfer_detail::write_header(data, transfer, size);
+      const std::size_t length = utf8_fit(name, max_size - transfer_header_bytes);
+      std::memcpy(data.data() + transfer_header_bytes, name.data(), length);
+      return transfer_header_bytes + length;
+    }
+
+    static bool decode(const std::array<char, max_text_bytes> &data, std::size_t size, file_offer &out)
+    {
+      if (size < transfer_header_bytes)
+        return false;
+      transfer_detail::read_header(data, out.transfer, out.size);
+      out.name = std::string_view(data.data() + transfer_header_bytes, size - transfer_header_bytes);
+      return true;
+    }
+  };
+
+  // A chunk as handlers see it fits a buffer. One sent straight from a file
+  // may carry up to transfer_frame_bytes, the receiving connection cuts it
+  // into buffer-sized chunks with their offsets moved on (see net_registry.h).
+  struct file_chunk {
+    static constexpr std::size_t max_size = max_text_bytes;
+    static constexpr std::size_t max_wire_size = transfer_header_bytes + transfer_frame_bytes;
+    static constexpr std::size_t split_head = transfer_header_bytes;
+    uint32_t transfer = 0;
+    uint64_t offset = 0;
+    std::string_view bytes;
+
+    std::size_t encode(std::array<char, max_text_bytes> &data) const
+    {
+      transfer_detail::write_header(data, transfer, offset);
+      // Empty when only the head of a chunk is built, its bytes sent from a file
+      const std::size_t length = std::min(bytes.size(), transfer_chunk_bytes);
+      if (length > 0)
+        std::memcpy(data.data() + transfer_header_bytes, bytes.data(), length);
+      return transfer_header_bytes + length;
+    }
+
+    static bool decode(const std::array<char, max_text_bytes> &data, std::size_t size, file_chunk &out)
+    {
+      if (size <= transfer_header_bytes)
+        return false;
+      transfer_detail::read_header(data, out.transfer, out.offset);
+      out.bytes = std::string_view(data.data() + transfer_header_bytes, size - transfer_header_bytes);
+      return true;
+    }
+
+    static void split_advance(char *head, std::size_t bytes)
+    {
+      put_le(head + 4, get_le<uint64_t>(head + 4) + bytes);
+    }
+  };
+
+  struct file_credit {
+    static constexpr std::size_t max_size = transfer_header_bytes;
+    uint32_t transfer = 0;
+    uint64_t offset = 0;
+
+    std::size_t encode(std::array<char, max_text_bytes> &data) const
+    {
+      transfer_detail::write_header(data, transfer, offset);
+      return max_size;
+    }
+
+    static bool decode(const std::array<char, max_text_bytes> &data, std::size_t size, file_credit &out)
+    {
+      transfer_detail::read_header(data, out.transfer, out.offset);
+      return size == max_size;
+    }
+  };
+
+  struct file_cancel {
+    static constexpr std::size_t max_size = 4;
+    uint32_t transfer = 0;
+
+    std::size_t encode(std::array<char, max_text_bytes> &data) const
+    {
+      put_le(data.data(), transfer);
+      return max_size;
+    }
+
+    static bool decode(const std::array<char, max_text_bytes> &data, std::size_t size, file_cancel &out)
+    {
+      out.transfer = get_le<uint32_t>(data.data());
+      return size == max_size;
+    }
+  };
+
+  // Anonymous scratch file a server keeps a shared file in. It is unlinked as
+  // soon as it is created, so it goes away with the last handle on it. Reads
+  // may come from any thread.
+  class spool_file {
+  public:
+    spool_file(const spool_file &) = delete;
+    spool_file &operator=(const spool_file &) = delete;
+
+    ~spool_file()
+    {
+#ifdef NET_TRANSFER_POSIX
+      if (__fd >= 0)
+        ::close(__fd);
+#else
+      if (__file)
+        std::fclose(__file);
+#endif
+    }
+
+    // nullptr if no file could be created in dir
+    static std::shared_ptr<spool_file> create(const std::filesystem::path &dir)
+    {
+      std::shared_ptr<spool_file> spool(new spool_file());
+#ifdef NET_TRANSFER_POSIX
+      std::string path = (dir / "mestcp-XXXXXX").string();
+      spool->__fd = ::mkstemp(path.data());
+      if (spool->__fd < 0)
+        return nullptr;
+      ::unlink(path.c_str());
+#else
+      spool->__file = std::tmpfile();
+      if (!spool->__file)
+        return nullptr;
+#endif
+      return spool;
+    }
+
+    bool write(uint64_t offset, const char *data, std::size_t size)
+    {
+#ifdef NET_TRANSFER_POSIX
+      while (size > 0) {
+        const ssize_t n = ::pwrite(__fd, data, size, static_cast<off_t>(offset));
+        if (n <= 0)
+          return false;
+        data += n;
+        offset += static_cast<uint64_t>(n);
+        size -= static_cast<std::size_t>(n);
+      }
+      return true;
+#else
+      std::scoped_lock lock(__mux);
+      return std::fseek(__file, static_cast<long>(offset), SEEK_SET) == 0 && std::fwrite(data, 1, size, __file) == size;
+#endif
+    }
+
+    bool read(uint64_t offset, char *data, std::size_t size) const
+    {
+#ifdef NET_TRANSFER_POSIX
+      while (size > 0) {
+        const ssize_t n = ::pread(__fd, data, size, static_cast<off_t>(offset));
+        if (n <= 0)
+          return false;
+        data += n;
+        offset += static_cast<uint64_t>(n);
+        size -= static_cast<std::size_t>(n);
+      }
+      return true;
+#else
+      std::scoped_lock lock(__mux);
+      return std::fseek(__file, static_cast<long>(offset), SEEK_SET) == 0 && std::fread(data, 1, size, __file) == size;
+#endif
+    }
+
+#ifdef NET_TRANSFER_POSIX
+    int native_handle() const
+    {
+      return __fd;
+    }
+#endif
+
+  private:
+    spool_file() = default;
+
+#ifdef NET_TRANSFER_POSIX
+    int __fd = -1;
+#else
+    std::FILE *__file = nullptr;
+    mutable std::mutex __mux;
+#endif
+  };
+
+  // Sending side of a transfer, reading a local file a chunk at a time
+  class upload_stream {
+  public:
+    bool open(uint32_t transfer, const std::filesystem::path &path)
+    {
+      __in.open(path, std::ios::binary);
+      if (!__in)
+        return false;
+      std::error_code ec;
+      __size = std::filesystem::file_size(path, ec);
+      __transfer = transfer;
+      __sent = __acked = 0;
+      return !ec;
+    }
+
+    uint32_t transfer() const { return __transfer; }
+    uint64_t size() const { return __size; }
+    bool done() const { return __acked >= __size; }
+
+    // The next chunk to send, or nothing while the window is full or
+    // everything has gone out. The chunk points into this stream.
+    std::optional<file_chunk> next_chunk()
+    {
+      if (__sent >= __size || __sent - __acked >= transfer_window)
+        return std::nullopt;
+      const std::size_t length = static_cast<std::size_t>(std::min<uint64_t>(__size - __sent, transfer_chunk_bytes));
+      if (!__in.read(__buffer.data(), static_cast<std::streamsize>(length)))
+        return std::nullopt;
+      file_chunk chunk{ __transfer, __sent, std::string_view(__buffer.data(), length) };
+      __sent += length;
+      return chunk;
+    }
+
+    void on_credit(const file_credit &credit)
+    {
+      if (credit.transfer == __transfer)
+        __acked = std::max(__acked, std::min(credit.offset, __sent));
+    }
+
+  private:
+    std::ifstream __in;
+    std::array<char, transfer_chunk_bytes> __buffer{};
+    uint32_t __transfer = 0;
+    uint64_t __size = 0;
+    uint64_t __sent = 0;
+    uint64_t __acked = 0;
+  };
+
+  // Receiving side of a transfer, writing chunks to a local file in order
+  class download_stream {
+  public:
+    bool open(uint32_t transfer, uint64_t size, const std::filesystem::path &path)
+    {
+      __out.open(path, std::ios::binary | std::ios::trunc);
+      __transfer = transfer;
+      __size = size;
+      __received = __credited = 0;
+      return static_cast<bool>(__out);
+    }
+
+    uint32_t transfer() const { return __transfer; }
+    uint64_t size() const { return __size; }
+    uint64_t received() const { return __received; }
+    bool done() const { return __received >= __size; }
+
+    // Store a chunk. Returns false if it is not the one expected next.
+    bool write(const file_chunk &chunk)
+    {
+      if (chunk.transfer != __transfer || chunk.offset != __received || chunk.bytes.size() > __size - __received)
+        return false;
+      __out.write(chunk.bytes.data(), static_cast<std::streamsize>(chunk.bytes.size()));
+      __received += chunk.bytes.size();
+      if (done())
+        __out.close();
+      return static_cast<bool>(__out) || done();
+    }
+
+    // Credit to send back, every quarter window and at the end
+    std::optional<file_credit> credit_due()
+    {
+      if (__received == __credited || (__received - __credited < transfer_window / 4 && !done()))
+        return std::nullopt;
+      __credited = __received;
+      return file_credit{ __transfer, __received };
+    }
+
+  private:
+    std::ofstream __out;
+    uint32_t __transfer = 0;
+    uint64_t __size = 0;
+    uint64_t __received = 0;
+    uint64_t __credited = 0;
+  };
+}    // namespace net
+
+#endif
@@ -0,0 +1,467 @@
+#ifndef NET_UTF8
+#define NET_UTF8
+
+#include "net_common.h"
+#include <cstring>
+#include <string_view>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define NET_UTF8_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NET_UTF8_SSE2 1
+#endif
+
+// UTF-8 is the wire encoding for all message text. Both ends validate what
+// they receive and transcode to/from the UTF-16 used by Qt (and by wchar_t on
+// Windows). The hot loops are vectorised: AVX2 validates 32 bytes per step
+// with the lookup-table algorithm of Keiser & Lemire, SSE2 handles the ASCII
+// fast paths of the transcoders 16 bytes at a time, and a scalar fallback
+// covers everything else (and other CPUs).
+namespace net {
+  namespace utf8_detail {
+    // Decode one code point starting at s[i]; returns the number of bytes
+    // consumed, or 0 if the sequence is malformed, overlong, a surrogate or
+    // beyond U+10FFFF.
+    inline std::size_t decode_one(const unsigned char *s, std::size_t n, std::size_t i, char32_t &cp)
+    {
+      unsigned char c = s[i];
+      if (c < 0x80) {
+        cp = c;
+        return 1;
+      }
+      if (c < 0xC2)
+        return 0;
+      if (c < 0xE0) {
+        if (i + 1 >= n || (s[i + 1] & 0xC0) != 0x80)
+          return 0;
+        cp = (char32_t(c & 0x1F) << 6) | (s[i + 1] & 0x3F);
+        return 2;
+      }
+      if (c < 0xF0) {
+        if (i + 2 >= n || (s[i + 1] & 0xC0) != 0x80 || (s[i + 2] & 0xC0) != 0x80)
+          return 0;
+        cp = (char32_t(c & 0x0F) << 12) | (char32_t(s[i + 1] & 0x3F) << 6) | (s[i + 2] & 0x3F);
+        if (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))
+          return 0;
+        return 3;
+      }
+      if (c < 0xF5) {
+        if (i + 3 >= n || (s[i + 1] & 0xC0) != 0x80 || (s[i + 2] & 0xC0) != 0x80 || (s[i + 3] & 0xC0) != 0x80)
+          return 0;
+        cp = (char32_t(c & 0x07) << 18) | (char32_t(s[i + 1] & 0x3F) << 12) | (char32_t(s[i + 2] & 0x3F) << 6) | (s[i + 3] & 0x3F);
+        if (cp < 0x10000 || cp > 0x10FFFF)
+          return 0;
+        return 4;
+      }
+      return 0;
+    }
+
+    inline bool validate_scalar(const unsigned char *s, std::size_t n)
+    {
+      char32_t cp;
+      for (std::size_t i = 0; i < n;) {
+        std::size_t len = decode_one(s, n, i, cp);
+        if (!len)
+          return false;
+        i += len;
+      }
+      return true;
+    }
+
+#if defined(NET_UTF8_AVX2)
+    // Error classes for the lookup-table validator, one bit each
+    constexpr uint8_t TOO_SHORT = 1 << 0;    // lead byte not followed by a continuation
+    constexpr uint8_t TOO_LONG = 1 << 1;    // ASCII followed by a continuation
+    constexpr uint8_t OVERLONG_3 = 1 << 2;
+    constexpr uint8_t TOO_LARGE = 1 << 3;
+    constexpr uint8_t SURROGATE = 1 << 4;
+    constexpr uint8_t OVERLONG_2 = 1 << 5;
+    constexpr uint8_t TOO_LARGE_1000 = 1 << 6;
+    constexpr uint8_t OVERLONG_4 = 1 << 6;
+    constexpr uint8_t TWO_CONTS = 1 << 7;    // two continuations in a row
+    constexpr uint8_t CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+    inline __m256i table16(uint8_t a0, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4, uint8_t a5, uint8_t a6, uint8_t a7,
+                           uint8_t a8, uint8_t a9, uint8_t a10, uint8_t a11, uint8_t a12, uint8_t a13, uint8_t a14, uint8_t a15)
+    {
+      return _mm256_setr_epi8(a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15,
+                              a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15);
+    }
+
+    inline __m256i high_nibbles(__m256i v)
+    {
+      return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+    }
+
+    // The 32 bytes ending N bytes before the end of `input`, spanning into `prev`
+    template <int N>
+    inline __m256i prev_bytes(__m256i input, __m256i prev)
+    {
+      return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 16 - N);
+    }
+
+    inline __m256i check_block(__m256i input, __m256i prev_input)
+    {
+      const __m256i prev1 = prev_bytes<1>(input, prev_input);
+
+      const __m256i byte_1_high = _mm256_shuffle_epi8(
+        table16(TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+                TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+                TOO_SHORT | OVERLONG_2,
+                TOO_SHORT,
+                TOO_SHORT | OVERLONG_3 | SURROGATE,
+                TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4),
+        high_nibbles(prev1));
+
+      const __m256i byte_1_low = _mm256_shuffle_epi8(
+        table16(CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+                CARRY | OVERLONG_2,
+                CARRY,
+                CARRY,
+                CARRY | TOO_LARGE,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+                CARRY | TOO_LARGE | TOO_LARGE_1000,
+                CARRY | TOO_LARGE | TOO_LARGE_1000),
+        _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)));
+
+      const __m256i byte_2_high = _mm256_shuffle_epi8(
+        table16(TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+                TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+                TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT),
+        high_nibbles(input));
+
+      const __m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+      // Third and fourth bytes of 3/4-byte sequences must be continuations,
+      // which the two-byte lookup above flags as TWO_CONTS - cancel those out
+      const __m256i prev2 = prev_bytes<2>(input, prev_input);
+      const __m256i prev3 = prev_bytes<3>(input, prev_input);
+      const __m256i is_third_byte = _mm256_subs_epu8(prev2, _mm256_set1_epi8(char(0xE0 - 0x80)));
+      const __m256i is_fourth_byte = _mm256_subs_epu8(prev3, _mm256_set1_epi8(char(0xF0 - 0x80)));
+      const __m256i must23_80 = _mm256_and_si256(_mm256_or_si256(is_third_byte, is_fourth_byte), _mm256_set1_epi8(char(0x80)));
+
+      return _mm256_xor_si256(must23_80, special_cases);
+    }
+
+    // Non-zero where the block ends in the middle of a multi-byte sequence
+    inline __m256i incomplete_tail(__m256i input)
+    {
+      const __m256i max_value = _mm256_setr_epi8(
+        char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xFF),
+        char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xFF),
+        char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xFF),
+        char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xFF), char(0xF0 - 1), char(0xE0 - 1), char(0xC0 - 1));
+      return _mm256_subs_epu8(input, max_value);
+    }
+
+    inline bool validate_avx2(const unsigned char *s, std::size_t n)
+    {
+      __m256i error = _mm256_setzero_si256();
+      __m256i prev_input = _mm256_setzero_si256();
+      __m256i prev_incomplete = _mm256_setzero_si256();
+
+      auto step = [&](__m256i input) {
+        if (_mm256_movemask_epi8(input) == 0) {
+          // Pure ASCII block: only an unfinished sequence before it can be wrong
+          error = _mm256_or_si256(error, prev_incomplete);
+        }
+        else {
+          error = _mm256_or_si256(error, check_block(input, prev_input));
+          prev_incomplete = incomplete_tail(input);
+        }
+        prev_input = input;
+      };
+
+      std::size_t i = 0;
+      for (; i + 32 <= n; i += 32)
+        step(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i)));
+
+      if (i < n) {
+        // Zero padding is ASCII, so the tail can reuse the block check
+        alignas(32) unsigned char tail[32] = {};
+        std::memcpy(tail, s + i, n - i);
+        step(_mm256_load_si256(reinterpret_cast<const __m256i *>(tail)));
+      }
+
+      error = _mm256_or_si256(error, prev_incomplete);
+      return _mm256_testz_si256(error, error) != 0;
+    }
+#endif
+
+    // Length of the run of ASCII bytes at the start of s
+    inline std::size_t ascii_prefix(const unsigned char *s, std::size_t n)
+    {
+      std::size_t i = 0;
+#if defined(NET_UTF8_SSE2)
+      for (; i + 16 <= n; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i)));
+        if (mask)
+          break;
+      }
+#endif
+      while (i < n && s[i] < 0x80)
+        ++i;
+      return i;
+    }
+
+    // Widen a run of ASCII bytes to UTF-16
+    inline void widen_ascii(const unsigned char *s, std::size_t n, char16_t *out)
+    {
+      std::size_t i = 0;
+#if defined(NET_UTF8_SSE2)
+      const __m128i zero = _mm_setzero_si128();
+      for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 8), _mm_unpackhi_epi8(v, zero));
+      }
+#endif
+      for (; i < n; ++i)
+        out[i] = s[i];
+    }
+
+    // Length of the run of UTF-16 units below 0x80 at the start of s
+    inline std::size_t ascii_prefix16(const char16_t *s, std::size_t n)
+    {
+      std::size_t i = 0;
+#if defined(NET_UTF8_SSE2)
+      const __m128i high = _mm_set1_epi16(static_cast<short>(0xFF80));
+      const __m128i zero = _mm_setzero_si128();
+      for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, high), zero)) != 0xFFFF)
+          break;
+      }
+#endif
+      while (i < n && s[i] < 0x80)
+        ++i;
+      return i;
+    }
+
+    // Narrow a run of UTF-16 units below 0x80 to bytes
+    inline void narrow_ascii(const char16_t *s, std::size_t n, char *out)
+    {
+      std::size_t i = 0;
+#if defined(NET_UTF8_SSE2)
+      for (; i + 16 <= n; i += 16) {
+        __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+        __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i + 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packus_epi16(lo, hi));
+      }
+#endif
+      for (; i < n; ++i)
+        out[i] = static_cast<char>(s[i]);
+    }
+
+    inline void append_utf8(std::string &out, char32_t cp)
+    {
+      if (cp < 0x80) {
+        out += static_cast<char>(cp);
+      }
+      else if (cp < 0x800) {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+      }
+      else if (cp < 0x10000) {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+      }
+      else {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+      }
+    }
+  }    // namespace utf8_detail
+
+  constexpr char32_t utf_replacement = 0xFFFD;
+
+  // True if the bytes are well-formed UTF-8 (no overlongs, surrogates or
+  // code points past U+10FFFF, nothing cut off at the end)
+  inline bool utf8_validate(std::string_view text)
+  {
+    const auto *s = reinterpret_cast<const unsigned char *>(text.data());
+#if defined(NET_UTF8_AVX2)
+    return utf8_detail::validate_avx2(s, text.size());
+#else
+    std::size_t i = 0;
+    while (i < text.size()) {
+      i += utf8_detail::ascii_prefix(s + i, text.size() - i);
+      if (i == text.size())
+        break;
+
+      // Validate up to the next ASCII byte, then go back to the fast path
+      std::size_t j = i;
+      while (j < text.size() && s[j] >= 0x80)
+        ++j;
+      if (!utf8_detail::validate_scalar(s + i, j - i))
+        return false;
+      i = j;
+    }
+    return true;
+#endif
+  }
+
+  // Call fn(char32_t) for every code point; malformed input decodes to U+FFFD
+  template <typename Fn>
+  void utf8_for_each(std::string_view text, Fn &&fn)
+  {
+    const auto *s = reinterpret_cast<const unsigned char *>(text.data());
+    for (std::size_t i = 0; i < text.size();) {
+      char32_t cp;
+      std::size_t len = utf8_detail::decode_one(s, text.size(), i, cp);
+      if (!len) {
+        cp = utf_replacement;
+        len = 1;
+      }
+      fn(cp);
+      i += len;
+    }
+  }
+
+  // UTF-8 -> UTF-16. Malformed sequences become U+FFFD.
+  inline std::u16string utf8_to_utf16(std::string_view text)
+  {
+    const auto *s = reinterpret_cast<const unsigned char *>(text.data());
+    const std::size_t n = text.size();
+    std::u16string out(n, u'\0');    // never more units than bytes
+    std::size_t o = 0;
+
+    for (std::size_t i = 0; i < n;) {
+      std::size_t run = utf8_detail::ascii_prefix(s + i, n - i);
+      utf8_detail::widen_ascii(s + i, run, &out[o]);
+      i += run;
+      o += run;
+
+      while (i < n && s[i] >= 0x80) {
+        char32_t cp;
+        std::size_t len = utf8_detail::decode_one(s, n, i, cp);
+        if (!len) {
+          cp = utf_replacement;
+          len = 1;
+        }
+        if (cp >= 0x10000) {
+          cp -= 0x10000;
+          out[o++] = static_cast<char16_t>(0xD800 + (cp >> 10));
+          out[o++] = static_cast<char16_t>(0xDC00 + (cp & 0x3FF));
+        }
+        else {
+          out[o++] = static_cast<char16_t>(cp);
+        }
+        i += len;
+      }
+    }
+
+    out.resize(o);
+    return out;
+  }
+
+  // UTF-16 -> UTF-8. Unpaired surrogates become U+FFFD.
+  inline std::string utf16_to_utf8(std::u16string_view text)
+  {
+    const char16_t *s = text.data();
+    const std::size_t n = text.size();
+    std::string out;
+    out.reserve(n + n / 2);
+
+    for (std::size_t i = 0; i < n;) {
+      std::size_t run = utf8_detail::ascii_prefix16(s + i, n - i);
+      if (run) {
+        std::size_t at = out.size();
+        out.resize(at + run);
+        utf8_detail::narrow_ascii(s + i, run, &out[at]);
+        i += run;
+      }
+
+      while (i < n && s[i] >= 0x80) {
+        char32_t cp = s[i++];
+        if (cp >= 0xD800 && cp <= 0xDBFF && i < n && s[i] >= 0xDC00 && s[i] <= 0xDFFF)
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (s[i++] - 0xDC00);
+        else if (cp >= 0xD800 && cp <= 0xDFFF)
+          cp = utf_replacement;
+        utf8_detail::append_utf8(out, cp);
+      }
+    }
+    return out;
+  }
+
+  // wchar_t is UTF-16 on Windows and UTF-32 elsewhere
+  inline std::wstring utf8_to_wide(std::string_view text)
+  {
+    if constexpr (sizeof(wchar_t) == sizeof(char16_t)) {
+      std::u16string u16 = utf8_to_utf16(text);
+      return std::wstring(u16.begin(), u16.end());
+    }
+    else {
+      std::wstring out;
+      out.reserve(text.size());
+      utf8_for_each(text, [&out](char32_t cp) { out += static_cast<wchar_t>(cp); });
+      return out;
+    }
+  }
+
+  inline std::string wide_to_utf8(std::wstring_view text)
+  {
+    if constexpr (sizeof(wchar_t) == sizeof(char16_t)) {
+      return utf16_to_utf8(std::u16string_view(reinterpret_cast<const char16_t *>(text.data()), text.size()));
+    }
+    else {
+      std::string out;
+      out.reserve(text.size());
+      for (wchar_t ch : text) {
+        char32_t cp = static_cast<char32_t>(ch);
+        utf8_detail::append_utf8(out, (cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) ? utf_replacement : cp);
+      }
+      return out;
+    }
+  }
+
+  // Text in a fixed-size message field, up to the first NUL
+  template <std::size_t N>
+  std::string_view field_text(const std::array<char, N> &field)
+  {
+    const void *end = std::memchr(field.data(), '\0', N);
+    return std::string_view(field.data(), end ? static_cast<const char *>(end) - field.data() : N);
+  }
+
+  // How much of text fits in max bytes without splitting a code point
+  inline std::size_t utf8_fit(std::string_view text, std::size_t max)
+  {
+    std::size_t len = std::min(text.size(), max);
+    if (len < text.size()) {
+      // Step back over continuation bytes of a sequence that was split
+      while (len > 0 && (static_cast<unsigned char>(text[len]) & 0xC0) == 0x80)
+        --len;
+    }
+    return len;
+  }
+
+  // Store UTF-8 text in a fixed-size message field, NUL-terminated. Text that
+  // does not fit is cut at a code point boundary. Returns false if cut.
+  template <std::size_t N>
+  bool set_field_text(std::array<char, N> &field, std::string_view text)
+  {
+    const std::size_t len = utf8_fit(text, N - 1);
+    std::memcpy(field.data(), text.data(), len);
+    std::memset(field.data() + len, 0, N - len);
+    return len == text.size();
+  }
+}    // namespace net
+
+#endif
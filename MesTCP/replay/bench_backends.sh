@@ -0,0 +1,81 @@
+#!/usr/bin/env bash
+# Compares the epoll and io_uring builds of the server on localhost, using the
+# replay tool as the load generator.
+#
+#   replay/bench_backends.sh CAPTURE
+#
+# CAPTURE is a file recorded with `Server --record FILE`. For every backend the
+# server is started, the capture is replayed with --fast and the throughput is
+# taken from the replay report. A second run under strace counts the
+# server's system calls per replayed frame; it is skipped when strace is not
+# installed. Extra compiler flags (e.g. include paths) come from CXXFLAGS.
+
+set -euo pipefail
+
+CAPTURE=${1:?usage: bench_backends.sh CAPTURE}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+OUT=${OUT:-/tmp/mestcp-bench}
+PORT=9030
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:-}
+
+mkdir -p "$OUT"
+
+build() {
+  local name=$1; shift
+  $CXX -std=c++17 -O2 $CXXFLAGS "$@" -I"$ROOT/include" -I"$ROOT/server/include" \
+    "$ROOT/server/src/Server.cpp" -o "$OUT/$name" -pthread ${LIBS:-}
+}
+
+echo "== building"
+$CXX -std=c++17 -O2 $CXXFLAGS -I"$ROOT/include" "$ROOT/replay/src/Replay.cpp" -o "$OUT/Replay" -pthread
+build server-epoll
+BACKENDS="epoll"
+if LIBS=-luring build server-io_uring -DMESTCP_IO_URING 2>"$OUT/io_uring-build.log"; then
+  BACKENDS="$BACKENDS io_uring"
+else
+  echo "io_uring build failed (needs liburing and Boost >= 1.78), see $OUT/io_uring-build.log"
+fi
+
+# frames/s from the replay report
+run_replay() {
+  "$OUT/Replay" "$CAPTURE" --port $PORT --fast | tee -a "$OUT/replay.log" |
+    sed -n 's/.*(\([0-9.e+]*\) frames\/s).*/\1/p'
+}
+
+wait_port() {
+  for _ in $(seq 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null && return 0
+    sleep 0.1
+  done
+  return 1
+}
+
+printf '\n%-10s %-12s %14s %16s\n' backend read frames/s syscalls/frame
+for backend in $BACKENDS; do
+  for mode in wait eager; do
+    flags=()
+    [ "$mode" = eager ] && flags+=(--eager-read)
+
+    "$OUT/server-$backend" "${flags[@]}" --reserve 4096 >"$OUT/server-$backend-$mode.log" 2>&1 &
+    pid=$!
+    wait_port
+    rate=$(run_replay)
+    kill $pid; wait $pid 2>/dev/null || true
+
+    per_frame="n/a"
+    if command -v strace >/dev/null; then
+      strace -f -qq -o "$OUT/strace-$backend-$mode.txt" "$OUT/server-$backend" "${flags[@]}" --reserve 4096 \
+        >/dev/null 2>&1 &
+      pid=$!
+      wait_port
+      frames=$("$OUT/Replay" "$CAPTURE" --port $PORT --fast | sed -n 's/^\[REPLAY\] \([0-9]*\) frames,.*/\1/p')
+      kill -INT $pid; wait $pid 2>/dev/null || true
+      # One line per call, interrupted calls show up again as "resumed"
+      calls=$(grep -vc -e 'resumed>' -e '^[0-9]* +++' -e '^[0-9]* ---' "$OUT/strace-$backend-$mode.txt" || true)
+      [ -n "$calls" ] && [ "${frames:-0}" -gt 0 ] && per_frame=$(awk -v c="$calls" -v f="$frames" 'BEGIN { printf "%.2f", c / f }')
+    fi
+
+    printf '%-10s %-12s %14s %16s\n' "$backend" "$mode" "${rate:-n/a}" "$per_frame"
+  done
+done
@@ -0,0 +1,223 @@
+// Replays a traffic capture written by server_interface::start_recording()
+// against a running server. Every recorded connection gets its own socket and
+// its frames are sent either at the original pacing (optionally scaled) or as
+// fast as the server accepts them. Whatever the server sends back is read and
+// discarded so it never stalls on full socket buffers.
+//
+//   Replay <capture> [--host H] [--port P] [--speed X] [--fast]
+
+#include "net.h"
+
+using boost::asio::ip::tcp;
+
+namespace replay_detail {
+  struct frame {
+    std::chrono::nanoseconds offset;
+    std::size_t session;
+    std::vector<char> data;
+  };
+
+  // One recorded connection, replayed through one socket
+  struct session {
+    explicit session(boost::asio::io_context &ctx)
+        : socket(ctx) {}
+
+    tcp::socket socket;
+    std::deque<const frame *> q_out;
+    std::array<char, 1 << 14> discard{};
+    bool writing = false;
+  };
+
+  class Replayer {
+  public:
+    Replayer(std::vector<frame> frames, std::size_t sessions, double speed, bool fast)
+        : __frames(std::move(frames)), __speed(speed), __fast(fast), __timer(__io_context)
+    {
+      for (std::size_t i = 0; i < sessions; ++i)
+        __sessions.push_back(std::make_unique<session>(__io_context));
+    }
+
+    bool connect(const std::string &host, uint16_t port)
+    {
+      try {
+        tcp::resolver resolver(__io_context);
+        auto endpoints = resolver.resolve(host, std::to_string(port));
+        for (auto &s : __sessions) {
+          boost::asio::connect(s->socket, endpoints);
+          s->socket.set_option(tcp::no_delay(true));
+          read_data(*s);
+        }
+      } catch (std::exception &e) {
+        std::cerr << "[REPLAY] Connect failed: " << e.what() << '\n';
+        return false;
+      }
+      return true;
+    }
+
+    void run()
+    {
+      __start = std::chrono::steady_clock::now();
+      pump();
+      __io_context.run();
+    }
+
+    void report() const
+    {
+      auto elapsed = std::chrono::duration<double>(__finished - __start).count();
+      std::cout << "[REPLAY] " << __sent << " frames, " << __bytes << " bytes over "
+                << __sessions.size() << " connections in " << elapsed << " s ("
+                << (elapsed > 0 ? double(__sent) / elapsed : 0.0) << " frames/s)\n";
+      if (!__fast)
+        std::cout << "[REPLAY] Worst lag behind the recorded schedule: "
+                  << std::chrono::duration<double, std::milli>(__worst_lag).count() << " ms\n";
+    }
+
+  private:
+    // Hand every frame that is due to its session, then sleep until the next one
+    void pump()
+    {
+      auto now = std::chrono::steady_clock::now();
+      while (__next < __frames.size()) {
+        const frame &f = __frames[__next];
+        auto due = __start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(f.offset / __speed);
+        if (!__fast && due > now) {
+          __timer.expires_at(due);
+          __timer.async_wait([this](std::error_code ec) {
+            if (!ec)
+              pump();
+          });
+          return;
+        }
+
+        if (!__fast && now - due > __worst_lag)
+          __worst_lag = now - due;
+
+        session &s = *__sessions[f.session];
+        bool bWritingMessage = s.writing;
+        s.q_out.push_back(&f);
+        if (!bWritingMessage)
+          write_data(s);
+        ++__next;
+      }
+    }
+
+    void write_data(session &s)
+    {
+      s.writing = true;
+      const frame *f = s.q_out.front();
+      boost::asio::async_write(s.socket, boost::asio::buffer(f->data),
+                               [this, &s](std::error_code ec, std::size_t length) {
+                                 if (ec) {
+                                   std::cerr << "[REPLAY] Write failed: " << ec.message() << '\n';
+                                   __io_context.stop();
+                                   return;
+                                 }
+
+                                 __sent++;
+                                 __bytes += length;
+                                 s.q_out.pop_front();
+                                 if (!s.q_out.empty())
+                                   write_data(s);
+                                 else
+                                   s.writing = false;
+
+                                 if (__sent == __frames.size())
+                                   finish();
+                               });
+    }
+
+    void read_data(session &s)
+    {
+      s.socket.async_read_some(boost::asio::buffer(s.discard),
+                               [this, &s](std::error_code ec, std::size_t) {
+                                 if (!ec)
+                                   read_data(s);
+                               });
+    }
+
+    // Give the server a moment to fan out the tail, then close everything
+    void finish()
+    {
+      __finished = std::chrono::steady_clock::now();
+      __timer.expires_after(std::chrono::milliseconds(500));
+      __timer.async_wait([this](std::error_code) {
+        for (auto &s : __sessions) {
+          boost::system::error_code ignored;
+          s->socket.close(ignored);
+        }
+      });
+    }
+
+  private:
+    boost::asio::io_context __io_context;
+    std::vector<frame> __frames;
+    std::vector<std::unique_ptr<session>> __sessions;
+    double __speed = 1.0;
+    bool __fast = false;
+    boost::asio::steady_timer __timer;
+
+    std::size_t __next = 0;
+    std::size_t __sent = 0;
+    std::size_t __bytes = 0;
+    std::chrono::steady_clock::time_point __start;
+    std::chrono::steady_clock::time_point __finished;
+    std::chrono::steady_clock::duration __worst_lag{ 0 };
+  };
+}    // namespace replay_detail
+
+int main(int argc, char **argv)
+{
+  using namespace replay_detail;
+
+  if (argc < 2) {
+    std::cerr << "usage: Replay <capture> [--host H] [--port P] [--speed X] [--fast]\n";
+    return 1;
+  }
+
+  std::string host = "127.0.0.1";
+  uint16_t port = 9030;
+  double speed = 1.0;
+  bool fast = false;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--fast")
+      fast = true;
+    else if (arg == "--host" && i + 1 < argc)
+      host = argv[++i];
+    else if (arg == "--port" && i + 1 < argc)
+      port = static_cast<uint16_t>(std::stoul(argv[++i]));
+    else if (arg == "--speed" && i + 1 < argc)
+      speed = std::stod(argv[++i]);
+  }
+  if (speed <= 0)
+    speed = 1.0;
+
+  net::capture_reader reader;
+  if (!reader.open(argv[1])) {
+    std::cerr << "[REPLAY] " << argv[1] << " is not a capture file\n";
+    return 1;
+  }
+
+  // Load the whole capture up front so file I/O never disturbs the pacing,
+  // and map recorded connection ids onto dense session indexes
+  std::vector<frame> frames;
+  std::unordered_map<uint32_t, std::size_t> sessions;
+  net::capture_reader::record rec;
+  while (reader.next(rec)) {
+    auto it = sessions.emplace(rec.connection_id, sessions.size()).first;
+    frames.push_back({ rec.offset, it->second, std::move(rec.data) });
+  }
+
+  std::cout << "[REPLAY] " << frames.size() << " frames from " << sessions.size()
+            << " connections, max frame size " << reader.header().frame_size << " bytes\n";
+  if (frames.empty())
+    return 0;
+
+  Replayer replayer(std::move(frames), sessions.size(), speed, fast);
+  if (!replayer.connect(host, port))
+    return 1;
+
+  replayer.run();
+  replayer.report();
+  return 0;
+}
@@ -2,15 +2,100 @@
 #define NET_SERVER
 
 #include "net.h"
+#include "net_snapshot.h"
+#include "net_ratelimit.h"
+#include "net_spsc.h"
+#include "net_topic.h"
+#include <unordered_map>
+#include <unordered_set>
+#ifdef __linux__
+#include <pthread.h>
+#endif
 
 using boost::asio::ip::tcp;
 
 namespace net {
+  // How the server spreads accepting and connection I/O over threads
+  struct listener_options {
+    // Threads running connection I/O, each with an io_context of its own.
+    // A connection stays on the thread that accepted it for its whole life.
+    std::size_t io_threads = 1;
+
+    // async_accept calls kept outstanding per acceptor, so a burst of
+    // reconnecting clients is not taken one completion at a time
+    std::size_t pending_accepts = 16;
+
+    // One SO_REUSEPORT acceptor per io thread and let the kernel balance new
+    // connections between them. Without it (or where the platform lacks
+    // SO_REUSEPORT) a single acceptor hands sockets out round robin.
+    bool reuse_port = false;
+
+    // Let idle connections wait for readability without holding a receive
+    // buffer (see connection::set_idle_wait). Turn off to trade memory for
+    // one less operation per message, e.g. when running on io_uring.
+    bool idle_wait = true;
+
+    // Frame buffers allocated up front as one slab, so a warm server no
+    // longer allocates on the receive and send paths
+    std::size_t reserve_buffers = 0;
+
+    // Broadcast batching (see connection::set_flush_policy): hold outgoing
+    // frames for up to flush_interval, or until flush_bytes are queued, and
+    // write them together. Zero sends every frame right away.
+    std::chrono::microseconds flush_interval{ 0 };
+    std::size_t flush_bytes = 64 * 1024;
+
+    // Federation: this server's node id, unique among its peers and carried in
+    // the top byte of every connection id it hands out, and the batching of
+    // the links to those peers. A peer link carries one frame per relayed
+    // message however many users sit on the other end, so it is always
+    // batched.
+    uint8_t node_id = 0;
+    std::chrono::microseconds peer_flush_interval{ 1000 };
+
+    // Sharded outbound fan-out: every io thread becomes a shard with its own
+    // inbound queue and its own list of the connections it runs. Whatever the
+    // thread calling update() sends to clients crosses over through a
+    // lock-free mailbox per shard, and a broadcast is fanned out by each
+    // shard to its own connections - one mailbox entry per shard instead of
+    // one cross-thread post per recipient. Only sending is split up: every
+    // message is still handled on the thread calling update(), which owns
+    // the connection list, the senders' buckets and the handlers' own state.
+    bool shard_fanout = false;
+
+    // Pin io thread i to CPU i (Linux only)
+    bool pin_threads = false;
+  };
+
+  // Tokens a message costs against its sender's bucket and against the room
+  // bucket. The room cost is meant to be the fan-out: a line relayed to 5,000
+  // members costs the room 5,000.
+  struct rate_cost {
+    double sender = 1;
+    double room = 0;
+  };
+
   template <typename T>
   class server_interface {
   public:
-    server_interface(uint16_t port)
-        : __acceptor(__io_context, tcp::endpoint(tcp::v4(), port)) {}
+    server_interface(uint16_t port, listener_options options = {})
+        : __port(port), __options(options)
+    {
+      __options.io_threads = std::max<std::size_t>(__options.io_threads, 1);
+      __options.pending_accepts = std::max<std::size_t>(__options.pending_accepts, 1);
+      for (std::size_t i = 0; i < __options.io_threads; ++i) {
+        __io_contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+        __work.push_back(boost::asio::make_work_guard(*__io_contexts.back()));
+        if (__options.shard_fanout) {
+          __shards.push_back(std::make_unique<shard>());
+          __shards.back()->context = __io_contexts.back().get();
+          __shards.back()->inbound.set_doorbell(&__doorbell);
+        }
+      }
+      __q_messages_in.set_doorbell(&__doorbell);
+      __q_deferred.set_doorbell(&__doorbell);
+      message_pool<T>::get().reserve(__options.reserve_buffers);
+    }
 
     virtual ~server_interface() { stop(); }
 
@@ -18,140 +103,857 @@ namespace net {
     bool start()
     {
       try {
-        // Issue a task to the asio context - This is important
-        // as it will prime the context with "work", and stop it
+        bool sharded = __options.reuse_port && __options.io_threads > 1;
+#ifndef SO_REUSEPORT
+        if (sharded)
+          log_warning("[SERVER] SO_REUSEPORT is not available, using a single acceptor");
+        sharded = false;
+#endif
+        // One acceptor per io thread when sharding, otherwise just one
+        for (std::size_t i = 0; i < (sharded ? __io_contexts.size() : 1); ++i)
+          __acceptors.push_back(open_acceptor(*__io_contexts[i], sharded));
+
+        // Issue tasks to the asio contexts - This is important
+        // as it will prime them with "work", and stop them
         // from exiting immediately. Since this is a server, we
-        // wnat it primed ready to handle clients trying to connect.
-        wait_for_client_connection();
-        __context_thread = std::thread([this]() { __io_context.run(); });
+        // wnat them primed ready to handle clients trying to connect.
+        for (auto &acceptor : __acceptors)
+          for (std::size_t i = 0; i < __options.pending_accepts; ++i)
+            wait_for_client_connection(*acceptor);
+
+        for (auto &ctx : __io_contexts) {
+          __context_threads.emplace_back([&ctx]() { ctx->run(); });
+          if (__options.pin_threads)
+            pin_thread(__context_threads.back(), __context_threads.size() - 1);
+        }
       } catch (std::exception &excp) {
         // Something prohibited the server from listening.
-        std::cerr << "[SERVER] Exception: " << excp.what() << '\n';
+        log_error("[SERVER] Exception: ", excp.what());
         return false;
       }
 
-      std::cout << "[SERVER MESSAGE] Server started...\n";
+      log_info("[SERVER MESSAGE] Server started, ", __io_contexts.size(), __shards.empty() ? " io thread(s), " : " shard(s), ",
+               __acceptors.size(), " acceptor(s), ", backend_name(), " backend...");
       return true;
     }
 
     void stop()
     {
-      __io_context.stop();
-      if (__context_thread.joinable())
-        __context_thread.join();
+      for (auto &ctx : __io_contexts)
+        ctx->stop();
+      for (auto &thread : __context_threads)
+        if (thread.joinable())
+          thread.join();
+      __context_threads.clear();
 
-      std::cout << "[SERVER] Server stopped...\n";
+      log_info("[SERVER] Server stopped...");
     }
 
-    void wait_for_client_connection()
+    void wait_for_client_connection(tcp::acceptor &acceptor)
     {
       // Prime context with an instruction to wait until a socket connects. This
       // is the purpose of an "acceptor" object. It will provide a unique socket
-      // for each incoming connection attempt.
-      __acceptor.async_accept([this](std::error_code err, tcp::socket socket) {
+      // for each incoming connection attempt. A sharded acceptor keeps its
+      // connections on its own thread, a shared one deals them out in turn.
+      boost::asio::io_context &target = __acceptors.size() > 1
+                                          ? static_cast<boost::asio::io_context &>(acceptor.get_executor().context())
+                                          : *__io_contexts[__next_context++ % __io_contexts.size()];
+
+      acceptor.async_accept(target, [this, &acceptor, &target](std::error_code err, tcp::socket socket) {
         // Trigged by incoming connection request.
         if (!err) {
-          std::cout << "[SERVER MESSAGE] Server Get New Connection\n";
+          log_debug("[SERVER MESSAGE] Server Get New Connection");
 
-          // Create a new connection to handle this client.
+          // Create a new connection to handle this client. With shard_fanout it
+          // delivers into the inbound queue of the shard that runs it.
+          const std::size_t shard_index = context_index(target);
           std::shared_ptr<connection<T>> new_connect =
-            std::make_shared<connection<T>>(connection<T>::owner::server, __io_context, std::move(socket), __q_messages_in);
+            std::make_shared<connection<T>>(connection<T>::owner::server, target, std::move(socket),
+                                            __shards.empty() ? __q_messages_in : __shards[shard_index]->inbound);
+          new_connect->set_shard(static_cast<uint16_t>(shard_index));
 
           // Give the user server a chance to deny connection.
-          if (__on_client_connect(new_connect)) {
-            // Connection allowed, so add to container of new connection.
-            __connection_deq.push_back(std::move(new_connect));
+          new_connect->set_tracer(&__tracer);
+          new_connect->set_capture(&__capture);
+          new_connect->set_idle_wait(__options.idle_wait);
+          new_connect->set_flush_policy(__options.flush_interval, __options.flush_bytes);
 
+          if (__on_client_connect(new_connect)) {
             // Issue a task to the connection's asio context to sit
             // and wait for bytes to arrive.
-            __connection_deq.back()->connect_to_client(__io_counter++);
+            new_connect->connect_to_client(make_global_id(__options.node_id, __io_counter.fetch_add(1, std::memory_order_relaxed)));
 
-            //std::cout << "[" << __connection_deq.back()->get_id() << "] Connection Accepted...\n";
+            // The shard's own list is only touched on the shard's thread
+            if (!__shards.empty())
+              boost::asio::post(target, [s = __shards[shard_index].get(), new_connect]() { s->members.push_back(new_connect); });
+
+            // Connection allowed. It joins the container with the next
+            // publish, before any message is dispatched, so a burst of
+            // accepts costs one new version of the container, not one each.
+            // Broadcasters still iterating the old one are unaffected.
+            __connections.stage(std::move(new_connect));
           }
           else {
             // Connection will go out of scope with no pending tasks, so will
             // get destroyed automatically due to the wonder of smart pointers.
-            std::cout << "[-----] Connection Denied...!\n";
+            log_info("[-----] Connection Denied...!");
           }
         }
+        else if (err == boost::system::error_code(boost::asio::error::operation_aborted)) {
+          // Acceptor closed, the server is going down
+          return;
+        }
         else {
           // Error has occured during acceptance.
-          std::cout << "[SERVER] Connection Error: " << err.message() << '\n';
+          log_warning("[SERVER] Connection Error: ", err.message());
         }
 
-        wait_for_client_connection();
+        wait_for_client_connection(acceptor);
       });
     }
 
-    // Send a message to a specific client.
-    void message_client(std::shared_ptr<connection<T>> client, const message<T> &msg)
+    // Send a message to a specific client. The send functions are meant for
+    // the thread calling update() (the message handlers). They are safe from
+    // any thread, but with shard_fanout a send from elsewhere skips the
+    // mailbox and is not ordered with the handlers' sends to that client.
+    void message_client(std::shared_ptr<connection<T>> client, const message<T> &msg, priority prio = priority::normal)
+    {
+      message_client(std::move(client), frame_lease<T>::copy_of(msg), prio);
+    }
+
+    // Same, for a frame already in a pooled buffer (see current_frame())
+    void message_client(std::shared_ptr<connection<T>> client, const frame_lease<T> &frame, priority prio = priority::normal)
     {
       // Check if the client is legitimate...
       if (client && client->is_connected()) {
-        // ...and post the message via the connection.
-        client->send(msg);
+        // ...and post the message via the connection, or its shard's mailbox
+        if (__shards.empty())
+          client->send(frame, prio);
+        else
+          post_to_shard(*__shards[client->get_shard()], { frame, client, 0, prio, current_trace() });
       }
       else {
         // If we can't communicate with the client, then we may as
         // well remove the client - let the server know, it may
-        // be tracking it somehow.
-        __on_client_disconnect(client);
-
-        // off the client.
-        client.reset();
+        // be tracking it somehow. That happens in the sweep at the end of
+        // update(), together with every other client that went meanwhile.
+        __sweep_due.store(true, std::memory_order_relaxed);
+      }
+    }
 
-        // Then physically remove it from the containter
-        __connection_deq.erase(
-          std::remove(__connection_deq.begin(), __connection_deq.end(), client), __connection_deq.end());
+    // Send a run of frames to one client, queued back to back. Sharded, they
+    // go through the shard's mailbox like anything else for that client, so
+    // they stay in order with what was sent to it before and after.
+    void message_client_burst(std::shared_ptr<connection<T>> client, std::vector<frame_lease<T>> frames, priority prio = priority::normal)
+    {
+      if (client && client->is_connected()) {
+        if (__shards.empty())
+          client->send_burst(std::move(frames), prio);
+        else
+          for (frame_lease<T> &frame : frames)
+            post_to_shard(*__shards[client->get_shard()], { std::move(frame), client, 0, prio, current_trace() });
       }
+      else
+        __sweep_due.store(true, std::memory_order_relaxed);
     }
 
-    // Send message to all clients
-    void message_all_clients(const message<T> &msg, std::shared_ptr<connection<T>> ignored_client = nullptr)
+    // Send one client a frame whose payload ends in bytes of a file (see
+    // connection::send_file). Handed to the connection directly, with
+    // shard_fanout too: it only has to stay in order with the client's other file
+    // frames, and they all come from here.
+    void message_client_file(std::shared_ptr<connection<T>> client, frame_lease<T> head, std::shared_ptr<const spool_file> file,
+                             uint64_t offset, uint32_t bytes, priority prio = priority::bulk)
     {
-      bool invalid_client_exists = false;
+      if (client && client->is_connected())
+        client->send_file(std::move(head), std::move(file), offset, bytes, prio);
+      else
+        __sweep_due.store(true, std::memory_order_relaxed);
+    }
 
-      // Iterate through all clients in container
-      for (auto &__client : __connection_deq) {
-        // Check if the client is connect...
-        if (__client && __client->is_connected()) {
-          // ...if yes, and it's not the client been ignored
-          if (__client != ignored_client)
-            __client->send(msg);
-        }
-        else {
-          // The client couldn't be contacted, so assume it has disconnected.
-          __on_client_disconnect(__client);
-          __client.reset();
+    // Send message to all clients. The message is copied into a pooled frame
+    // once, every client then gets a lease on that same frame.
+    void message_all_clients(const message<T> &msg, std::shared_ptr<connection<T>> ignored_client = nullptr, priority prio = priority::normal)
+    {
+      message_all_clients(frame_lease<T>::copy_of(msg), std::move(ignored_client), prio);
+    }
+
+    // Same, for a frame already in a pooled buffer (see current_frame())
+    void message_all_clients(const frame_lease<T> &frame, std::shared_ptr<connection<T>> ignored_client = nullptr, priority prio = priority::normal)
+    {
+      // Sharded, every shard gets a lease and fans it out itself
+      if (!__shards.empty()) {
+        const uint32_t ignored = ignored_client ? ignored_client->get_id() : no_connection;
+        for (auto &s : __shards)
+          post_to_shard(*s, { frame, nullptr, ignored, prio, current_trace() });
+        return;
+      }
+
+      bool invalid_client_exists = false;
 
-          // Set this flag to then remove dead clients from container.
-          invalid_client_exists = true;
+      {
+        // Iterate through the current snapshot of clients - no lock is taken,
+        // accepts and removals publish new versions alongside us
+        auto clients = __connections.read();
+        for (const auto &__client : *clients) {
+          // Check if the client is connect...
+          if (__client && __client->is_connected()) {
+            // ...if yes, and it's not the client been ignored
+            if (__client != ignored_client)
+              __client->send(frame, prio);
+          }
+          else {
+            // The client couldn't be contacted, so assume it has disconnected.
+            invalid_client_exists = true;
+          }
         }
       }
 
-      // Remove dead clients, all in one go - this way, we don't invalidate the
-      // container as we iterated through it.
+      // Dead clients go in the sweep at the end of update(), all in one go
       if (invalid_client_exists)
-        __connection_deq.erase(
-          std::remove(__connection_deq.begin(), __connection_deq.end(), nullptr), __connection_deq.end());
+        __sweep_due.store(true, std::memory_order_relaxed);
+    }
+
+    // Take every client whose socket has closed out of the container and let
+    // the server know. update() does this periodically, so a client that
+    // leaves is reported even when nobody sends anything, and at the end of
+    // any update() in which a send found a client gone.
+    void remove_disconnected_clients()
+    {
+      auto removed = __connections.remove_if([](const auto &c) { return !c || !c->is_connected(); });
+      for (auto &dead : removed)
+        client_removed(dead);
     }
 
     // Force server to respond to incoming messages
+    // When waiting, update() returns at least every disconnect_check_interval so
+    // that departed clients are noticed without any traffic, and far more often
+    // while rate limited messages are waiting for tokens
     void update(std::size_t max_messages = -1, bool __wait = false)
     {
+      __update_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
       if (__wait)
-        __q_messages_in.wait();
+        __doorbell.wait_for(__delayed_senders.empty() ? disconnect_check_interval : delay_check_interval,
+                            [this]() { return has_inbound(); });
+
+      // Messages held back by the delay policy go first, in order per sender
+      std::size_t __message_count = release_delayed(max_messages);
+
+      // Process as many messages as you can up to the value specified. Each
+      // shard's queue is taken in turn, at most what it held when we got to it.
+      __message_count += drain_inbound(__q_messages_in, max_messages - __message_count);
+      for (auto &s : __shards)
+        __message_count += drain_inbound(s->inbound, max_messages - __message_count);
+
+      // Work other threads handed back, see defer()
+      for (std::size_t n = __q_deferred.count(); n > 0; --n)
+        __q_deferred.pop_front()();
+
+      // New connections are published by dispatch(), it may not have run
+      __connections.publish_staged();
+
+      auto now = std::chrono::steady_clock::now();
+      if (now - __last_disconnect_check >= disconnect_check_interval) {
+        __last_disconnect_check = now;
+        __sweep_due.store(false, std::memory_order_relaxed);
+        remove_disconnected_clients();
+        maintain_peer_links(now);
+      }
+      else if (__sweep_due.exchange(false, std::memory_order_relaxed))
+        remove_disconnected_clients();
+    }
 
-      // Process as many messages as you can up to the value specified.
-      std::size_t __message_count = 0;
-      while (__message_count < max_messages && !__q_messages_in.empty()) {
+    // Have fn run on the thread calling update(), from any thread. Work a
+    // handler hands off elsewhere (a disk write, say) comes back through here
+    // to touch what handlers own.
+    void defer(std::function<void()> fn)
+    {
+      __q_deferred.push_back(std::move(fn));
+    }
+
+    // Federation. Servers link up over ordinary connections: one side dials
+    // (add_peer), the other accepts it like any client, and once both sides
+    // have introduced themselves (accept_peer) the link leaves the client list.
+    // Peers form a full mesh and only ever pass on what their own users sent -
+    // a message from a peer is fanned out locally and never forwarded again
+    // (split horizon), so nothing can loop, and a frame claiming any origin
+    // other than the peer it came from is a bug or a lie (see peer_node).
+
+    // Dial a peer, now and again whenever the link drops
+    void add_peer(const std::string &host, uint16_t port)
+    {
+      peer_link link;
+      link.host = host;
+      link.port = port;
+      __peers.push_back(std::move(link));
+    }
+
+    // Record that the connection is the link to server node. Called when its
+    // hello arrives, on either end. Returns false if it can't be a peer (our
+    // own node id, or a node we are already linked with) and should be dropped.
+    bool accept_peer(std::shared_ptr<connection<T>> client, uint8_t node)
+    {
+      if (node == __options.node_id)
+        return false;
+      for (const peer_link &link : __peers)
+        if (link.identified && link.node == node && link.conn != client)
+          return false;
+
+      peer_link *link = find_peer(client);
+      if (!link) {
+        // An accepted client introducing itself as a server
+        if (__connections.remove_if([&client](const auto &c) { return c == client; }).empty())
+          return false;
+        __senders.erase(client->get_id());
+        __delayed_senders.erase(client->get_id());
+        drop_subscriptions(client);
+        if (!__shards.empty())
+          post_to_shard(*__shards[client->get_shard()], { {}, client, 0, priority::normal, {} });
+        __peers.emplace_back();
+        link = &__peers.back();
+        link->conn = client;
+        link->announced = true;
+        link->state->store(peer_state::connected);
+      }
+      link->node = node;
+      link->identified = true;
+      client->set_flush_policy(__options.peer_flush_interval, __options.flush_bytes);
+      log_info("[PEER] Linked with node ", static_cast<int>(node));
+      return true;
+    }
+
+    // Is this connection a link to another server (introduced or not)
+    bool is_peer(const std::shared_ptr<connection<T>> &client) const
+    {
+      return find_peer(client) != nullptr;
+    }
+
+    // Node id at the other end of a peer link, nothing for clients and for
+    // links still waiting for their hello
+    std::optional<uint8_t> peer_node(const std::shared_ptr<connection<T>> &client) const
+    {
+      const peer_link *link = find_peer(client);
+      if (!link || !link->identified)
+        return std::nullopt;
+      return link->node;
+    }
+
+    // Send a message once to every linked peer
+    void message_peers(const message<T> &msg, priority prio = priority::normal)
+    {
+      if (!__peers.empty())
+        message_peers(frame_lease<T>::copy_of(msg), prio);
+    }
+
+    void message_peers(const frame_lease<T> &frame, priority prio = priority::normal)
+    {
+      for (const peer_link &link : __peers)
+        if (link.identified && link.conn && link.conn->is_connected())
+          link.conn->send(frame, prio);
+    }
+
+    uint8_t node_id() const
+    {
+      return __options.node_id;
+    }
+
+    // Topic subscriptions (see net_topic.h). A client holds at most
+    // max_subscriptions_per_client patterns; they go when it does.
+    bool subscribe(std::shared_ptr<connection<T>> client, std::string_view pattern)
+    {
+      std::vector<std::string> &patterns = __subscriptions[client->get_id()];
+      if (patterns.size() >= max_subscriptions_per_client || !__topics.subscribe(pattern, client)) {
+        if (patterns.empty())
+          __subscriptions.erase(client->get_id());
+        return false;
+      }
+      patterns.emplace_back(pattern);
+      return true;
+    }
+
+    bool unsubscribe(std::shared_ptr<connection<T>> client, std::string_view pattern)
+    {
+      auto patterns = __subscriptions.find(client->get_id());
+      if (patterns == __subscriptions.end() || !__topics.unsubscribe(pattern, client))
+        return false;
+      auto &list = patterns->second;
+      list.erase(std::find(list.begin(), list.end(), pattern));
+      if (list.empty())
+        __subscriptions.erase(patterns);
+      return true;
+    }
+
+    // How many clients a message on topic goes out to
+    std::size_t topic_fanout(std::string_view topic)
+    {
+      return __topics.match(topic)->size();
+    }
+
+    // Send a message to every client subscribed to a pattern matching topic,
+    // once each however many of its patterns match
+    void message_topic(std::string_view topic, const frame_lease<T> &frame, std::shared_ptr<connection<T>> ignored_client = nullptr,
+                       priority prio = priority::normal)
+    {
+      // Held on to, sending may drop dead clients and with them the cached list
+      auto subscribers = __topics.match(topic);
+      for (const auto &client : *subscribers)
+        if (client != ignored_client)
+          message_client(client, frame, prio);
+    }
+
+    // Trace one received message out of every sample_every (0 = off) and
+    // aggregate its stage-to-stage latencies
+    void enable_tracing(uint32_t sample_every)
+    {
+      __tracer.enable(sample_every);
+    }
+
+    // Log the per-stage latency histograms collected so far
+    void report_tracing() const
+    {
+      __tracer.report();
+    }
+
+    // Limit every sender, and all senders together (the room), to a token
+    // rate. Costs come from __message_cost(). A disabled limit (rate 0) costs
+    // nothing to check.
+    void set_rate_limits(const rate_limit &sender, const rate_limit &room)
+    {
+      __sender_limit = sender;
+      __room_limit = room;
+    }
+
+    const rate_meter &sender_rate_meter() const
+    {
+      return __sender_meter;
+    }
+
+    const rate_meter &room_rate_meter() const
+    {
+      return __room_meter;
+    }
+
+    // Log how often each limit fired
+    void report_rate_limits() const
+    {
+      auto line = [](const char *which, const rate_limit &limit, const rate_meter &m) {
+        if (limit.enabled())
+          log_info("[RATE] ", which, " ", limit.rate, "/s burst ", limit.burst, " (", rate_policy_name(limit.policy), "): ",
+                   m.admitted, " admitted, ", m.delayed, " delayed, ", m.dropped, " dropped, ", m.disconnected, " disconnected");
+      };
+      line("sender", __sender_limit, __sender_meter);
+      line("room", __room_limit, __room_meter);
+    }
+
+    // Record every inbound frame with its arrival time and connection id, so
+    // the traffic can be replayed later (see replay/src/Replay.cpp)
+    bool start_recording(const std::string &path)
+    {
+      return __capture.start(path, sizeof(message_header<T>) + max_text_bytes);
+    }
+
+    void stop_recording()
+    {
+      __capture.stop();
+    }
+
+  private:
+    // Handle up to max_messages from one inbound queue, returns how many
+    std::size_t drain_inbound(ts_queue<owned_message<T>> &queue, std::size_t max_messages)
+    {
+      std::size_t count = 0;
+      for (std::size_t n = std::min(queue.count(), max_messages); n > 0; --n) {
         // Grab the front message
-        auto msg = __q_messages_in.pop_front();
+        auto msg = queue.pop_front();
+        msg.trace.stamp(trace_stage::dequeued);
 
-        // Pass to message handler
-        __on_message(msg.remote, msg.msg);
-        __message_count++;
+        // Rate limits are enforced before the handler ever sees the message
+        if (!admit(msg))
+          continue;
+
+        dispatch(msg);
+        count++;
+      }
+      return count;
+    }
+
+    bool has_inbound()
+    {
+      if (!__q_messages_in.empty() || !__q_deferred.empty())
+        return true;
+      for (auto &s : __shards)
+        if (!s->inbound.empty())
+          return true;
+      return false;
+    }
+
+    // What the thread calling update() hands a shard: a frame for one
+    // connection, for every connection but one (target empty), or - without
+    // a frame - word that target is no longer a client of the shard
+    struct shard_mail {
+      frame_lease<T> frame;
+      std::shared_ptr<connection<T>> target;
+      uint32_t ignored = 0;
+      priority prio = priority::normal;
+      trace_stamps trace{};
+    };
+
+    struct shard {
+      boost::asio::io_context *context = nullptr;
+      ts_queue<owned_message<T>> inbound;    // from this shard's connections
+      spsc_ring<shard_mail, 1024> mailbox;    // from the thread calling update()
+      std::atomic<bool> drain_posted{ false };
+
+      // Connections run by this shard, only touched on its thread
+      std::vector<std::shared_ptr<connection<T>>> members;
+    };
+
+    static constexpr uint32_t no_connection = std::numeric_limits<uint32_t>::max();
+
+    static trace_stamps current_trace()
+    {
+      trace_stamps *origin = stage_tracer::current();
+      return origin && origin->sampled ? *origin : trace_stamps{};
+    }
+
+    std::size_t context_index(const boost::asio::io_context &ctx) const
+    {
+      for (std::size_t i = 0; i < __io_contexts.size(); ++i)
+        if (__io_contexts[i].get() == &ctx)
+          return i;
+      return 0;
+    }
+
+    // The thread calling update() is the one producer of every mailbox. A
+    // full mailbox means the shard is behind, wait for it. Any other thread
+    // posts its mail to the shard as a task of its own.
+    void post_to_shard(shard &s, shard_mail &&mail)
+    {
+      if (std::this_thread::get_id() != __update_thread.load(std::memory_order_relaxed)) {
+        boost::asio::post(*s.context, [&s, mail = std::move(mail)]() mutable { deliver(s, mail); });
+        return;
+      }
+
+      while (!s.mailbox.try_push(std::move(mail)))
+        std::this_thread::yield();
+
+      // One drain at a time is enough, it takes everything it finds
+      if (!s.drain_posted.exchange(true, std::memory_order_acq_rel))
+        boost::asio::post(*s.context, [&s]() { drain_mailbox(s); });
+    }
+
+    // Runs on the shard's own thread
+    static void drain_mailbox(shard &s)
+    {
+      // Cleared first, so anything pushed from here on posts a new drain
+      s.drain_posted.store(false, std::memory_order_release);
+
+      shard_mail mail;
+      while (s.mailbox.try_pop(mail)) {
+        deliver(s, mail);
+        mail = {};
+      }
+    }
+
+    // Runs on the shard's own thread
+    static void deliver(shard &s, shard_mail &mail)
+    {
+      stage_tracer::current() = mail.trace.sampled ? &mail.trace : nullptr;
+      if (!mail.frame) {
+        // Became a peer link, no longer a client
+        s.members.erase(std::remove(s.members.begin(), s.members.end(), mail.target), s.members.end());
+      }
+      else if (mail.target) {
+        mail.target->send(mail.frame, mail.prio);
+      }
+      else {
+        // Fan out, dropping closed connections on the way
+        auto live = s.members.begin();
+        for (auto &member : s.members) {
+          if (!member->is_connected())
+            continue;
+          if (member->get_id() != mail.ignored)
+            member->send(mail.frame, mail.prio);
+          *live++ = std::move(member);
+        }
+        s.members.erase(live, s.members.end());
+      }
+      stage_tracer::current() = nullptr;
+    }
+
+    static void pin_thread(std::thread &thread, std::size_t cpu)
+    {
+#ifdef __linux__
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu % std::max(1u, std::thread::hardware_concurrency()), &set);
+      if (pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) != 0)
+        log_warning("[SERVER] Could not pin io thread to CPU ", cpu);
+#else
+      log_warning("[SERVER] Pinning io threads is only supported on Linux");
+#endif
+    }
+
+    // Pass a message to the handler, anything it sends inherits the stamps
+    void dispatch(owned_message<T> &msg)
+    {
+      // Connections accepted so far are in the container before anything
+      // is handled
+      __connections.publish_staged();
+
+      stage_tracer::current() = &msg.trace;
+      __dispatching = &msg.msg;
+      __on_message(msg.remote, *msg.msg);
+      __dispatching = nullptr;
+      stage_tracer::current() = nullptr;
+
+      msg.trace.stamp(trace_stage::dispatched);
+      __tracer.record_inbound(msg.trace);
+    }
+
+    // Per-sender limiter state, only touched from the thread calling update()
+    struct sender_state {
+      token_bucket bucket;
+      std::deque<owned_message<T>> backlog;    // held back by the delay policy
+    };
+
+    // Take the message's tokens from its sender and from the room
+    bool take_tokens(sender_state &state, const owned_message<T> &msg, bool &room_limited)
+    {
+      rate_cost cost = __message_cost(msg.remote, *msg.msg);
+      auto now = token_bucket::clock::now();
+      room_limited = false;
+      if (!state.bucket.try_take(__sender_limit, cost.sender, now))
+        return false;
+      if (!__room_bucket.try_take(__room_limit, cost.room, now)) {
+        state.bucket.refund(__sender_limit.enabled() ? cost.sender : 0);
+        room_limited = true;
+        return false;
+      }
+      __sender_meter.admitted++;
+      if (cost.room > 0)
+        __room_meter.admitted++;
+      return true;
+    }
+
+    // True if the message may be dispatched now. Otherwise the policy of the
+    // limit it ran into has been applied and the message is no longer ours.
+    bool admit(owned_message<T> &msg)
+    {
+      if ((!__sender_limit.enabled() && !__room_limit.enabled()) || !msg.remote)
+        return true;
+      // Peer links are exempt. Their users were limited where they joined,
+      // and dropping a relayed presence delta or hanging up on the link would
+      // put the nodes' rosters out of step for good.
+      if (is_peer(msg.remote))
+        return true;
+
+      sender_state &state = __senders[msg.remote->get_id()];
+      bool room_limited = false;
+      // Once a sender has a backlog, everything it sends queues up behind it
+      if (state.backlog.empty() && take_tokens(state, msg, room_limited))
+        return true;
+
+      const rate_limit &limit = room_limited ? __room_limit : __sender_limit;
+      rate_meter &meter = room_limited ? __room_meter : __sender_meter;
+      // The room running dry is nobody's fault in particular, whoever sends
+      // next may be held back or lose the message but is never hung up on
+      rate_policy policy = limit.policy;
+      if (room_limited && policy == rate_policy::disconnect)
+        policy = rate_policy::drop;
+      if (!state.backlog.empty())
+        enforce(rate_policy::delay, meter, state, msg);
+      else
+        enforce(policy, meter, state, msg);
+      return false;
+    }
+
+    void enforce(rate_policy policy, rate_meter &meter, sender_state &state, owned_message<T> &msg)
+    {
+      switch (policy) {
+      case rate_policy::delay:
+        if (state.backlog.size() < max_delayed_per_sender) {
+          meter.delayed++;
+          __delayed_senders.insert(msg.remote->get_id());
+          state.backlog.push_back(std::move(msg));
+          break;
+        }
+        // Backlog full, the sender keeps outrunning its limit
+        meter.dropped++;
+        break;
+      case rate_policy::drop:
+        meter.dropped++;
+        break;
+      case rate_policy::disconnect:
+        meter.disconnected++;
+        log_warning("[", msg.remote->get_id(), "] Exceeded its rate limit, disconnecting");
+        msg.remote->disconnect();
+        break;
+      }
+    }
+
+    // Dispatch whatever delayed messages have tokens again, returns how many.
+    // A handler may remove clients, so sender state is looked up afresh after
+    // every dispatch.
+    std::size_t release_delayed(std::size_t max_messages)
+    {
+      std::size_t count = 0;
+      std::vector<uint32_t> ids(__delayed_senders.begin(), __delayed_senders.end());
+      for (uint32_t id : ids) {
+        bool room_limited = false;
+        for (auto state = __senders.find(id); state != __senders.end() && !state->second.backlog.empty() && count < max_messages;
+             state = __senders.find(id)) {
+          if (!take_tokens(state->second, state->second.backlog.front(), room_limited))
+            break;
+          owned_message<T> msg = std::move(state->second.backlog.front());
+          state->second.backlog.pop_front();
+          dispatch(msg);
+          count++;
+        }
+        auto state = __senders.find(id);
+        if (state == __senders.end() || state->second.backlog.empty())
+          __delayed_senders.erase(id);
+      }
+      return count;
+    }
+
+    // Where a peer link is, as seen from the io thread that dials it
+    enum class peer_state : uint8_t {
+      idle,
+      connecting,
+      connected,
+      failed
+    };
+
+    struct peer_link {
+      std::string host;    // empty for links the peer dialled
+      uint16_t port = 0;
+      std::shared_ptr<connection<T>> conn;
+      std::shared_ptr<std::atomic<peer_state>> state = std::make_shared<std::atomic<peer_state>>(peer_state::idle);
+      bool announced = false;    // __on_peer_connect has run
+      bool identified = false;    // its hello arrived, node is valid
+      uint8_t node = 0;
+      std::chrono::steady_clock::time_point retry_at{};
+    };
+
+    peer_link *find_peer(const std::shared_ptr<connection<T>> &client)
+    {
+      for (peer_link &link : __peers)
+        if (link.conn && link.conn == client)
+          return &link;
+      return nullptr;
+    }
+
+    const peer_link *find_peer(const std::shared_ptr<connection<T>> &client) const
+    {
+      return const_cast<server_interface *>(this)->find_peer(client);
+    }
+
+    // Part of the periodic disconnect check: notice links that came up or
+    // went down, and redial the ones we are responsible for
+    void maintain_peer_links(std::chrono::steady_clock::time_point now)
+    {
+      for (auto link = __peers.begin(); link != __peers.end();) {
+        peer_state state = link->state->load(std::memory_order_acquire);
+
+        if (state == peer_state::connected && link->conn->is_connected()) {
+          if (!link->announced) {
+            link->announced = true;
+            __on_peer_connect(link->conn);
+          }
+          ++link;
+          continue;
+        }
+
+        if (state == peer_state::connected || state == peer_state::failed) {
+          // Went down, or never came up
+          if (link->identified) {
+            log_warning("[PEER] Lost link with node ", static_cast<int>(link->node));
+            __on_peer_disconnect(link->conn, link->node);
+          }
+          if (link->host.empty()) {
+            link = __peers.erase(link);
+            continue;
+          }
+          link->conn.reset();
+          link->announced = link->identified = false;
+          link->state->store(peer_state::idle);
+          link->retry_at = now + peer_retry_interval;
+        }
+
+        if (link->state->load() == peer_state::idle && now >= link->retry_at)
+          dial_peer(*link);
+        ++link;
+      }
+    }
+
+    // ASYNC - Resolve and connect a peer link on the first io thread
+    void dial_peer(peer_link &link)
+    {
+      boost::asio::io_context &ctx = *__io_contexts.front();
+      link.conn = std::make_shared<connection<T>>(connection<T>::owner::client, ctx, tcp::socket(ctx), __q_messages_in);
+      link.conn->set_flush_policy(__options.peer_flush_interval, __options.flush_bytes);
+      link.state->store(peer_state::connecting);
+
+      auto resolver = std::make_shared<tcp::resolver>(ctx);
+      resolver->async_resolve(link.host, std::to_string(link.port),
+                              [resolver, conn = link.conn, state = link.state](std::error_code ec, tcp::resolver::results_type endpoints) {
+                                if (ec) {
+                                  state->store(peer_state::failed);
+                                  return;
+                                }
+                                conn->connect_to_server(endpoints, peer_connect_timeout, [state](std::error_code ec) {
+                                  state->store(ec ? peer_state::failed : peer_state::connected, std::memory_order_release);
+                                });
+                              });
+    }
+
+    // Forget everything kept about a client that is gone, then tell the server
+    void client_removed(std::shared_ptr<connection<T>> client)
+    {
+      if (client) {
+        __senders.erase(client->get_id());
+        __delayed_senders.erase(client->get_id());
+        drop_subscriptions(client);
       }
+      __on_client_disconnect(client);
+    }
+
+    void drop_subscriptions(const std::shared_ptr<connection<T>> &client)
+    {
+      auto patterns = __subscriptions.find(client->get_id());
+      if (patterns == __subscriptions.end())
+        return;
+      for (const std::string &pattern : patterns->second)
+        __topics.unsubscribe(pattern, client);
+      __subscriptions.erase(patterns);
+    }
+
+    static const char *backend_name()
+    {
+#if defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_DISABLE_EPOLL)
+      return "io_uring";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+      return "epoll";
+#elif defined(BOOST_ASIO_HAS_IOCP)
+      return "iocp";
+#else
+      return "select";
+#endif
+    }
+
+    std::unique_ptr<tcp::acceptor> open_acceptor(boost::asio::io_context &ctx, bool reuse_port)
+    {
+      auto acceptor = std::make_unique<tcp::acceptor>(ctx);
+      tcp::endpoint endpoint(tcp::v4(), __port);
+      acceptor->open(endpoint.protocol());
+      acceptor->set_option(tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+      if (reuse_port)
+        acceptor->set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+      acceptor->bind(endpoint);
+      acceptor->listen(boost::asio::socket_base::max_listen_connections);
+      return acceptor;
     }
 
   protected:
@@ -159,38 +961,118 @@ namespace net {
     // customised functionality
 
     // Called when a client connects, you can veto the connection by returning false
-    virtual bool __on_client_connect(std::shared_ptr<connection<T>> client)
+    virtual bool __on_client_connect(std::shared_ptr<connection<T>> /*client*/)
     {
       return false;
     }
 
     // Called when a client appears to have disconnected
-    virtual void __on_client_disconnect(std::shared_ptr<connection<T>> client)
+    virtual void __on_client_disconnect(std::shared_ptr<connection<T>> /*client*/)
     {
     }
 
-    // Called when a message arrives
-    virtual void __on_message(std::shared_ptr<connection<T>> client, message<T> &msg)
+    // Called when a link this server dialled comes up, time to say hello
+    virtual void __on_peer_connect(std::shared_ptr<connection<T>> /*peer*/)
     {
     }
 
+    // Called when the link to a peer that had introduced itself drops
+    virtual void __on_peer_disconnect(std::shared_ptr<connection<T>> /*peer*/, uint8_t /*node*/)
+    {
+    }
+
+    // Called when a message arrives. msg is a view straight into the buffer
+    // the frame was received into, see current_frame() to forward it.
+    virtual void __on_message(std::shared_ptr<connection<T>> /*client*/, const message<T> & /*msg*/)
+    {
+    }
+
+    // Called before a message is dispatched when rate limits are on, returns
+    // what it costs. By default one sender token and nothing from the room.
+    virtual rate_cost __message_cost(std::shared_ptr<connection<T>> /*client*/, const message<T> & /*msg*/)
+    {
+      return {};
+    }
+
+
+    // Lease on the frame __on_message is looking at, only valid inside it.
+    // Forwarding this lease sends the received buffer itself, and edit() on
+    // it rewrites that buffer in place (msg sees the change).
+    frame_lease<T> &current_frame()
+    {
+      return *__dispatching;
+    }
 
   protected:
+    static constexpr std::chrono::milliseconds disconnect_check_interval{ 250 };
+    static constexpr std::chrono::milliseconds delay_check_interval{ 5 };
+    static constexpr std::size_t max_delayed_per_sender = 256;
+    static constexpr std::chrono::seconds peer_retry_interval{ 2 };
+    static constexpr std::chrono::seconds peer_connect_timeout{ 5 };
+    static constexpr std::size_t max_subscriptions_per_client = 64;
+
     // Thread Safe Queue for incoming message packets
     ts_queue<owned_message<T>> __q_messages_in;
 
-    // Container of active validated connections
-    std::deque<std::shared_ptr<connection<T>>> __connection_deq;
+    // Calls waiting for the thread calling update(), see defer()
+    ts_queue<std::function<void()>> __q_deferred;
+
+    // Container of active validated connections. Readers take a snapshot
+    // without locking, writers publish a new version (see net_snapshot.h).
+    snapshot_list<std::shared_ptr<connection<T>>> __connections;
+    std::atomic<bool> __sweep_due{ false };    // a send found a client gone
 
-    // Order of declaration is important - it is also the order of initialisation
-    boost::asio::io_context __io_context;
-    std::thread __context_thread;
+    uint16_t __port;
+    listener_options __options;
+
+    // Order of declaration is important - it is also the order of initialisation.
+    // Each io context is run by exactly one thread, so the handlers of a
+    // connection never run concurrently with each other.
+    std::vector<std::unique_ptr<boost::asio::io_context>> __io_contexts;
+    std::vector<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> __work;
+    std::vector<std::thread> __context_threads;
 
     // These things need an asio context
-    tcp::acceptor __acceptor;    // Handles new incoming connection attempts...
+    std::vector<std::unique_ptr<tcp::acceptor>> __acceptors;    // Handle new incoming connection attempts...
+    std::atomic<std::size_t> __next_context{ 0 };
+
+    // Shards, see listener_options::shard_fanout. All inbound queues ring the
+    // same doorbell to wake update().
+    std::vector<std::unique_ptr<shard>> __shards;
+    // The only producer of the shards' mailboxes
+    std::atomic<std::thread::id> __update_thread{};
+    doorbell __doorbell;
 
     // Clients will be identified in the "wider system" via an ID
-    uint32_t __io_counter = 0;
+    std::atomic<uint32_t> __io_counter{ 0 };
+
+    std::chrono::steady_clock::time_point __last_disconnect_check = std::chrono::steady_clock::now();
+
+    // Rate limiting, see set_rate_limits()
+    rate_limit __sender_limit;
+    rate_limit __room_limit;
+    token_bucket __room_bucket;
+    rate_meter __sender_meter;
+    rate_meter __room_meter;
+    std::unordered_map<uint32_t, sender_state> __senders;
+    std::unordered_set<uint32_t> __delayed_senders;
+
+    // Links to other servers, only touched from the thread calling update()
+    std::vector<peer_link> __peers;
+
+    // Topic subscriptions, and each client's patterns so they can be dropped
+    // with it. Only touched from the thread calling update().
+    topic_trie<std::shared_ptr<connection<T>>> __topics;
+    std::unordered_map<uint32_t, std::vector<std::string>> __subscriptions;
+
+    // The frame being dispatched, see current_frame()
+    frame_lease<T> *__dispatching = nullptr;
+
+    // Per-stage latency histograms, fed by sampled messages
+    stage_tracer __tracer;
+
+    // Inbound traffic recorder, idle unless start_recording() was called
+    capture_writer __capture;
   };
 }    // namespace net
 
@@ -1,91 +1,768 @@
+#include "chat_protocol.h"
 #include "net_server.h"
+#include <map>
+#include <unordered_map>
 
 namespace server_detail {
-  enum class msg_type : uint32_t {
-    JoinServer,
-    ServerAccept,
-    ServerDeny,
-    ServerPing,
-    MessageAll,
-    ServerMessage,
-    PassString
+  using chat::msg_type;
+  using chat::protocol;
+  using net::message_tag;
+
+  // Who a frame came from, when it was relayed by another server
+  struct from_peer {
+    uint8_t node;
+  };
+
+  // What the room keeps around: relayed frames for resuming sessions, and
+  // the files its users shared
+  struct room_options {
+    std::size_t replay_frames = 1024;
+    std::filesystem::path spool_dir = std::filesystem::temp_directory_path();
+    uint64_t max_file_bytes = 256ull << 20;
+    std::size_t max_files = 16;
+    // Everything in the spool at once, shared files and uploads in flight
+    // alike (an upload counts in full from its offer on)
+    uint64_t max_spool_bytes = 1ull << 30;
+    std::size_t max_uploads_per_client = 1;
   };
 
   class Server : public net::server_interface<msg_type> {
   public:
-    Server(uint16_t port)
-        : net::server_interface<msg_type>(port) {}
+    Server(uint16_t port, net::listener_options options = {}, room_options room = {})
+        : net::server_interface<msg_type>(port, options), __room(room.replay_frames), __room_options(std::move(room)) {}
 
   protected:
     virtual bool __on_client_connect(std::shared_ptr<net::connection<msg_type>> client)
     {
+      // Every session gets a ticket it can resume with after a reconnect
       net::message<msg_type> msg;
-      msg.header.id = msg_type::ServerAccept;
-      client->send(msg);
+      protocol::encode<msg_type::ServerAccept>(msg, { __tokens.issue(), __room.head() });
+      client->send(msg, net::priority::control);
       return true;
     }
 
     // Called when a client appears to have disconnected
     virtual void __on_client_disconnect(std::shared_ptr<net::connection<msg_type>> client)
     {
-      std::cout << "Removing client [" << client->get_id() << "] \n";
+      net::log_info("Removing client [", client->get_id(), "]");
+      drop_transfers(client->get_id());
+
+      // Only users that joined are on the roster, and only they are announced
+      if (__roster.erase(client->get_id())) {
+        net::message<msg_type> msg;
+        protocol::encode<msg_type::PresenceLeave>(msg, { client->get_id() });
+        message_joined_clients(msg);
+        message_peers(msg);
+      }
+    }
+
+    // A link we dialled is up, introduce ourselves
+    virtual void __on_peer_connect(std::shared_ptr<net::connection<msg_type>> peer)
+    {
+      send_hello(peer);
+    }
+
+    // Everyone who was on the far side of the link is gone as far as our
+    // users are concerned. They come back with the roster when it relinks.
+    virtual void __on_peer_disconnect(std::shared_ptr<net::connection<msg_type>> /*peer*/, uint8_t node)
+    {
+      for (auto user = __roster.begin(); user != __roster.end();) {
+        if (net::origin_node(user->first) != node) {
+          ++user;
+          continue;
+        }
+        net::message<msg_type> msg;
+        protocol::encode<msg_type::PresenceLeave>(msg, { user->first });
+        user = __roster.erase(user);
+        message_joined_clients(msg);
+      }
     }
 
-    // Called when a message arrives
+    // Called when a message arrives. The registry decodes the payload and
+    // calls the on() overload for its type; frames from other servers follow
+    // their own rules (the from_peer overloads).
     virtual void __on_message(std::shared_ptr<net::connection<msg_type>> client,
-                              net::message<msg_type> &msg)
+                              const net::message<msg_type> &msg)
+    {
+      bool handled;
+      if (auto node = peer_node(client))
+        handled = protocol::dispatch(*this, msg, from_peer{ *node });
+      else
+        handled = protocol::dispatch(*this, msg, client);
+      if (!handled)
+        net::log_debug("[", client->get_id(), "] Ignored frame of type ", static_cast<uint32_t>(msg.header.id));
+    }
+
+    // A relayed line costs the room one token per member it fans out to, so a
+    // single sender can't turn its own budget into a flood for everyone.
+    // Frames from peers are never charged, their senders were limited on the
+    // node they joined.
+    virtual net::rate_cost __message_cost(std::shared_ptr<net::connection<msg_type>> /*client*/,
+                                          const net::message<msg_type> &msg)
     {
+      const double sender = 1;
       switch (msg.header.id) {
-      case msg_type::ServerPing: {
-        std::wcout << "[" << msg.header.name.data() << "]: Ping the server\n";
+      case msg_type::PassString:
+      case msg_type::MessageAll:
+      case msg_type::JoinServer:
+      case msg_type::ServerMessage:
+      case msg_type::PresenceJoin:
+      case msg_type::PresenceRename:
+        return { sender, static_cast<double>(__connections.size()) };
+      // Topic traffic only reaches the subscribers
+      case msg_type::Publish:
+      case msg_type::TopicMessage: {
+        net::topic_message topic;
+        if (!net::topic_message::decode(msg.data, msg.header.size, topic))
+          return { sender, 0 };
+        return { sender, static_cast<double>(topic_fanout(topic.topic)) };
+      }
+      // Transfers pace themselves by credit and are capped in size, counting
+      // every chunk would only starve the sender's chat
+      case msg_type::FileChunk:
+      case msg_type::FileCredit:
+        return { 0, 0 };
+      default:
+        return { sender, 0 };
+      }
+    }
+
+  private:
+    friend protocol;
+    using client_ptr = std::shared_ptr<net::connection<msg_type>>;
+
+    // Transfers in flight, and the files users shared
+    struct upload {
+      std::shared_ptr<net::spool_file> file;
+      std::string name;
+      uint64_t size = 0;
+      uint64_t serial = 0;      // tells an upload from an earlier one under its key
+      uint64_t received = 0;    // everything before this is on its way to disk
+      uint64_t written = 0;     // and everything before this is on it
+      uint64_t credited = 0;
+    };
+    struct shared_file {
+      std::shared_ptr<const net::spool_file> file;
+      std::string name;
+      uint64_t size = 0;
+      uint32_t owner = 0;
+    };
+    struct download {
+      std::shared_ptr<const net::spool_file> file;
+      uint32_t owner = 0;
+      uint64_t size = 0;
+      uint64_t queued = 0;    // everything before this is on its way
+      uint64_t acked = 0;     // and everything before this has arrived
+    };
 
-        // Simply bounce message back to client
-        client->send(msg);
-        break;
+    void on(message_tag<msg_type::ServerPing>, client_ptr &client, const chat::ping_payload &)
+    {
+      net::log_debug("[", client->get_id(), "]: Ping the server");
+
+      // Simply bounce the frame back to client, ahead of any queued chat traffic
+      message_client(client, current_frame(), net::priority::control);
+    }
+
+    void on(message_tag<msg_type::MessageAll>, client_ptr &client, const net::empty_payload &)
+    {
+      net::log_debug("[", client->get_id(), "]: Send the message to all user");
+
+      //Construct a new message and send it to all clients
+      net::message<msg_type> __msg;
+      protocol::encode<msg_type::ServerMessage>(__msg, {});
+      __msg.header.sender = client->get_id();
+      auto frame = net::frame_lease<msg_type>::copy_of(__msg);
+      __room.stamp(frame);
+      message_all_clients(frame, client);
+      message_peers(frame);
+    }
+
+    void on(message_tag<msg_type::JoinServer>, client_ptr &client, const net::text_payload<net::max_name_bytes> &join)
+    {
+      // The name travels in the payload of this one frame. Everything relayed
+      // must be well-formed UTF-8, reject it here rather than have every
+      // receiving client deal with it.
+      std::string_view name = join.text;
+      if (!net::utf8_validate(name)) {
+        net::log_warning("[", client->get_id(), "] Dropped join with malformed name");
+        return;
       }
 
-      case msg_type::MessageAll: {
-        std::wcout << "[" << msg.header.name.data() << "]: Send the message to all user\n";
+      auto user = __roster.find(client->get_id());
+      if (user == __roster.end()) {
+        net::log_info("[", name, "] Join the server");
+        __roster.emplace(client->get_id(), std::string(name));
 
-        //Construct a new message and send it to all clients
+        // The newcomer gets the whole roster (itself included), everyone
+        // else just the one new entry
+        send_presence_snapshot(client);
         net::message<msg_type> __msg;
-        __msg.header.id = msg_type::ServerMessage;
-        __msg.header.name = msg.header.name;
-        message_all_clients(__msg, client);
-        break;
+        protocol::encode<msg_type::PresenceJoin>(__msg, { { client->get_id(), name } });
+        message_joined_clients(__msg, client);
+        message_peers(__msg);
       }
+      else if (user->second != name) {
+        // Joining again under another name is a rename
+        net::log_info("[", user->second, "] Renamed to [", name, "]");
+        user->second = std::string(name);
+        net::message<msg_type> __msg;
+        protocol::encode<msg_type::PresenceRename>(__msg, { { client->get_id(), name } });
+        message_joined_clients(__msg);
+        message_peers(__msg);
+      }
+    }
 
-      case msg_type::JoinServer: {
-        std::wcout << "[" << msg.header.name.data() << "] Join the server\n";
-        break;
+    void on(message_tag<msg_type::PassString>, client_ptr &client, const net::text_payload<net::max_text_bytes> &line)
+    {
+      // Others only know who is talking once the sender is on the roster
+      auto user = __roster.find(client->get_id());
+      if (user == __roster.end()) {
+        net::log_warning("[", client->get_id(), "] Dropped message sent before joining");
+        return;
+      }
+      if (!net::utf8_validate(line.text)) {
+        net::log_warning("[", client->get_id(), "] Dropped message with malformed text");
+        return;
       }
 
-      case msg_type::PassString: {
-        std::wcout << "[" << msg.header.name.data() << "]: " << msg.data.data() << '\n';
+      net::log_info("[", user->second, "]: ", line.text);
 
-        // Forward this text to all other clients
-        net::message<msg_type> __msg;
-        __msg.header.id = msg_type::ServerMessage;
-        __msg.header.name = msg.header.name;
-        __msg.data = msg.data;
-        __msg.time = msg.time;
-        message_all_clients(__msg, client);
-        break;
+      // Forward this text to all other clients, tagged with the sender's id
+      // and its place in the room's stream. Both types carry the same
+      // payload, so only the header changes: the frame is rewritten where it
+      // was received and that same buffer goes out to everyone.
+      net::frame_lease<msg_type> &frame = current_frame();
+      net::message_header<msg_type> &header = frame.edit().header;
+      header.id = msg_type::ServerMessage;
+      header.sender = client->get_id();
+      __room.stamp(frame);
+      message_all_clients(frame, client);
+      message_peers(frame);
+    }
+
+    // A client back after losing its connection. It gets what it missed as
+    // one burst: the answer, then the frames, oldest first.
+    void on(message_tag<msg_type::ResumeSession>, client_ptr &client, const net::session_ticket &ticket)
+    {
+      std::vector<net::frame_lease<msg_type>> burst(1);
+      net::resume_result result;
+      if (__tokens.known(ticket.token))
+        result = __room.collect(ticket.seq, burst);
+      else
+        result.from = result.to = __room.head();
+
+      net::message<msg_type> reply;
+      protocol::encode<msg_type::SessionResumed>(reply, result);
+      burst.front() = net::frame_lease<msg_type>::copy_of(reply);
+      net::log_info("[", client->get_id(), "] Resumed session, ", burst.size() - 1, " frame(s) replayed");
+      message_client_burst(client, std::move(burst));
+    }
+
+    void on(message_tag<msg_type::PeerHello>, client_ptr &client, const chat::hello_payload &hello)
+    {
+      // Another server introducing itself, on a link either side may have
+      // dialled. Whoever didn't dial answers with its own hello, and both
+      // then share the users they host.
+      const bool dialled = is_peer(client);
+      if (!accept_peer(client, hello.node)) {
+        net::log_warning("[", client->get_id(), "] Refused peer link from node ", static_cast<int>(hello.node));
+        client->disconnect();
+        return;
       }
+      if (!dialled)
+        send_hello(client);
+      send_local_roster(client);
+    }
+
+    // Relayed chat and presence from the users of another node. Each frame is
+    // only accepted if it originated on that node, and is only fanned out
+    // locally - never passed on to other peers.
+    void on(message_tag<msg_type::ServerMessage>, from_peer peer, const net::text_payload<net::max_text_bytes> &)
+    {
+      net::frame_lease<msg_type> &frame = current_frame();
+      if (net::origin_node(frame->header.sender) != peer.node)
+        return;
+      // Our users see it in our room's stream
+      __room.stamp(frame);
+      message_all_clients(frame);
+    }
+
+    void on(message_tag<msg_type::PresenceJoin>, from_peer peer, const chat::presence_entry_payload &user)
+    {
+      on_peer_presence(peer, user.entry);
+    }
+
+    void on(message_tag<msg_type::PresenceRename>, from_peer peer, const chat::presence_entry_payload &user)
+    {
+      on_peer_presence(peer, user.entry);
+    }
+
+    void on(message_tag<msg_type::PresenceLeave>, from_peer peer, const chat::presence_id_payload &user)
+    {
+      if (net::origin_node(user.id) == peer.node && __roster.erase(user.id))
+        message_joined_clients(current_frame());
+    }
+
+    // Topic subscriptions, held by the server_interface until the client
+    // drops them or goes
+    void on(message_tag<msg_type::Subscribe>, client_ptr &client, const chat::topic_pattern_payload &pattern)
+    {
+      if (subscribe(client, pattern.text))
+        net::log_info("[", client->get_id(), "] Subscribed to [", pattern.text, "]");
+      else
+        net::log_warning("[", client->get_id(), "] Refused subscription to [", pattern.text, "]");
+    }
+
+    void on(message_tag<msg_type::Unsubscribe>, client_ptr &client, const chat::topic_pattern_payload &pattern)
+    {
+      if (unsubscribe(client, pattern.text))
+        net::log_info("[", client->get_id(), "] Unsubscribed from [", pattern.text, "]");
+    }
+
+    // A line on a topic. Like PassString, the received frame itself is
+    // retagged and goes out to the topic's subscribers and to our peers.
+    void on(message_tag<msg_type::Publish>, client_ptr &client, const net::topic_message &line)
+    {
+      if (!__roster.count(client->get_id())) {
+        net::log_warning("[", client->get_id(), "] Dropped publish sent before joining");
+        return;
+      }
+      if (!net::topic_valid(line.topic) || !net::utf8_validate(line.text)) {
+        net::log_warning("[", client->get_id(), "] Dropped publish with malformed topic or text");
+        return;
       }
+
+      net::frame_lease<msg_type> &frame = current_frame();
+      net::message_header<msg_type> &header = frame.edit().header;
+      header.id = msg_type::TopicMessage;
+      header.sender = client->get_id();
+      // edit() may have switched to a copy, take the topic from the frame sent
+      const std::string_view topic(frame->data.data() + 1, line.topic.size());
+      message_topic(topic, frame, client);
+      message_peers(frame);
+    }
+
+    // A topic line from a user of another node, for our subscribers only
+    void on(message_tag<msg_type::TopicMessage>, from_peer peer, const net::topic_message &line)
+    {
+      if (net::origin_node(current_frame()->header.sender) != peer.node || !net::topic_valid(line.topic))
+        return;
+      message_topic(line.topic, current_frame());
+    }
+
+    // A user starting to share a file. Chunks may follow straight away, up
+    // to a window ahead of our credit; a refusal is a FileCancel. Older
+    // shared files make way for it if the spool is full, uploads in flight
+    // don't.
+    void on(message_tag<msg_type::FileOffer>, client_ptr &client, const net::file_offer &offer)
+    {
+      const uint64_t key = transfer_key(client->get_id(), offer.transfer);
+      std::shared_ptr<net::spool_file> spool;
+      if (__roster.count(client->get_id()) && offer.size > 0 && offer.size <= __room_options.max_file_bytes
+          && net::utf8_validate(offer.name) && !__uploads.count(key)
+          && uploads_of(client->get_id()) < __room_options.max_uploads_per_client) {
+        while (!__files.empty() && __spooled_bytes + offer.size > __room_options.max_spool_bytes)
+          evict_oldest_file();
+        if (__spooled_bytes + offer.size <= __room_options.max_spool_bytes)
+          spool = net::spool_file::create(__room_options.spool_dir);
+      }
+      if (!spool) {
+        net::log_warning("[", client->get_id(), "] Refused file offer of ", offer.size, " bytes");
+        send_cancel(client, offer.transfer);
+        return;
+      }
+      net::log_info("[", client->get_id(), "] Uploading [", offer.name, "], ", offer.size, " bytes");
+      __uploads.emplace(key, upload{ std::move(spool), std::string(offer.name), offer.size, __next_upload++ });
+      __spooled_bytes += offer.size;
+    }
+
+    void on(message_tag<msg_type::FileChunk>, client_ptr &client, const net::file_chunk &chunk)
+    {
+      const uint64_t key = transfer_key(client->get_id(), chunk.transfer);
+      auto it = __uploads.find(key);
+      if (it == __uploads.end())
+        return;    // cancelled, the rest of its window is still on the way
+      upload &up = it->second;
+      // An uploader starting a chunk past the window it was credited is not
+      // waiting for us, and would fill the spool as fast as it can send
+      if (chunk.offset != up.received || chunk.bytes.size() > up.size - up.received
+          || up.received - up.credited >= net::transfer_window) {
+        net::log_warning("[", client->get_id(), "] Dropped upload [", up.name, "] at ", up.received, " bytes");
+        drop_upload(it);
+        send_cancel(client, chunk.transfer);
+        return;
+      }
+      up.received += chunk.bytes.size();
+
+      // The disk thread writes the chunk straight from the frame it came in,
+      // in arrival order, and hands the result back to on_spooled()
+      boost::asio::post(__file_io, [this, client, key, serial = up.serial, file = up.file, frame = current_frame(),
+                                    offset = chunk.offset, bytes = chunk.bytes]() {
+        const bool written = file->write(offset, bytes.data(), bytes.size());
+        defer([this, client, key, serial, written, end = offset + bytes.size()]() {
+          on_spooled(client, key, serial, end, written);
+        });
+      });
     }
+
+    // Bytes of an upload up to end are on disk, or failed to get there.
+    // Credit only goes out for what is on disk, so an uploader can't run
+    // further ahead of the disk than its window; the file is shared once all
+    // of it is there.
+    void on_spooled(const client_ptr &client, uint64_t key, uint64_t serial, uint64_t end, bool written)
+    {
+      auto it = __uploads.find(key);
+      if (it == __uploads.end() || it->second.serial != serial)
+        return;    // dropped while the write was under way
+      upload &up = it->second;
+      const uint32_t transfer = static_cast<uint32_t>(key);
+      if (!written) {
+        net::log_warning("[", client->get_id(), "] Could not spool upload [", up.name, "] at ", up.written, " bytes");
+        drop_upload(it);
+        send_cancel(client, transfer);
+        return;
+      }
+      up.written = end;
+
+      // Credit every quarter window, so the uploader never stalls on a full one
+      const bool complete = up.written == up.size;
+      if (complete || up.written - up.credited >= net::transfer_window / 4) {
+        up.credited = up.written;
+        net::message<msg_type> credit;
+        protocol::encode<msg_type::FileCredit>(credit, { transfer, up.written });
+        message_client(client, credit, net::priority::control);
+      }
+      if (complete) {
+        share_file(client->get_id(), std::move(up));
+        __uploads.erase(it);
+      }
+    }
+
+    // A user asking for a shared file, from offset on (non-zero to pick up an
+    // interrupted download)
+    void on(message_tag<msg_type::FileFetch>, client_ptr &client, const net::file_credit &fetch)
+    {
+      auto file = __files.find(fetch.transfer);
+      if (file == __files.end() || fetch.offset >= file->second.size) {
+        send_cancel(client, fetch.transfer);
+        return;
+      }
+      const uint64_t key = transfer_key(client->get_id(), fetch.transfer);
+      __downloads[key] = download{ file->second.file, file->second.owner, file->second.size, fetch.offset, fetch.offset };
+      pump_download(client, key);
+    }
+
+    // A downloader confirming what it has, which opens the window further
+    void on(message_tag<msg_type::FileCredit>, client_ptr &client, const net::file_credit &credit)
+    {
+      const uint64_t key = transfer_key(client->get_id(), credit.transfer);
+      auto it = __downloads.find(key);
+      if (it == __downloads.end())
+        return;
+      download &down = it->second;
+      down.acked = std::max(down.acked, std::min(credit.offset, down.queued));
+      if (down.acked == down.size)
+        __downloads.erase(it);
+      else
+        pump_download(client, key);
+    }
+
+    // Either side of a transfer giving up on it
+    void on(message_tag<msg_type::FileCancel>, client_ptr &client, const net::file_cancel &cancel)
+    {
+      const uint64_t key = transfer_key(client->get_id(), cancel.transfer);
+      if (auto it = __uploads.find(key); it != __uploads.end())
+        drop_upload(it);
+      __downloads.erase(key);
+    }
+
+    void on_peer_presence(from_peer peer, const net::presence_entry &entry)
+    {
+      if (net::origin_node(entry.id) != peer.node)
+        return;
+      __roster[entry.id] = std::string(entry.name);
+      message_joined_clients(current_frame());
+    }
+
+    static uint64_t transfer_key(uint32_t client, uint32_t transfer)
+    {
+      return (static_cast<uint64_t>(client) << 32) | transfer;
+    }
+
+    void send_cancel(std::shared_ptr<net::connection<msg_type>> client, uint32_t transfer)
+    {
+      net::message<msg_type> msg;
+      protocol::encode<msg_type::FileCancel>(msg, { transfer });
+      message_client(client, msg, net::priority::control);
+    }
+
+    // A finished upload becomes a shared file and the room hears about it.
+    // Only the newest few are kept; downloads in flight hold on to theirs.
+    // Its bytes were counted in the spool when it was offered.
+    void share_file(uint32_t owner, upload up)
+    {
+      const uint32_t id = __next_file++;
+      net::log_info("[", owner, "] Shared [", up.name, "] as file ", id);
+
+      net::message<msg_type> ready;
+      protocol::encode<msg_type::FileReady>(ready, { id, up.size, up.name });
+      ready.header.sender = owner;
+      __files.emplace(id, shared_file{ std::move(up.file), std::move(up.name), up.size, owner });
+      while (__files.size() > __room_options.max_files)
+        evict_oldest_file();
+      message_joined_clients(ready);
+    }
+
+    void evict_oldest_file()
+    {
+      __spooled_bytes -= __files.begin()->second.size;
+      __files.erase(__files.begin());
+    }
+
+    void drop_upload(std::unordered_map<uint64_t, upload>::iterator it)
+    {
+      __spooled_bytes -= it->second.size;
+      __uploads.erase(it);
+    }
+
+    std::size_t uploads_of(uint32_t client) const
+    {
+      return std::count_if(__uploads.begin(), __uploads.end(),
+                           [client](const auto &entry) { return static_cast<uint32_t>(entry.first >> 32) == client; });
+    }
+
+    // Queue the next chunks of a download, as far as its window allows. Each
+    // chunk is a small head frame in a pooled buffer with up to
+    // transfer_frame_bytes of the file after it, sent from the spool file
+    // without passing through user space where the platform allows. They go
+    // on the bulk lane, so chat and control frames overtake them between
+    // chunks.
+    void pump_download(std::shared_ptr<net::connection<msg_type>> client, uint64_t key)
+    {
+      download &down = __downloads.at(key);
+      const uint32_t id = static_cast<uint32_t>(key);
+      while (down.queued < down.size && down.queued - down.acked < net::transfer_window) {
+        const uint32_t bytes = static_cast<uint32_t>(std::min<uint64_t>(down.size - down.queued, net::transfer_frame_bytes));
+        net::message<msg_type> head;
+        net::file_chunk{ id, down.queued, {} }.encode(head.data);
+        head.header.id = msg_type::FileChunk;
+        head.header.sender = down.owner;
+        head.header.size = static_cast<uint32_t>(net::transfer_header_bytes) + bytes;
+        message_client_file(client, net::frame_lease<msg_type>::copy_of(head), down.file, down.queued, bytes);
+        down.queued += bytes;
+      }
+    }
+
+    // Everything a departing client had in flight goes with it
+    void drop_transfers(uint32_t client)
+    {
+      auto owned = [client](const auto &entry) { return static_cast<uint32_t>(entry.first >> 32) == client; };
+      for (auto it = __uploads.begin(); it != __uploads.end();)
+        if (owned(*it))
+          drop_upload(it++);
+        else
+          ++it;
+      for (auto it = __downloads.begin(); it != __downloads.end();)
+        it = owned(*it) ? __downloads.erase(it) : std::next(it);
+    }
+
+    void send_hello(std::shared_ptr<net::connection<msg_type>> peer)
+    {
+      net::message<msg_type> msg;
+      protocol::encode<msg_type::PeerHello>(msg, { node_id() });
+      peer->send(msg, net::priority::control);
+    }
+
+    // A newly linked peer learns about our own users as a run of joins
+    void send_local_roster(std::shared_ptr<net::connection<msg_type>> peer)
+    {
+      for (const auto &[id, name] : __roster) {
+        if (net::origin_node(id) != node_id())
+          continue;
+        net::message<msg_type> msg;
+        protocol::encode<msg_type::PresenceJoin>(msg, { { id, name } });
+        peer->send(msg);
+      }
+    }
+
+    // Presence deltas only go to users on the roster, anyone else gets the
+    // full snapshot once they join. Dead clients are left to the periodic
+    // disconnect check.
+    void message_joined_clients(const net::message<msg_type> &msg, std::shared_ptr<net::connection<msg_type>> ignored_client = nullptr)
+    {
+      message_joined_clients(net::frame_lease<msg_type>::copy_of(msg), std::move(ignored_client));
+    }
+
+    void message_joined_clients(const net::frame_lease<msg_type> &frame, std::shared_ptr<net::connection<msg_type>> ignored_client = nullptr)
+    {
+      auto clients = __connections.read();
+      for (const auto &__client : *clients)
+        if (__client && __client != ignored_client && __client->is_connected() && __roster.count(__client->get_id()))
+          message_client(__client, frame);
+    }
+
+    void send_presence_snapshot(std::shared_ptr<net::connection<msg_type>> client)
+    {
+      std::vector<net::presence_entry> entries;
+      entries.reserve(__roster.size());
+      for (const auto &[id, name] : __roster)
+        entries.push_back({ id, name });
+
+      // Packed in full before anything is sent: sending may notice the client
+      // is gone and take it off the roster the entries point into
+      std::vector<net::message<msg_type>> frames;
+      net::pack_presence_snapshot<net::max_text_bytes>(entries, [&](const auto &data, std::size_t used) {
+        frames.emplace_back();
+        protocol::encode<msg_type::PresenceSnapshot>(frames.back(), { std::string_view(data.data(), used) });
+      });
+      for (const auto &msg : frames)
+        message_client(client, msg);
+    }
+
+    // Users that have joined, here or on a linked peer, by connection id. Only
+    // touched from the thread calling update(), like every handler above.
+    std::unordered_map<uint32_t, std::string> __roster;
+
+    // The room's relayed chat, numbered, with the newest frames kept for
+    // resuming sessions; and the tickets those sessions resume with
+    net::replay_buffer<msg_type> __room;
+    net::session_tokens __tokens;
+
+    // File sharing. Uploads are spooled to disk as their chunks arrive and
+    // become shared files once complete; downloads are served from those
+    // spools. Transfers in flight are keyed by client id and transfer id
+    // (the file's id, for downloads).
+    room_options __room_options;
+    std::unordered_map<uint64_t, upload> __uploads;
+    std::map<uint32_t, shared_file> __files;    // by id, so oldest first
+    uint64_t __spooled_bytes = 0;
+    std::unordered_map<uint64_t, download> __downloads;
+    uint32_t __next_file = 1;
+    uint64_t __next_upload = 1;
+
+    // Uploads are written to the spool here, off the thread running the
+    // handlers. One thread, so an upload's chunks land in order. Declared
+    // last: it is stopped before anything its work touches goes away.
+    boost::asio::thread_pool __file_io{ 1 };
   };
 }    // namespace server_detail
 
-int main()
+int main(int argc, char **argv)
 {
   using namespace server_detail;
-  Server server(9030);
+
+  // --trace N      : trace one message in N and report stage latencies periodically
+  // --record FILE  : capture all inbound traffic for the replay tool
+  // --io-threads N : run connection I/O on N threads
+  // --reuse-port   : give every io thread its own SO_REUSEPORT acceptor
+  // --eager-read   : read straight into pooled buffers, no readiness wait
+  // --reserve N    : allocate N frame buffers up front
+  // --flush-ms N   : batch outgoing frames per client for up to N ms
+  // --sender-rate N / --sender-burst N : messages per second each client may send
+  // --room-rate N / --room-burst N     : deliveries per second all relays together may cause
+  // --rate-policy delay|drop|disconnect : what happens to messages over a limit
+  // --port N       : listen on port N (9030)
+  // --node N       : this server's node id among its peers (0-255)
+  // --peer HOST:PORT : link up with another server, repeat for each one
+  // --peer-flush-ms N : batch frames to peers for up to N ms
+  // --shard-fanout : fan outgoing frames out per io thread through mailboxes
+  // --pin          : pin io thread i to CPU i
+  // --replay N     : keep the newest N relayed frames for resuming sessions (1024)
+  // --spool DIR    : keep shared files in DIR (the system's temp directory)
+  // --max-file-mb N : largest file a user may share, in MiB (256)
+  // --max-files N  : shared files kept for download at a time (16)
+  // --max-spool-mb N : all shared files and uploads together, in MiB (1024)
+  // --max-uploads N : uploads one user may have in flight at a time (1)
+  uint32_t trace_every = 0;
+  std::string record_path;
+  net::listener_options options;
+  net::rate_limit sender_limit, room_limit;
+  uint16_t port = 9030;
+  room_options room;
+  std::vector<std::pair<std::string, uint16_t>> peers;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--reuse-port")
+      options.reuse_port = true;
+    else if (arg == "--eager-read")
+      options.idle_wait = false;
+    else if (arg == "--shard-fanout")
+      options.shard_fanout = true;
+    else if (arg == "--pin")
+      options.pin_threads = true;
+    else if (i + 1 >= argc)
+      break;
+    else if (arg == "--trace")
+      trace_every = static_cast<uint32_t>(std::stoul(argv[++i]));
+    else if (arg == "--record")
+      record_path = argv[++i];
+    else if (arg == "--io-threads")
+      options.io_threads = std::stoul(argv[++i]);
+    else if (arg == "--reserve")
+      options.reserve_buffers = std::stoul(argv[++i]);
+    else if (arg == "--flush-ms")
+      options.flush_interval = std::chrono::microseconds(static_cast<int64_t>(std::stod(argv[++i]) * 1000));
+    else if (arg == "--sender-rate")
+      sender_limit.rate = std::stod(argv[++i]);
+    else if (arg == "--sender-burst")
+      sender_limit.burst = std::stod(argv[++i]);
+    else if (arg == "--room-rate")
+      room_limit.rate = std::stod(argv[++i]);
+    else if (arg == "--room-burst")
+      room_limit.burst = std::stod(argv[++i]);
+    else if (arg == "--replay")
+      room.replay_frames = std::stoul(argv[++i]);
+    else if (arg == "--spool")
+      room.spool_dir = argv[++i];
+    else if (arg == "--max-file-mb")
+      room.max_file_bytes = std::stoull(argv[++i]) << 20;
+    else if (arg == "--max-files")
+      room.max_files = std::max<std::size_t>(std::stoul(argv[++i]), 1);
+    else if (arg == "--max-spool-mb")
+      room.max_spool_bytes = std::stoull(argv[++i]) << 20;
+    else if (arg == "--max-uploads")
+      room.max_uploads_per_client = std::max<std::size_t>(std::stoul(argv[++i]), 1);
+    else if (arg == "--port")
+      port = static_cast<uint16_t>(std::stoul(argv[++i]));
+    else if (arg == "--node")
+      options.node_id = static_cast<uint8_t>(std::stoul(argv[++i]));
+    else if (arg == "--peer") {
+      std::string peer = argv[++i];
+      auto colon = peer.rfind(':');
+      if (colon != std::string::npos)
+        peers.emplace_back(peer.substr(0, colon), static_cast<uint16_t>(std::stoul(peer.substr(colon + 1))));
+    }
+    else if (arg == "--peer-flush-ms")
+      options.peer_flush_interval = std::chrono::microseconds(static_cast<int64_t>(std::stod(argv[++i]) * 1000));
+    else if (arg == "--rate-policy") {
+      std::string policy = argv[++i];
+      sender_limit.policy = room_limit.policy = policy == "delay"        ? net::rate_policy::delay
+                                                : policy == "disconnect" ? net::rate_policy::disconnect
+                                                                         : net::rate_policy::drop;
+    }
+  }
+
+  Server server(port, options, room);
+  for (const auto &[host, peer_port] : peers)
+    server.add_peer(host, peer_port);
+  server.enable_tracing(trace_every);
+  server.set_rate_limits(sender_limit, room_limit);
+  if (!record_path.empty())
+    server.start_recording(record_path);
+
   server.start();
 
+  auto last_report = std::chrono::steady_clock::now();
   while (true) {
     server.update(-1, true);
+
+    if (std::chrono::steady_clock::now() - last_report > std::chrono::seconds(10)) {
+      if (trace_every)
+        server.report_tracing();
+      server.report_rate_limits();
+      last_report = std::chrono::steady_clock::now();
+    }
   }
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,32 @@
+#ifndef TEST_CHECK
+#define TEST_CHECK
+
+#include <iostream>
+
+// The tests' one assertion. A failing CHECK reports where and carries on, so
+// one run shows every failure; main() returns test_result().
+namespace test_detail {
+  inline int &failures()
+  {
+    static int count = 0;
+    return count;
+  }
+}    // namespace test_detail
+
+// Variadic so that braced initializers with commas need no extra parentheses
+#define CHECK(...)                                                                                    \
+  do {                                                                                                \
+    if (!(__VA_ARGS__)) {                                                                             \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #__VA_ARGS__ ") failed" << std::endl;    \
+      ++test_detail::failures();                                                                      \
+    }                                                                                                 \
+  } while (false)
+
+inline int test_result()
+{
+  if (test_detail::failures() > 0)
+    std::cerr << test_detail::failures() << " check(s) failed" << std::endl;
+  return test_detail::failures() > 0 ? 1 : 0;
+}
+
+#endif
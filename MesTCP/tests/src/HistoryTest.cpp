@@ -0,0 +1,143 @@
+// The on-disk transcript: records survive a reopen, relayed lines are kept
+// once per (stream, seq), a record torn by a crash is cut off together with
+// whatever follows it, and the resume ticket is the highest seq of the newest
+// stream.
+
+#include "net_history.h"
+#include "test_check.h"
+#include <chrono>
+#include <string>
+
+namespace history_test {
+  const uint64_t stream_a = 7ull << 32;
+  const uint64_t stream_b = 9ull << 32;
+
+  std::filesystem::path scratch_path()
+  {
+    const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+    return std::filesystem::temp_directory_path() / ("mestcp-history-test-" + std::to_string(now)) / "room.mlog";
+  }
+
+  net::history_entry line(uint64_t token, uint32_t seq, int64_t time_ms, std::string_view text)
+  {
+    net::history_entry e;
+    e.token = token;
+    e.seq = seq;
+    e.time_ms = time_ms;
+    e.sender = 3;
+    e.flags = net::history_shown;
+    e.name = "alice";
+    e.text = text;
+    return e;
+  }
+
+  void append_and_reopen(const std::filesystem::path &path)
+  {
+    {
+      net::history_log log;
+      CHECK(log.open(path));
+      for (uint32_t seq = 1; seq <= 1000; ++seq) {
+        const std::string text = "line " + std::to_string(seq);
+        CHECK(log.append(line(stream_a | 1, seq, 1000 + seq, text)));
+      }
+      // Our own lines have no seq and are never taken for duplicates
+      CHECK(log.append(line(0, 0, 5000, "own")));
+      CHECK(log.append(line(0, 0, 5001, "own")));
+      CHECK(log.size() == 1002);
+    }
+
+    net::history_log log;
+    CHECK(log.open(path));
+    CHECK(log.size() == 1002);
+    const net::history_entry e = log.at(log.find_seq(stream_a, 500));
+    CHECK(e.seq == 500 && e.text == "line 500" && e.name == "alice" && e.time_ms == 1500 && e.sender == 3);
+    CHECK(log.find_seq(stream_a, 1001) == log.size());
+    CHECK(log.at(log.find_time(1777)).seq == 777);
+    CHECK(log.find_time(99999) == log.size());
+    CHECK(log.at(log.size() - 1).text == "own");
+  }
+
+  void dedup(const std::filesystem::path &path)
+  {
+    net::history_log log;
+    CHECK(log.open(path));
+    const std::size_t before = log.size();
+
+    // Seen again after a resume: same stream, same seq, any session token
+    CHECK(!log.append(line(stream_a | 2, 10, 9000, "again")));
+    // The same seq in another stream is a different line
+    CHECK(log.append(line(stream_b | 1, 10, 9000, "other stream")));
+    CHECK(log.size() == before + 1);
+    CHECK(log.at(log.find_seq(stream_b, 10)).text == "other stream");
+    CHECK(log.at(log.find_seq(stream_a, 10)).text == "line 10");
+  }
+
+  void resume_ticket(const std::filesystem::path &path)
+  {
+    net::history_log log;
+    CHECK(log.open(path));
+    // Replays land after live lines, so the newest record is not the highest
+    CHECK(log.append(line(stream_b | 1, 15, 9001, "live")));
+    CHECK(log.append(line(stream_b | 1, 12, 9002, "replayed")));
+    CHECK(log.append(line(0, 0, 9003, "own")));
+    const net::session_ticket ticket = log.last_ticket();
+    CHECK(ticket.token == (stream_b | 1));
+    CHECK(ticket.seq == 15);
+  }
+
+  void torn_tail(const std::filesystem::path &path)
+  {
+    std::size_t whole;
+    {
+      net::history_log log;
+      CHECK(log.open(path));
+      whole = log.size();
+      CHECK(log.append(line(stream_b | 1, 100, 9100, "cut short by a crash")));
+    }
+    // Lose the end of the last record
+    const auto bytes = std::filesystem::file_size(path);
+    std::filesystem::resize_file(path, bytes - 5);
+
+    {
+      net::history_log log;
+      CHECK(log.open(path));
+      CHECK(log.size() == whole);
+      CHECK(log.find_seq(stream_b, 100) == log.size());
+      // The torn record no longer counts as seen
+      CHECK(log.append(line(stream_b | 1, 100, 9100, "sent again")));
+      CHECK(log.size() == whole + 1);
+    }
+
+    net::history_log log;
+    CHECK(log.open(path));
+    CHECK(log.size() == whole + 1);
+    CHECK(log.at(log.size() - 1).text == "sent again");
+  }
+
+  void garbage_is_refused(const std::filesystem::path &path)
+  {
+    const std::filesystem::path other = path.parent_path() / "not-a-log";
+    {
+      std::ofstream out(other, std::ios::binary);
+      out << "definitely not a history log";
+    }
+    net::history_log log;
+    CHECK(!log.open(other));
+    CHECK(!log.is_open());
+    CHECK(!log.append(line(stream_a, 1, 1, "ignored")));
+  }
+}    // namespace history_test
+
+int main()
+{
+  const std::filesystem::path path = history_test::scratch_path();
+  history_test::append_and_reopen(path);
+  history_test::dedup(path);
+  history_test::resume_ticket(path);
+  history_test::torn_tail(path);
+  history_test::garbage_is_refused(path);
+
+  std::error_code ec;
+  std::filesystem::remove_all(path.parent_path(), ec);
+  return test_result();
+}
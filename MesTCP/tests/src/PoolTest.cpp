@@ -0,0 +1,113 @@
+// Block pool: a thread gets back the blocks it released itself without going
+// through the shared list, its cache holds a bounded number of them, and
+// whatever a thread still has cached when it exits goes back to the shared
+// list for the others. Reserved slab blocks are kept however small the idle
+// limit is. Each case uses a block type of its own, so each has its own pool.
+
+#include "net_pool.h"
+#include "test_check.h"
+#include <set>
+#include <thread>
+
+namespace pool_test {
+  template <int N>
+  struct block {
+    char bytes[64];
+  };
+
+  template <typename B>
+  using pool = net::block_pool<B>;
+
+  void reused_by_the_same_thread()
+  {
+    using B = block<1>;
+    auto first = pool<B>::get().acquire();
+    B *raw = first.get();
+    CHECK(pool<B>::get().in_use() == 1);
+    first.reset();
+    CHECK(pool<B>::get().in_use() == 0);
+    CHECK(pool<B>::get().idle() == 0);    // in this thread's cache, not the shared list
+    auto again = pool<B>::get().acquire();
+    CHECK(again.get() == raw);
+  }
+
+  void cache_is_bounded()
+  {
+    using B = block<2>;
+    std::vector<pool<B>::handle> blocks;
+    for (int i = 0; i < 40; ++i)
+      blocks.push_back(pool<B>::get().acquire());
+    CHECK(pool<B>::get().in_use() == 40);
+    blocks.clear();
+    CHECK(pool<B>::get().in_use() == 0);
+    CHECK(pool<B>::get().idle() == 8);    // 32 stay with this thread
+  }
+
+  void given_back_on_thread_exit()
+  {
+    using B = block<3>;
+    std::set<B *> released;
+    std::thread worker([&released] {
+      std::vector<pool<B>::handle> blocks;
+      for (int i = 0; i < 10; ++i) {
+        blocks.push_back(pool<B>::get().acquire());
+        released.insert(blocks.back().get());
+      }
+      blocks.clear();
+      CHECK(pool<B>::get().idle() == 0);
+    });
+    worker.join();
+
+    // The worker's cache went to the shared list, where this thread finds them
+    CHECK(pool<B>::get().idle() == 10);
+    std::vector<pool<B>::handle> blocks;
+    for (int i = 0; i < 10; ++i) {
+      blocks.push_back(pool<B>::get().acquire());
+      CHECK(released.count(blocks.back().get()) == 1);
+    }
+    CHECK(pool<B>::get().idle() == 0);
+  }
+
+  void released_by_another_thread()
+  {
+    using B = block<4>;
+    pool<B>::handle lent;
+    std::thread worker([&lent] { lent = pool<B>::get().acquire(); });
+    worker.join();
+    CHECK(pool<B>::get().in_use() == 1);
+    B *raw = lent.get();
+    lent.reset();
+    CHECK(pool<B>::get().in_use() == 0);
+    CHECK(pool<B>::get().acquire().get() == raw);    // now in this thread's cache
+  }
+
+  void idle_limit_and_slabs()
+  {
+    using B = block<5>;
+    pool<B>::get().reserve(4);
+    CHECK(pool<B>::get().idle() == 4);
+    pool<B>::get().set_max_idle(0);
+    CHECK(pool<B>::get().idle() == 4);    // slab blocks are never freed
+
+    // The slab's blocks are lent out first. Given back newest first, heap
+    // blocks fill this thread's cache, the rest of them are freed over the
+    // idle limit and the slab's go back to the shared list regardless.
+    std::vector<pool<B>::handle> blocks;
+    for (int i = 0; i < 40; ++i)
+      blocks.push_back(pool<B>::get().acquire());
+    CHECK(pool<B>::get().idle() == 0);
+    while (!blocks.empty())
+      blocks.pop_back();
+    CHECK(pool<B>::get().idle() == 4);
+  }
+}    // namespace pool_test
+
+int main()
+{
+  pool_test::reused_by_the_same_thread();
+  pool_test::cache_is_bounded();
+  pool_test::given_back_on_thread_exit();
+  pool_test::released_by_another_thread();
+  pool_test::idle_limit_and_slabs();
+  return test_result();
+}
@@ -0,0 +1,109 @@
+// Roster snapshots: packing splits a roster over as few payloads as fit, the
+// first and last payloads are flagged, and reading them back gives every
+// entry in order.
+
+#include "net_presence.h"
+#include "test_check.h"
+#include <string>
+
+namespace presence_test {
+  constexpr std::size_t payload = 1024;
+
+  struct unpacked {
+    std::vector<std::string> names;
+    std::vector<uint32_t> ids;
+    std::vector<uint8_t> flags;
+    bool malformed = false;
+  };
+
+  unpacked round_trip(const std::vector<net::presence_entry> &roster)
+  {
+    unpacked out;
+    net::pack_presence_snapshot<payload>(roster, [&](const std::array<char, payload> &data, std::size_t used) {
+      CHECK(used <= payload);
+      auto flags = net::read_presence_snapshot(data, [&](const net::presence_entry &e) {
+        out.ids.push_back(e.id);
+        out.names.emplace_back(e.name);
+      });
+      if (flags)
+        out.flags.push_back(*flags);
+      else
+        out.malformed = true;
+    });
+    return out;
+  }
+
+  void empty_roster()
+  {
+    unpacked out = round_trip({});
+    CHECK(!out.malformed);
+    CHECK(out.ids.empty());
+    CHECK(out.flags.size() == 1);
+    CHECK(out.flags.size() == 1 && out.flags[0] == (net::presence_snapshot_first | net::presence_snapshot_last));
+  }
+
+  void large_roster()
+  {
+    std::vector<std::string> names;
+    for (int i = 0; i < 20000; ++i)
+      names.push_back("user" + std::to_string(i));
+    std::vector<net::presence_entry> roster;
+    for (std::size_t i = 0; i < names.size(); ++i)
+      roster.push_back({ static_cast<uint32_t>(i * 7), names[i] });
+
+    unpacked out = round_trip(roster);
+    CHECK(!out.malformed);
+    CHECK(out.names == names);
+    CHECK(out.ids.size() == roster.size() && out.ids.back() == roster.back().id);
+
+    // Only the first payload starts the roster over, only the last ends it
+    CHECK(out.flags.size() > 1);
+    for (std::size_t i = 0; i < out.flags.size(); ++i) {
+      CHECK(((out.flags[i] & net::presence_snapshot_first) != 0) == (i == 0));
+      CHECK(((out.flags[i] & net::presence_snapshot_last) != 0) == (i + 1 == out.flags.size()));
+    }
+    // Payloads are filled before a new one is started: each one is short of
+    // full by less than an entry
+    std::size_t bytes = 0;
+    for (const std::string &name : names)
+      bytes += 5 + name.size();
+    CHECK(out.flags.size() <= bytes / (payload - 3 - (5 + 9)) + 1);
+  }
+
+  void long_names_are_cut()
+  {
+    const std::string name(300, 'n');
+    unpacked out = round_trip({ { 1, name } });
+    CHECK(out.names.size() == 1 && out.names[0] == name.substr(0, net::presence_max_name));
+  }
+
+  void entries_and_ids()
+  {
+    std::array<char, 16> data{};
+    CHECK(net::write_presence_entry(data, 0, { 42, "alice" }) == 10);
+    CHECK(net::write_presence_entry(data, 10, { 43, "bob" }) == 0);    // doesn't fit
+
+    net::presence_entry e;
+    CHECK(net::read_presence_entry(data, 0, e) == 10);
+    CHECK(e.id == 42 && e.name == "alice");
+
+    // A name running past the payload is malformed
+    data[4] = 100;
+    CHECK(net::read_presence_entry(data, 0, e) == 0);
+
+    net::write_presence_id(data, 0xdeadbeef);
+    CHECK(net::read_presence_id(data) == 0xdeadbeef);
+
+    // Ids go out least significant byte first, whatever the host
+    CHECK(data[0] == '\xef' && data[1] == '\xbe' && data[2] == '\xad' && data[3] == '\xde');
+  }
+}    // namespace presence_test
+
+int main()
+{
+  presence_test::empty_roster();
+  presence_test::large_roster();
+  presence_test::long_names_are_cut();
+  presence_test::entries_and_ids();
+  return test_result();
+}
@@ -0,0 +1,131 @@
+// The message registry: header validation against each type's payload limit,
+// encoding, and dispatch to exactly the handlers a type has, with payloads
+// that fail to decode rejected.
+
+#include "net_registry.h"
+#include "test_check.h"
+#include <string>
+
+namespace registry_test {
+  enum class msg : uint32_t { Ping = 0, Chat = 1, Note = 2, Blob = 7 };
+
+  using protocol = net::message_registry<net::message_spec<msg::Ping, net::empty_payload>,
+                                         net::message_spec<msg::Chat, net::text_payload<64>>,
+                                         net::message_spec<msg::Note, net::text_payload<16>>,
+                                         net::message_spec<msg::Blob, net::bytes_payload<8>>>;
+
+  // Handles everything but Note
+  struct handler {
+    int pings = 0;
+    std::string chat;
+    std::string blob;
+    int from = 0;
+
+    void on(net::message_tag<msg::Ping>, int sender, const net::empty_payload &)
+    {
+      ++pings;
+      from = sender;
+    }
+    void on(net::message_tag<msg::Chat>, int sender, const net::text_payload<64> &p)
+    {
+      chat = std::string(p.text);
+      from = sender;
+    }
+    void on(net::message_tag<msg::Blob>, int sender, const net::bytes_payload<8> &p)
+    {
+      blob = std::string(p.bytes);
+      from = sender;
+    }
+  };
+
+  net::message_header<msg> header(msg id, uint32_t size)
+  {
+    net::message_header<msg> h;
+    h.id = id;
+    h.size = size;
+    return h;
+  }
+
+  void accepts()
+  {
+    CHECK(protocol::accepts(header(msg::Ping, 0)));
+    CHECK(!protocol::accepts(header(msg::Ping, 1)));
+    CHECK(protocol::accepts(header(msg::Chat, 64)));
+    CHECK(!protocol::accepts(header(msg::Chat, 65)));
+    CHECK(protocol::accepts(header(msg::Blob, 8)));
+    // Gaps in the enumeration and anything past its end are unknown
+    CHECK(!protocol::accepts(header(static_cast<msg>(3), 0)));
+    CHECK(!protocol::accepts(header(static_cast<msg>(8), 0)));
+    CHECK(!protocol::accepts(header(static_cast<msg>(0xffffffff), 0)));
+
+    CHECK(protocol::max_payload(msg::Note) == std::optional<std::size_t>(16));
+    CHECK(!protocol::max_payload(static_cast<msg>(5)));
+  }
+
+  void encode_and_dispatch()
+  {
+    handler h;
+    net::message<msg> m;
+
+    protocol::encode<msg::Chat>(m, { "hello" });
+    CHECK(m.header.id == msg::Chat && m.header.size == 6);
+    CHECK(protocol::dispatch(h, m, 7));
+    CHECK(h.chat == "hello" && h.from == 7);
+
+    protocol::encode<msg::Ping>(m, {});
+    CHECK(m.header.size == 0);
+    CHECK(protocol::dispatch(h, m, 8));
+    CHECK(h.pings == 1 && h.from == 8);
+
+    protocol::encode<msg::Blob>(m, { std::string_view("0123456789") });
+    CHECK(m.header.size == 8);
+    CHECK(protocol::dispatch(h, m, 9));
+    CHECK(h.blob == "01234567");
+  }
+
+  void rejects()
+  {
+    handler h;
+    net::message<msg> m;
+
+    // A type the handler has no on() for
+    protocol::encode<msg::Note>(m, { "note" });
+    CHECK(!protocol::dispatch(h, m, 1));
+
+    // A type that is not in the registry
+    m.header.id = static_cast<msg>(4);
+    CHECK(!protocol::dispatch(h, m, 1));
+
+    // Payloads that fail to decode, or are too large for their type
+    protocol::encode<msg::Ping>(m, {});
+    m.header.size = 1;
+    CHECK(!protocol::dispatch(h, m, 1));
+    protocol::encode<msg::Chat>(m, { "hi" });
+    m.header.size = 65;
+    CHECK(!protocol::dispatch(h, m, 1));
+    CHECK(h.pings == 0 && h.chat.empty());
+  }
+
+  void text_is_cut_on_a_character()
+  {
+    // The terminator takes the last byte
+    handler h;
+    net::message<msg> m;
+    protocol::encode<msg::Chat>(m, { std::string(63, 'a') + "b" });
+    CHECK(m.header.size == 64);
+    CHECK(protocol::dispatch(h, m, 1) && h.chat == std::string(63, 'a'));
+
+    // 15 bytes fit before it, "é" takes two and is left out whole
+    protocol::encode<msg::Note>(m, { std::string(14, 'x') + "\xc3\xa9" });
+    CHECK(m.header.size == 15 && std::string(m.data.data()) == std::string(14, 'x'));
+  }
+}    // namespace registry_test
+
+int main()
+{
+  registry_test::accepts();
+  registry_test::encode_and_dispatch();
+  registry_test::rejects();
+  registry_test::text_is_cut_on_a_character();
+  return test_result();
+}
@@ -0,0 +1,140 @@
+// History search: tokens are folded the same way for lines and queries,
+// posting lists survive gaps of every varint length, and a query finds
+// exactly the records brute force does, newest first, whether the index was
+// built in one go or in steps.
+
+#include "net_search.h"
+#include "test_check.h"
+#include <chrono>
+#include <random>
+#include <set>
+#include <string>
+
+namespace search_test {
+  std::filesystem::path scratch_path()
+  {
+    const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+    return std::filesystem::temp_directory_path() / ("mestcp-search-test-" + std::to_string(now)) / "room.mlog";
+  }
+
+  void append(net::history_log &log, std::string_view text, bool shown = true)
+  {
+    net::history_entry e;
+    e.flags = shown ? net::history_shown : 0;
+    e.name = "bob";
+    e.text = text;
+    CHECK(log.append(e));
+  }
+
+  std::vector<std::string> tokens(std::string_view text)
+  {
+    std::vector<std::string> out;
+    net::for_each_search_token(text, [&](std::string_view token) { out.emplace_back(token); });
+    return out;
+  }
+
+  void tokenizer()
+  {
+    CHECK(tokens("Deploy-FAILED, at 3am!") == std::vector<std::string>({ "deploy", "failed", "at", "3am" }));
+    CHECK(tokens("Привет, МИР Ёж") == std::vector<std::string>({ "привет", "мир", "ёж" }));
+    CHECK(tokens("«цитата»\xc2\xa0" "end") == std::vector<std::string>({ "цитата", "end" }));
+    CHECK(tokens(" ... ").empty());
+  }
+
+  // Record numbers far apart take longer varints in the posting lists
+  void gaps(const std::filesystem::path &path)
+  {
+    const std::vector<std::size_t> at = { 0, 1, 128, 129, 16512, 16513, 300000 };
+    net::history_log log;
+    CHECK(log.open(path));
+    for (std::size_t i = 0, next = 0; i <= at.back(); ++i) {
+      const bool marked = next < at.size() && at[next] == i;
+      append(log, marked ? "needle filler" : "filler");
+      next += marked;
+    }
+    // Never shown, so never found
+    append(log, "needle", false);
+
+    net::search_index index;
+    index.update(log);
+    CHECK(index.indexed() == log.size());
+    const std::vector<std::size_t> expect(at.rbegin(), at.rend());
+    CHECK(index.find("Needle", at.size() + 10) == expect);
+    CHECK(index.find("needle", 3) == std::vector<std::size_t>(expect.begin(), expect.begin() + 3));
+    CHECK(index.find("needle absent").empty());
+    CHECK(index.find("").empty());
+    CHECK(index.find("needle needle", 100) == expect);
+  }
+
+  // Random lines over a small skewed vocabulary, queries of one to three
+  // words checked against a scan of every record
+  void against_brute_force(const std::filesystem::path &path)
+  {
+    std::mt19937 rng(12345);
+    std::vector<std::string> vocab;
+    for (int i = 0; i < 300; ++i)
+      vocab.push_back("w" + std::to_string(i));
+    auto pick = [&]() {
+      const double u = std::uniform_real_distribution<>(0, 1)(rng);
+      return vocab[static_cast<std::size_t>(u * u * vocab.size())];
+    };
+
+    net::history_log log;
+    CHECK(log.open(path));
+    std::vector<std::set<std::string>> lines;
+    for (int i = 0; i < 20000; ++i) {
+      std::string text;
+      std::set<std::string> words;
+      for (int n = 1 + rng() % 8; n > 0; --n) {
+        const std::string word = pick();
+        text += (rng() % 2 ? word : "W" + word.substr(1)) + (rng() % 3 ? " " : ", ");
+        words.insert(word);
+      }
+      const bool shown = rng() % 10 != 0;
+      append(log, text, shown);
+      lines.push_back(shown ? words : std::set<std::string>{});
+    }
+
+    // One index built in one go, one in uneven steps
+    net::search_index whole, stepped;
+    whole.update(log);
+    while (stepped.indexed() < log.size())
+      stepped.update(log, 1 + rng() % 3000);
+
+    int mismatches = 0, answered = 0;
+    for (int q = 0; q < 300; ++q) {
+      std::vector<std::string> words;
+      for (int n = 1 + rng() % 3; n > 0; --n)
+        words.push_back(pick());
+      std::string query;
+      for (const std::string &word : words)
+        query += word + " ";
+
+      std::vector<std::size_t> expect;
+      for (std::size_t i = lines.size(); i-- > 0;) {
+        bool all = true;
+        for (const std::string &word : words)
+          all = all && lines[i].count(word);
+        if (all)
+          expect.push_back(i);
+      }
+      answered += !expect.empty();
+      mismatches += whole.find(query, lines.size()) != expect;
+      mismatches += stepped.find(query, lines.size()) != expect;
+    }
+    CHECK(mismatches == 0);
+    CHECK(answered > 100);    // not just agreeing on nothing
+  }
+}    // namespace search_test
+
+int main()
+{
+  const std::filesystem::path path = search_test::scratch_path();
+  search_test::tokenizer();
+  search_test::gaps(path);
+  search_test::against_brute_force(path.parent_path() / "random.mlog");
+
+  std::error_code ec;
+  std::filesystem::remove_all(path.parent_path(), ec);
+  return test_result();
+}
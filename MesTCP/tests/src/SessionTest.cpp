@@ -0,0 +1,213 @@
+// Resuming a session: the replay buffer hands back everything after the last
+// frame a client saw with no gaps, says so when the oldest of it is gone, and
+// the client's tracker lets each sequenced frame through exactly once while
+// the replay and the live stream overlap. A ticket from another server run
+// starts the client over on the new stream.
+
+#include "net_session.h"
+#include "test_check.h"
+#include <array>
+#include <vector>
+
+namespace session_test {
+  enum class frame_type : uint32_t {
+    relayed = 1,
+  };
+
+  using frames = std::vector<net::frame_lease<frame_type>>;
+
+  void fill(net::replay_buffer<frame_type> &buffer, uint32_t count)
+  {
+    net::message<frame_type> msg;
+    msg.header.id = frame_type::relayed;
+    for (uint32_t i = 0; i < count; ++i) {
+      auto frame = net::frame_lease<frame_type>::copy_of(msg);
+      buffer.stamp(frame);
+    }
+  }
+
+  bool gap_free(const frames &out, uint32_t first, uint32_t last)
+  {
+    if (out.size() != last - first + 1)
+      return false;
+    for (std::size_t i = 0; i < out.size(); ++i)
+      if (out[i]->header.seq != first + i)
+        return false;
+    return true;
+  }
+
+  void resend_from_last_ack()
+  {
+    net::replay_buffer<frame_type> buffer(16);
+    CHECK(buffer.head() == 0);
+    fill(buffer, 10);
+    CHECK(buffer.head() == 10);
+
+    frames out;
+    auto result = buffer.collect(4, out);
+    CHECK(result.from == 4);
+    CHECK(result.to == 10);
+    CHECK(result.status == net::resume_status::complete);
+    CHECK(gap_free(out, 5, 10));
+
+    // Nothing missed
+    out.clear();
+    result = buffer.collect(10, out);
+    CHECK(result.from == 10 && result.to == 10);
+    CHECK(result.status == net::resume_status::complete);
+    CHECK(out.empty());
+
+    // Never saw a frame at all
+    out.clear();
+    result = buffer.collect(0, out);
+    CHECK(result.status == net::resume_status::complete);
+    CHECK(gap_free(out, 1, 10));
+  }
+
+  void overflow_is_partial()
+  {
+    net::replay_buffer<frame_type> buffer(8);
+    fill(buffer, 20);
+
+    // 4..12 fell out of the buffer, only 13..20 can be sent again
+    frames out;
+    const auto result = buffer.collect(3, out);
+    CHECK(result.status == net::resume_status::partial);
+    CHECK(result.from == 12);
+    CHECK(result.to == 20);
+    CHECK(gap_free(out, 13, 20));
+
+    // Just inside the buffer is still complete
+    out.clear();
+    CHECK(buffer.collect(12, out).status == net::resume_status::complete);
+    CHECK(gap_free(out, 13, 20));
+  }
+
+  void tokens_of_another_run()
+  {
+    net::session_tokens ours, theirs;
+    const uint64_t token = ours.issue();
+    CHECK(token != ours.issue());
+    CHECK(ours.known(token));
+    CHECK(theirs.known(theirs.issue()));
+    CHECK(!ours.known(theirs.issue()));    // a one in 2^31 chance of the same stream
+  }
+
+  void duplicate_seq_dropped()
+  {
+    net::session_tracker tracker;
+    tracker.on_ticket({ 5ull << 32 | 1, 0 });
+    CHECK(!tracker.resume_pending());
+
+    CHECK(tracker.on_sequenced(1));
+    CHECK(tracker.on_sequenced(2));
+    CHECK(tracker.on_sequenced(3));
+    CHECK(!tracker.on_sequenced(2));
+    CHECK(!tracker.on_sequenced(3));
+    CHECK(tracker.on_sequenced(0));    // not sequenced, always through
+    CHECK(tracker.ticket().seq == 3);
+  }
+
+  void resume_overlapping_live()
+  {
+    const uint64_t token = 5ull << 32 | 1;
+    net::session_tracker tracker;
+    tracker.restore({ token, 5 });
+    tracker.restore({ 1, 1 });    // a session is already there
+    CHECK(tracker.ticket().token == token);
+
+    tracker.on_reconnect();
+    CHECK(tracker.resume_pending());
+    tracker.on_ticket({ token + 1, 10 });
+    CHECK(tracker.ticket().token == token);    // not until the answer
+
+    // Live frames overtake the answer
+    CHECK(tracker.on_sequenced(9));
+    CHECK(tracker.on_sequenced(10));
+
+    tracker.on_resumed({ 5, 10, net::resume_status::complete });
+    CHECK(!tracker.resume_pending());
+    CHECK(tracker.ticket().token == token + 1);
+
+    CHECK(tracker.on_sequenced(6));
+    CHECK(!tracker.on_sequenced(6));
+    CHECK(tracker.on_sequenced(7));
+    CHECK(tracker.on_sequenced(8));
+    CHECK(!tracker.on_sequenced(9));
+    CHECK(!tracker.on_sequenced(10));
+    CHECK(tracker.ticket().seq == 10);
+
+    CHECK(tracker.on_sequenced(11));
+    CHECK(!tracker.on_sequenced(10));
+  }
+
+  void resume_with_nothing_missed()
+  {
+    const uint64_t token = 5ull << 32 | 1;
+    net::session_tracker tracker;
+    tracker.restore({ token, 5 });
+    tracker.on_reconnect();
+    tracker.on_ticket({ token + 1, 7 });
+    CHECK(tracker.on_sequenced(6));
+    CHECK(tracker.on_sequenced(7));
+    tracker.on_resumed({ 5, 5, net::resume_status::complete });
+    CHECK(tracker.ticket().seq == 7);
+    CHECK(!tracker.on_sequenced(7));
+    CHECK(tracker.on_sequenced(8));
+  }
+
+  void token_mismatch_starts_over()
+  {
+    // The server was restarted: the old token means nothing to it and the
+    // new stream's seq numbers have nothing to do with the old ones
+    net::session_tracker tracker;
+    tracker.restore({ 5ull << 32 | 1, 500 });
+    tracker.on_reconnect();
+    tracker.on_ticket({ 8ull << 32 | 1, 3 });
+    CHECK(tracker.on_sequenced(4));
+
+    tracker.on_resumed({ 3, 3, net::resume_status::unknown });
+    CHECK(tracker.ticket().token == (8ull << 32 | 1));
+    CHECK(tracker.ticket().seq == 4);
+    CHECK(!tracker.on_sequenced(4));
+    CHECK(tracker.on_sequenced(5));
+
+    // Likewise with no live frame in between
+    net::session_tracker quiet;
+    quiet.restore({ 5ull << 32 | 1, 500 });
+    quiet.on_reconnect();
+    quiet.on_ticket({ 8ull << 32 | 1, 3 });
+    quiet.on_resumed({ 3, 3, net::resume_status::unknown });
+    CHECK(quiet.ticket().seq == 3);
+    CHECK(quiet.on_sequenced(4));
+  }
+
+  void ticket_round_trip()
+  {
+    std::array<char, net::max_text_bytes> data{};
+    const net::session_ticket ticket{ 0x0102030405060708ull, 0x0a0b0c0du };
+    net::session_ticket back;
+    CHECK(net::session_ticket::decode(data, ticket.encode(data), back));
+    CHECK(back.token == ticket.token && back.seq == ticket.seq);
+    CHECK(!net::session_ticket::decode(data, 3, back));
+    CHECK(data[0] == '\x08' && data[7] == '\x01' && data[8] == '\x0d' && data[11] == '\x0a');    // little-endian
+
+    const net::resume_result result{ 12, 20, net::resume_status::partial };
+    net::resume_result rback;
+    CHECK(net::resume_result::decode(data, result.encode(data), rback));
+    CHECK(rback.from == 12 && rback.to == 20 && rback.status == net::resume_status::partial);
+  }
+}    // namespace session_test
+
+int main()
+{
+  session_test::resend_from_last_ack();
+  session_test::overflow_is_partial();
+  session_test::tokens_of_another_run();
+  session_test::duplicate_seq_dropped();
+  session_test::resume_overlapping_live();
+  session_test::resume_with_nothing_missed();
+  session_test::token_mismatch_starts_over();
+  session_test::ticket_round_trip();
+  return test_result();
+}
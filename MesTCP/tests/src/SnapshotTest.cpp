@@ -0,0 +1,162 @@
+// Snapshot lists: a version is freed as soon as no reader can still see it
+// and not before - whether the reader is this thread, a nested guard or
+// another thread - staged additions stay invisible until published together,
+// and readers iterating while a writer keeps publishing never see a freed
+// version (run under ASan to make that last one count).
+
+#include "net_snapshot.h"
+#include "test_check.h"
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+
+namespace snapshot_test {
+  // Every live version holds a reference to the tracked item, so its use
+  // count says how many versions are still around (plus the test's own)
+  using item = std::shared_ptr<int>;
+
+  long versions_holding(const item &tracked)
+  {
+    return tracked.use_count() - 1;
+  }
+
+  void reclaimed_without_readers()
+  {
+    net::snapshot_list<item> list;
+    const item tracked = std::make_shared<int>(1);
+    list.push_back(tracked);
+    CHECK(versions_holding(tracked) == 1);
+    for (int i = 0; i < 10; ++i)
+      list.push_back(std::make_shared<int>(i));
+    CHECK(versions_holding(tracked) == 1);
+    CHECK(list.size() == 11);
+  }
+
+  void kept_while_read()
+  {
+    net::snapshot_list<item> list;
+    const item tracked = std::make_shared<int>(1);
+    list.push_back(tracked);
+    {
+      auto guard = list.read();
+      const item *first = &guard->front();
+      for (int i = 0; i < 5; ++i)
+        list.push_back(std::make_shared<int>(i));
+
+      // The guarded version and every one retired since are still there
+      CHECK(versions_holding(tracked) == 6);
+      CHECK(guard->size() == 1 && &guard->front() == first && *guard->front() == 1);
+
+      // A nested guard doesn't end the outer one's protection on release
+      {
+        auto inner = list.read();
+        CHECK(inner->size() == 6);
+      }
+      list.push_back(std::make_shared<int>(9));
+      CHECK(versions_holding(tracked) == 7);
+    }
+
+    // The next publish after the last reader left frees them all
+    list.push_back(std::make_shared<int>(10));
+    CHECK(versions_holding(tracked) == 1);
+  }
+
+  void kept_for_another_thread()
+  {
+    net::snapshot_list<item> list;
+    const item tracked = std::make_shared<int>(1);
+    list.push_back(tracked);
+
+    std::mutex mux;
+    std::condition_variable cv;
+    int step = 0;
+    std::size_t seen = 0;
+    std::thread reader([&] {
+      auto guard = list.read();
+      std::unique_lock lock(mux);
+      step = 1;
+      cv.notify_all();
+      cv.wait(lock, [&] { return step == 2; });
+      seen = guard->size();
+    });
+
+    {
+      std::unique_lock lock(mux);
+      cv.wait(lock, [&] { return step == 1; });
+    }
+    for (int i = 0; i < 3; ++i)
+      list.push_back(std::make_shared<int>(i));
+    CHECK(versions_holding(tracked) == 4);
+    {
+      std::scoped_lock lock(mux);
+      step = 2;
+    }
+    cv.notify_all();
+    reader.join();
+    CHECK(seen == 1);
+
+    list.push_back(std::make_shared<int>(3));
+    CHECK(versions_holding(tracked) == 1);
+  }
+
+  void staged_and_removed()
+  {
+    net::snapshot_list<item> list;
+    list.stage(std::make_shared<int>(1));
+    list.stage(std::make_shared<int>(2));
+    CHECK(list.size() == 0);
+    list.publish_staged();
+    CHECK(list.size() == 2);
+    list.publish_staged();    // nothing staged
+    CHECK(list.size() == 2);
+
+    auto removed = list.remove_if([](const item &i) { return *i == 1; });
+    CHECK(removed.size() == 1 && *removed[0] == 1);
+    CHECK(list.size() == 1 && *list.read()->front() == 2);
+    CHECK(list.remove_if([](const item &i) { return *i == 7; }).empty());
+  }
+
+  void readers_during_writes()
+  {
+    net::snapshot_list<item> list;
+    std::atomic<bool> stop{ false };
+    std::atomic<long> sum{ 0 };
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; ++r)
+      readers.emplace_back([&] {
+        long local = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+          auto guard = list.read();
+          for (const item &i : *guard)
+            local += *i;
+        }
+        sum += local;
+      });
+
+    for (int i = 0; i < 2000; ++i) {
+      list.push_back(std::make_shared<int>(1));
+      if (i % 3 == 0)
+        list.remove_if([](const item &) { return true; });
+    }
+    stop = true;
+    for (auto &t : readers)
+      t.join();
+    CHECK(sum.load() >= 0);
+
+    // Every reader is gone, so one more publish leaves only the current version
+    const item tracked = std::make_shared<int>(0);
+    list.push_back(tracked);
+    list.push_back(std::make_shared<int>(0));
+    CHECK(versions_holding(tracked) == 1);
+  }
+}    // namespace snapshot_test
+
+int main()
+{
+  snapshot_test::reclaimed_without_readers();
+  snapshot_test::kept_while_read();
+  snapshot_test::kept_for_another_thread();
+  snapshot_test::staged_and_removed();
+  snapshot_test::readers_during_writes();
+  return test_result();
+}
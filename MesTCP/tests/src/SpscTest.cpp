@@ -0,0 +1,90 @@
+// The shard mailbox ring: full and empty are reported without losing or
+// consuming an item, indices wrap, and one producer and one consumer on two
+// threads see every item exactly once, in order.
+
+#include "net_spsc.h"
+#include "test_check.h"
+#include <memory>
+#include <thread>
+
+namespace spsc_test {
+  void full_and_empty()
+  {
+    net::spsc_ring<int, 4> ring;
+    int out = -1;
+    CHECK(ring.empty());
+    CHECK(!ring.try_pop(out) && out == -1);
+    for (int i = 0; i < 4; ++i)
+      CHECK(ring.try_push(int(i)));
+    CHECK(!ring.try_push(99));
+    CHECK(!ring.empty());
+
+    // Popping one makes room for one, and the rejected item was not stored
+    CHECK(ring.try_pop(out) && out == 0);
+    CHECK(ring.try_push(4));
+    for (int expect = 1; expect <= 4; ++expect)
+      CHECK(ring.try_pop(out) && out == expect);
+    CHECK(ring.empty());
+  }
+
+  void rejected_item_is_untouched()
+  {
+    net::spsc_ring<std::unique_ptr<int>, 2> ring;
+    CHECK(ring.try_push(std::make_unique<int>(1)));
+    CHECK(ring.try_push(std::make_unique<int>(2)));
+    auto item = std::make_unique<int>(3);
+    CHECK(!ring.try_push(std::move(item)));
+    CHECK(item && *item == 3);
+  }
+
+  void wraps_around()
+  {
+    net::spsc_ring<std::size_t, 8> ring;
+    std::size_t out = 0;
+    for (std::size_t i = 0; i < 1000; ++i) {
+      CHECK(ring.try_push(std::size_t(i)));
+      CHECK(ring.try_push(i + 1000000));
+      CHECK(ring.try_pop(out) && out == i);
+      CHECK(ring.try_pop(out) && out == i + 1000000);
+    }
+    CHECK(ring.empty());
+  }
+
+  void two_threads()
+  {
+    constexpr std::size_t count = 1000000;
+    net::spsc_ring<std::unique_ptr<std::size_t>, 64> ring;
+
+    std::thread producer([&]() {
+      for (std::size_t i = 0; i < count; ++i) {
+        auto item = std::make_unique<std::size_t>(i);
+        while (!ring.try_push(std::move(item)))
+          std::this_thread::yield();
+      }
+    });
+
+    std::size_t next = 0, out_of_order = 0;
+    std::unique_ptr<std::size_t> item;
+    while (next < count) {
+      if (!ring.try_pop(item)) {
+        std::this_thread::yield();
+        continue;
+      }
+      if (!item || *item != next)
+        ++out_of_order;
+      ++next;
+    }
+    producer.join();
+    CHECK(out_of_order == 0);
+    CHECK(ring.empty());
+  }
+}    // namespace spsc_test
+
+int main()
+{
+  spsc_test::full_and_empty();
+  spsc_test::rejected_item_is_untouched();
+  spsc_test::wraps_around();
+  spsc_test::two_threads();
+  return test_result();
+}
@@ -0,0 +1,105 @@
+// Token buckets: a bucket starts full, refills at its rate up to its burst
+// and no further, lets a cost larger than the whole bucket through once it
+// is full (leaving it in debt), and takes back what a refund returns. A
+// limit that is off, or a free message, always passes.
+
+#include "net_ratelimit.h"
+#include "test_check.h"
+
+namespace token_bucket_test {
+  using clock = net::token_bucket::clock;
+  using std::chrono::milliseconds;
+
+  void burst_then_rate()
+  {
+    const net::rate_limit limit{ 10, 5 };
+    net::token_bucket bucket;
+    const clock::time_point t0{};
+
+    // A full bucket's worth at once, then nothing
+    for (int i = 0; i < 5; ++i)
+      CHECK(bucket.try_take(limit, 1, t0));
+    CHECK(!bucket.try_take(limit, 1, t0));
+
+    // 10 a second: one token every 100 ms
+    CHECK(!bucket.try_take(limit, 1, t0 + milliseconds(99)));
+    CHECK(bucket.try_take(limit, 1, t0 + milliseconds(100)));
+    CHECK(!bucket.try_take(limit, 1, t0 + milliseconds(150)));
+    CHECK(bucket.try_take(limit, 1, t0 + milliseconds(200)));
+
+    // A long pause fills the bucket to its burst, not beyond
+    const clock::time_point later = t0 + std::chrono::seconds(60);
+    for (int i = 0; i < 5; ++i)
+      CHECK(bucket.try_take(limit, 1, later));
+    CHECK(!bucket.try_take(limit, 1, later));
+  }
+
+  void fractional_costs()
+  {
+    const net::rate_limit limit{ 4, 2 };
+    net::token_bucket bucket;
+    const clock::time_point t0{};
+    CHECK(bucket.try_take(limit, 0.5, t0));
+    CHECK(bucket.try_take(limit, 1.5, t0));
+    CHECK(!bucket.try_take(limit, 0.25, t0));
+    // 250 ms at 4 a second is one token
+    CHECK(bucket.try_take(limit, 1, t0 + milliseconds(250)));
+    CHECK(!bucket.try_take(limit, 0.25, t0 + milliseconds(250)));
+  }
+
+  void cost_beyond_burst()
+  {
+    // A broadcast costing more than the bucket holds waits for a full bucket
+    // and then puts it in debt, which takes a while to pay back
+    const net::rate_limit limit{ 10, 5 };
+    net::token_bucket bucket;
+    const clock::time_point t0{};
+    CHECK(bucket.try_take(limit, 1, t0));
+    CHECK(!bucket.try_take(limit, 20, t0));
+    CHECK(bucket.try_take(limit, 20, t0 + milliseconds(100)));    // full again
+    CHECK(!bucket.try_take(limit, 1, t0 + milliseconds(1500)));   // -15 + 14
+    CHECK(!bucket.try_take(limit, 1, t0 + milliseconds(1600)));   // -15 + 15
+    CHECK(bucket.try_take(limit, 1, t0 + milliseconds(1800)));    // -15 + 17
+  }
+
+  void refund()
+  {
+    const net::rate_limit limit{ 1, 2 };
+    net::token_bucket bucket;
+    const clock::time_point t0{};
+
+    // Nothing to give back before anything was taken
+    bucket.refund(5);
+    CHECK(bucket.try_take(limit, 2, t0));
+    CHECK(!bucket.try_take(limit, 1, t0));
+    bucket.refund(2);
+    CHECK(bucket.try_take(limit, 1, t0));
+    CHECK(bucket.try_take(limit, 1, t0));
+    CHECK(!bucket.try_take(limit, 1, t0));
+  }
+
+  void disabled_and_free()
+  {
+    net::token_bucket bucket;
+    const clock::time_point t0{};
+    const net::rate_limit off{};
+    for (int i = 0; i < 1000; ++i)
+      CHECK(bucket.try_take(off, 100, t0));
+
+    // A burst below one is one
+    const net::rate_limit shallow{ 1, 0 };
+    CHECK(bucket.try_take(shallow, 1, t0));
+    CHECK(!bucket.try_take(shallow, 1, t0));
+    CHECK(bucket.try_take(shallow, 0, t0));
+  }
+}    // namespace token_bucket_test
+
+int main()
+{
+  token_bucket_test::burst_then_rate();
+  token_bucket_test::fractional_costs();
+  token_bucket_test::cost_beyond_burst();
+  token_bucket_test::refund();
+  token_bucket_test::disabled_and_free();
+  return test_result();
+}
@@ -0,0 +1,170 @@
+// Topic subscriptions: the grammar for topics and patterns, the message
+// payload, and a trie that matches every topic to exactly the subscribers a
+// check of each pattern against it would find, through any mix of
+// subscribes and unsubscribes and with its match cache in play.
+
+#include "net_topic.h"
+#include "test_check.h"
+#include <random>
+#include <set>
+#include <string>
+
+namespace topic_test {
+  std::vector<std::string> levels(const std::string &s)
+  {
+    std::vector<std::string> out;
+    for (std::size_t start = 0;;) {
+      const std::size_t dot = s.find('.', start);
+      out.push_back(s.substr(start, dot == std::string::npos ? std::string::npos : dot - start));
+      if (dot == std::string::npos)
+        return out;
+      start = dot + 1;
+    }
+  }
+
+  // The grammar spelled out directly, level by level
+  bool brute_match(const std::string &pattern, const std::string &topic)
+  {
+    const std::vector<std::string> p = levels(pattern), t = levels(topic);
+    std::size_t i = 0;
+    for (; i < p.size(); ++i) {
+      if (p[i] == "#")
+        return true;
+      if (i >= t.size() || (p[i] != "*" && p[i] != t[i]))
+        return false;
+    }
+    return i == t.size();
+  }
+
+  void grammar()
+  {
+    CHECK(net::topic_valid("alerts.db.critical"));
+    CHECK(net::topic_valid("погода.москва"));
+    CHECK(!net::topic_valid(""));
+    CHECK(!net::topic_valid("a..b"));
+    CHECK(!net::topic_valid(".a"));
+    CHECK(!net::topic_valid("a."));
+    CHECK(!net::topic_valid("a.*"));
+    CHECK(!net::topic_valid("a.#"));
+    CHECK(!net::topic_valid("bad\xff"));
+    CHECK(!net::topic_valid(std::string(net::topic_max_bytes + 1, 'a')));
+
+    std::string deep = "a";
+    for (std::size_t i = 1; i < net::topic_max_levels; ++i)
+      deep += ".a";
+    CHECK(net::topic_valid(deep));
+    CHECK(!net::topic_valid(deep + ".a"));
+
+    CHECK(net::topic_pattern_valid("alerts.*.critical"));
+    CHECK(net::topic_pattern_valid("team.#"));
+    CHECK(net::topic_pattern_valid("#"));
+    CHECK(net::topic_pattern_valid("*"));
+    CHECK(!net::topic_pattern_valid("a.#.b"));
+    CHECK(!net::topic_pattern_valid("a.b*"));
+    CHECK(!net::topic_pattern_valid("a.#x"));
+  }
+
+  void payload()
+  {
+    std::array<char, net::max_text_bytes> data{};
+    const std::size_t size = net::topic_message{ "alerts.db", "disk full" }.encode(data);
+    net::topic_message out;
+    CHECK(net::topic_message::decode(data, size, out));
+    CHECK(out.topic == "alerts.db" && out.text == "disk full");
+
+    // A topic length running past the payload is malformed
+    CHECK(!net::topic_message::decode(data, 5, out));
+    CHECK(!net::topic_message::decode(data, 0, out));
+
+    // Text is cut to what fits after the topic
+    const std::string text(2000, 't');
+    CHECK(net::topic_message{ "a", text }.encode(data) == net::max_text_bytes);
+  }
+
+  void hash_matches_no_level_too()
+  {
+    net::topic_trie<int> trie;
+    CHECK(trie.subscribe("team.#", 1));
+    CHECK(trie.subscribe("team.*", 2));
+    CHECK(trie.subscribe("#", 3));
+    CHECK(!trie.subscribe("team.#", 1));    // already has it
+    CHECK(!trie.subscribe("a.#.b", 4));     // not a pattern
+
+    CHECK(*trie.match("team") == std::vector<int>({ 1, 3 }));
+    CHECK(*trie.match("team.ops") == std::vector<int>({ 1, 2, 3 }));
+    CHECK(*trie.match("team.ops.oncall") == std::vector<int>({ 1, 3 }));
+    CHECK(*trie.match("other") == std::vector<int>({ 3 }));
+
+    // A fan-out list held across a change keeps its contents
+    auto held = trie.match("team.ops");
+    CHECK(trie.unsubscribe("team.*", 2));
+    CHECK(!trie.unsubscribe("team.*", 2));
+    CHECK(*held == std::vector<int>({ 1, 2, 3 }));
+    CHECK(*trie.match("team.ops") == std::vector<int>({ 1, 3 }));
+  }
+
+  void against_brute_force()
+  {
+    std::mt19937 rng(7);
+    const char *words[] = { "a", "b", "c", "alerts", "db", "critical" };
+    auto random_topic = [&](bool pattern) {
+      std::string s;
+      const int n = 1 + rng() % 4;
+      for (int i = 0; i < n; ++i) {
+        if (i)
+          s += '.';
+        const int r = rng() % 10;
+        if (pattern && r == 0)
+          s += "*";
+        else if (pattern && r == 1 && i == n - 1)
+          s += "#";
+        else
+          s += words[rng() % 6];
+      }
+      return s;
+    };
+
+    net::topic_trie<int> trie;
+    std::set<std::pair<std::string, int>> subs;
+    int wrong = 0;
+    for (int step = 0; step < 20000; ++step) {
+      const int op = rng() % 3;
+      if (op == 0) {
+        const std::string pattern = random_topic(true);
+        const int who = rng() % 20;
+        wrong += trie.subscribe(pattern, who) != subs.insert({ pattern, who }).second;
+      }
+      else if (op == 1 && !subs.empty()) {
+        const auto sub = *std::next(subs.begin(), rng() % subs.size());
+        wrong += !trie.unsubscribe(sub.first, sub.second);
+        subs.erase(sub);
+        wrong += trie.unsubscribe(sub.first, sub.second);
+      }
+
+      const std::string topic = random_topic(false);
+      std::set<int> expect;
+      for (const auto &sub : subs)
+        if (brute_match(sub.first, topic))
+          expect.insert(sub.second);
+      // Each subscriber once, however many of its patterns match
+      auto got = trie.match(topic);
+      wrong += std::vector<int>(expect.begin(), expect.end()) != *got;
+    }
+    CHECK(wrong == 0);
+
+    // Emptied out, nothing matches anything any more
+    for (const auto &sub : subs)
+      trie.unsubscribe(sub.first, sub.second);
+    for (const char *word : words)
+      CHECK(trie.match(word)->empty());
+  }
+}    // namespace topic_test
+
+int main()
+{
+  topic_test::grammar();
+  topic_test::payload();
+  topic_test::hash_matches_no_level_too();
+  topic_test::against_brute_force();
+  return test_result();
+}
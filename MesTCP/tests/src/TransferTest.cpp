@@ -0,0 +1,189 @@
+// Credit accounting of a transfer: the sending side stops a window ahead of
+// what was credited and takes up no credit for bytes it never sent, the
+// receiving side only takes chunks in order and credits every quarter window
+// and at the end. A file streamed between the two, credit for credit, comes
+// out the same. A chunk frame too large for a buffer is split into pieces
+// with their offsets moved on.
+
+#include "net_transfer.h"
+#include "net_registry.h"
+#include "test_check.h"
+#include <chrono>
+#include <fstream>
+#include <string>
+
+namespace transfer_test {
+  std::filesystem::path scratch_dir()
+  {
+    const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+    return std::filesystem::temp_directory_path() / ("mestcp-transfer-test-" + std::to_string(now));
+  }
+
+  std::string pattern(std::size_t size)
+  {
+    std::string bytes(size, '\0');
+    for (std::size_t i = 0; i < size; ++i)
+      bytes[i] = static_cast<char>(i * 131 + i / 977);
+    return bytes;
+  }
+
+  void write_file(const std::filesystem::path &path, const std::string &bytes)
+  {
+    std::ofstream out(path, std::ios::binary);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+  }
+
+  std::string read_file(const std::filesystem::path &path)
+  {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+
+  void upload_window(const std::filesystem::path &dir)
+  {
+    const std::filesystem::path path = dir / "window.bin";
+    const std::size_t size = 3 * net::transfer_window + 100;
+    write_file(path, pattern(size));
+
+    net::upload_stream up;
+    CHECK(up.open(4, path));
+    CHECK(up.size() == size);
+
+    // A window's worth goes out, then nothing until credit comes
+    uint64_t sent = 0;
+    while (auto chunk = up.next_chunk()) {
+      CHECK(chunk->transfer == 4);
+      CHECK(chunk->offset == sent);
+      CHECK(chunk->bytes.size() <= net::transfer_chunk_bytes);
+      sent += chunk->bytes.size();
+    }
+    CHECK(sent >= net::transfer_window);
+    CHECK(sent < net::transfer_window + net::transfer_chunk_bytes);
+    CHECK(!up.done());
+
+    // Credit for another transfer, or for bytes never sent, opens nothing up
+    up.on_credit({ 5, sent });
+    CHECK(!up.next_chunk());
+    up.on_credit({ 4, size });
+    const uint64_t acked = sent;
+    CHECK(up.next_chunk());
+    sent += net::transfer_chunk_bytes;
+    while (up.next_chunk())
+      sent += net::transfer_chunk_bytes;
+    CHECK(sent - acked >= net::transfer_window);
+    CHECK(sent - acked < net::transfer_window + net::transfer_chunk_bytes);
+
+    // Older credit never takes back newer
+    up.on_credit({ 4, 10 });
+    CHECK(!up.next_chunk());
+  }
+
+  void download_credit(const std::filesystem::path &dir)
+  {
+    const std::string bytes = pattern(net::transfer_window / 2 + 10);
+    net::download_stream down;
+    CHECK(down.open(6, bytes.size(), dir / "credit.bin"));
+    CHECK(!down.credit_due());
+
+    // Out of order, another transfer, past the end: refused
+    CHECK(!down.write({ 6, 5, std::string_view(bytes).substr(5, 10) }));
+    CHECK(!down.write({ 7, 0, std::string_view(bytes).substr(0, 10) }));
+    CHECK(!down.write({ 6, 0, std::string_view(bytes.data(), bytes.size() + 1) }));
+    CHECK(down.received() == 0);
+
+    // Nothing due short of a quarter window
+    uint64_t offset = 0;
+    const std::size_t quarter = net::transfer_window / 4;
+    CHECK(down.write({ 6, offset, std::string_view(bytes).substr(0, quarter - 1) }));
+    offset += quarter - 1;
+    CHECK(!down.credit_due());
+    CHECK(down.write({ 6, offset, std::string_view(bytes).substr(offset, 1) }));
+    offset += 1;
+    auto credit = down.credit_due();
+    CHECK(credit && credit->transfer == 6 && credit->offset == quarter);
+    CHECK(!down.credit_due());
+
+    // The end is always credited
+    CHECK(down.write({ 6, offset, std::string_view(bytes).substr(offset) }));
+    CHECK(down.done());
+    credit = down.credit_due();
+    CHECK(credit && credit->offset == bytes.size());
+    CHECK(!down.credit_due());
+    CHECK(read_file(dir / "credit.bin") == bytes);
+  }
+
+  void stream_through(const std::filesystem::path &dir)
+  {
+    const std::string bytes = pattern(5 * net::transfer_window + 12345);
+    write_file(dir / "source.bin", bytes);
+
+    net::upload_stream up;
+    net::download_stream down;
+    CHECK(up.open(9, dir / "source.bin"));
+    CHECK(down.open(9, up.size(), dir / "copy.bin"));
+    std::size_t rounds = 0;
+    while (!up.done() && rounds++ < 10000) {
+      bool moved = false;
+      while (auto chunk = up.next_chunk()) {
+        CHECK(down.write(*chunk));
+        moved = true;
+      }
+      if (auto credit = down.credit_due()) {
+        up.on_credit(*credit);
+        moved = true;
+      }
+      if (!moved)
+        break;
+    }
+    CHECK(up.done());
+    CHECK(down.done());
+    CHECK(read_file(dir / "copy.bin") == bytes);
+  }
+
+  enum class frame_type : uint32_t {
+    chunk = 1,
+    credit = 2,
+  };
+
+  using protocol = net::message_registry<net::message_spec<frame_type::chunk, net::file_chunk>,
+                                         net::message_spec<frame_type::credit, net::file_credit>>;
+
+  void split_frames()
+  {
+    // Chunks may be announced up to a frame's worth, nothing else may
+    net::message_header<frame_type> header{ frame_type::chunk, 0, net::transfer_header_bytes + net::transfer_frame_bytes, 0 };
+    CHECK(protocol::accepts(header));
+    header.size += 1;
+    CHECK(!protocol::accepts(header));
+    header = { frame_type::credit, 0, net::max_text_bytes + 1, 0 };
+    CHECK(!protocol::accepts(header));
+    CHECK(protocol::split_of(frame_type::credit).head == 0);
+
+    // Every piece starts with the head, its offset moved on past the pieces
+    // before it
+    const net::split_rule rule = protocol::split_of(frame_type::chunk);
+    CHECK(rule.head == net::transfer_header_bytes);
+    std::array<char, net::max_text_bytes> data{};
+    net::file_chunk{ 3, 1000, {} }.encode(data);
+    CHECK(data[0] == 3 && data[4] == '\xe8' && data[5] == 3);    // little-endian
+    rule.advance(data.data(), net::transfer_chunk_bytes);
+    rule.advance(data.data(), 10);
+    net::file_chunk piece;
+    CHECK(net::file_chunk::decode(data, rule.head + 1, piece));
+    CHECK(piece.transfer == 3);
+    CHECK(piece.offset == 1000 + net::transfer_chunk_bytes + 10);
+  }
+}    // namespace transfer_test
+
+int main()
+{
+  const std::filesystem::path dir = transfer_test::scratch_dir();
+  std::filesystem::create_directories(dir);
+  transfer_test::upload_window(dir);
+  transfer_test::download_credit(dir);
+  transfer_test::stream_through(dir);
+  transfer_test::split_frames();
+  std::error_code ec;
+  std::filesystem::remove_all(dir, ec);
+  return test_result();
+}